@@ -0,0 +1,290 @@
+/*
+ * erl_i2c_bench.c
+ *
+ *  Created on: 09.09.2012
+ *      Author: Christian Adams <morlac78@googlemail.com>
+ *   Copyright: (c) 2012 by Christian Adams
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *   MA 02110-1301 USA.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "erl_i2c_cnode.h"
+
+/*
+ * microbenchmark of the request path of the C-Node without hardware -
+ * decoding the {call, From, Ref, Command} envelope, running a command
+ * through the dispatcher (without a bus and on a simulated one with no
+ * wire time) and encoding replies of several sizes
+ *
+ * usage: erl_i2c_bench [Iterations]
+ *
+ * prints ops/s and p50/p99/p999 latency (ns) per scenario
+ */
+
+#define BENCH_DEFAULT_ITERATIONS 1000000
+
+static t_cnode_state state = {
+		.erl_fd = -1,
+		.instances = 1,
+		.backend = &sim_backend,
+		.mainloop = true
+};
+
+static erlang_pid bench_pid;
+static erlang_ref bench_ref;
+
+// nothing is sent anywhere - the bench only looks at the encoding
+int send_reply(t_cnode_state* state, erlang_pid* to, ei_x_buff* reply) {
+	return 0;
+}
+
+static int compare_ns(const void* a, const void* b) {
+	unsigned long long x = *(const unsigned long long*) a;
+	unsigned long long y = *(const unsigned long long*) b;
+
+	return (x > y) - (x < y);
+}
+
+static void report(const char* name, unsigned long long* samples, long iterations,
+		unsigned long long total_ns) {
+	qsort(samples, iterations, sizeof(samples[0]), compare_ns);
+
+	printf("%-24s %12.0f ops/s   p50 %6llu ns   p99 %6llu ns   p999 %6llu ns\n",
+			name,
+			total_ns ? iterations * 1e9 / total_ns : 0.0,
+			samples[iterations / 2],
+			samples[(long)(iterations * 0.99)],
+			samples[(long)(iterations * 0.999)]);
+}
+
+// {call, Pid, Ref, Command} as the erlang side sends it
+static void encode_request(ei_x_buff* request, long data_len) {
+	request->index = 0;
+
+	ei_x_encode_version(request);
+	ei_x_encode_tuple_header(request, 4);
+	ei_x_encode_atom(request, "call");
+	ei_x_encode_pid(request, &bench_pid);
+	ei_x_encode_ref(request, &bench_ref);
+	ei_x_encode_tuple_header(request, 5);
+	ei_x_encode_atom(request, "read_byte");
+	ei_x_encode_long(request, 1);
+	ei_x_encode_long(request, 0x48);
+	ei_x_encode_long(request, 0);
+	ei_x_encode_long(request, data_len);
+}
+
+/*
+ * what the receiving loop does before a job is queued - envelope,
+ * command lookup and the job copy
+ */
+static void bench_envelope(long iterations, unsigned long long* samples) {
+	struct timespec start, end, first;
+	char tag[MAXATOMLEN_UTF8], command[MAXATOMLEN_UTF8];
+	int index, version, arity, ref_start, ref_end, term_end;
+	const t_command* cmd;
+	ei_x_buff request;
+	erlang_pid from;
+	t_job* job;
+	long i;
+
+	ei_x_new(&request);
+	encode_request(&request, 2);
+
+	clock_gettime(CLOCK_MONOTONIC, &first);
+
+	for (i = 0; i < iterations; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		index = 0;
+		ei_decode_version(request.buff, &index, &version);
+		ei_decode_tuple_header(request.buff, &index, &arity);
+		ei_decode_atom(request.buff, &index, tag);
+		ei_decode_pid(request.buff, &index, &from);
+
+		ref_start = ref_end = index;
+		ei_skip_term(request.buff, &ref_end);
+		term_end = index = ref_end;
+		ei_skip_term(request.buff, &term_end);
+
+		ei_decode_tuple_header(request.buff, &index, &arity);
+		ei_decode_atom(request.buff, &index, command);
+		cmd = find_command(command);
+
+		if ((job = new_job(&state, &from, request.buff + ref_start, ref_end - ref_start,
+				request.buff + ref_end, term_end - ref_end))) {
+			job->command = cmd;
+			free_job(&state, job);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		samples[i] = elapsed_ns(&start, &end);
+	}
+
+	report("envelope+job", samples, iterations, elapsed_ns(&first, &end));
+
+	ei_x_free(&request);
+}
+
+/*
+ * a whole job through run_job() - argument decoding, the dispatcher and
+ * the reply; with no bus open the command stops at no_open_bus, on a
+ * simulated bus it reads a word from the device at 0x48
+ */
+static void bench_run_job(long iterations, unsigned long long* samples, t_i2c_bus* i2c_bus) {
+	struct timespec start, end, first;
+	ei_x_buff request, reply;
+	t_job job;
+	int index, version, arity, ref_start;
+	long i;
+
+	ei_x_new(&request);
+	ei_x_new(&reply);
+	encode_request(&request, 2);
+
+	index = 0;
+	ei_decode_version(request.buff, &index, &version);
+	ei_decode_tuple_header(request.buff, &index, &arity);
+	ei_skip_term(request.buff, &index);
+	ei_skip_term(request.buff, &index);
+	ref_start = index;
+	ei_skip_term(request.buff, &index);
+
+	job.from = bench_pid;
+	job.ref_len = index - ref_start;
+	job.data = request.buff + ref_start;
+	job.len = request.index - ref_start;
+	job.command = find_command("read_byte");
+
+	clock_gettime(CLOCK_MONOTONIC, &first);
+
+	for (i = 0; i < iterations; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		job.received = job.queued = start;
+		run_job(&job, i2c_bus, &reply, &state);
+
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		samples[i] = elapsed_ns(&start, &end);
+	}
+
+	report(i2c_bus ? "run_job(simulated)" : "run_job(no_open_bus)",
+			samples, iterations, elapsed_ns(&first, &end));
+
+	ei_x_free(&request);
+	ei_x_free(&reply);
+}
+
+// {erl_i2c_cnode, Ref, {read_byte, ok, Len, <<Data>>}}
+static void bench_encode_reply(long iterations, unsigned long long* samples, long len) {
+	struct timespec start, end, first;
+	unsigned char data[I2C_MAX_DATA_LEN];
+	char name[32];
+	ei_x_buff reply;
+	long i;
+
+	memset(data, 0xa5, len);
+	ei_x_new(&reply);
+
+	clock_gettime(CLOCK_MONOTONIC, &first);
+
+	for (i = 0; i < iterations; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		reply.index = 0;
+		ei_x_encode_version(&reply);
+		ei_x_encode_tuple_header(&reply, 3);
+		ei_x_encode_atom(&reply, "erl_i2c_cnode");
+		ei_x_encode_ref(&reply, &bench_ref);
+		ei_x_encode_tuple_header(&reply, 4);
+		ei_x_encode_atom(&reply, "read_byte");
+		ei_x_encode_atom(&reply, "ok");
+		ei_x_encode_long(&reply, len);
+		ei_x_encode_binary(&reply, data, len);
+
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		samples[i] = elapsed_ns(&start, &end);
+	}
+
+	snprintf(name, sizeof(name), "encode_reply(%ld)", len);
+	report(name, samples, iterations, elapsed_ns(&first, &end));
+
+	ei_x_free(&reply);
+}
+
+int main(int argc, char** argv) {
+	long iterations = (argc > 1) ? atol(argv[1]) : BENCH_DEFAULT_ITERATIONS;
+	unsigned long long* samples;
+	t_i2c_bus* i2c_bus;
+
+	if (iterations < 1000) {
+		fprintf(stderr, "usage: erl_i2c_bench [Iterations >= 1000]\n");
+		return 1;
+	}
+
+	if (!(samples = malloc(iterations * sizeof(samples[0])))) {
+		perror("malloc");
+		return 1;
+	}
+
+	pthread_mutex_init(&state.lock, NULL);
+	pthread_mutex_init(&state.send_lock, NULL);
+	pthread_mutex_init(&state.pool_lock, NULL);
+
+	ei_init();
+	init_command_table();
+
+	strcpy(bench_pid.node, "bench@localhost");
+	bench_pid.num = 42;
+	bench_pid.serial = 0;
+	bench_pid.creation = 1;
+
+	strcpy(bench_ref.node, "bench@localhost");
+	bench_ref.len = 3;
+	bench_ref.n[0] = 1;
+	bench_ref.n[1] = 2;
+	bench_ref.n[2] = 3;
+	bench_ref.creation = 1;
+
+	printf("%ld iterations per scenario\n", iterations);
+
+	bench_envelope(iterations, samples);
+	bench_run_job(iterations, samples, NULL);
+
+	// the software path only - the simulated bus takes no wire time
+	sim_set_clock(0);
+
+	if ((i2c_bus = open_bus(1, &sim_backend))) {
+		bench_run_job(iterations, samples, i2c_bus);
+		release_bus(i2c_bus);
+	}
+
+	bench_encode_reply(iterations, samples, 2);
+	bench_encode_reply(iterations, samples, 32);
+	bench_encode_reply(iterations, samples, 256);
+	bench_encode_reply(iterations, samples, 8192);
+
+	// only while the pool and buffers warm up - none per iteration
+	printf("%lu allocations on the request path\n", state.allocations);
+
+	free(samples);
+
+	return 0;
+}
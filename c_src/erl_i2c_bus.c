@@ -0,0 +1,812 @@
+/*
+ * erl_i2c_bus.c
+ *
+ *  Created on: 09.09.2012
+ *      Author: Christian Adams <morlac78@googlemail.com>
+ *   Copyright: (c) 2012 by Christian Adams
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *   MA 02110-1301 USA.
+ *
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+
+#include "erl_i2c_cnode.h"
+
+/*
+ * the i2c-dev driver - handles are fds of /dev/i2c-N
+ */
+static int kernel_open(t_i2c_bus* i2c_bus) {
+	return open(i2c_bus->bus_device, O_RDWR);
+}
+
+static void kernel_close(t_i2c_bus* i2c_bus, int handle) {
+	close(handle);
+}
+
+static int kernel_funcs(t_i2c_bus* i2c_bus, int handle, unsigned long* funcs) {
+	return ioctl(handle, I2C_FUNCS, funcs);
+}
+
+static int kernel_set_address(t_i2c_bus* i2c_bus, int handle, int device_address) {
+	return ioctl(handle, I2C_SLAVE, device_address);
+}
+
+static int kernel_smbus(t_i2c_bus* i2c_bus, int handle, char read_write, __u8 command,
+		int size, union i2c_smbus_data* data) {
+	return i2c_smbus_access(handle, read_write, command, size, data);
+}
+
+static int kernel_rdwr(t_i2c_bus* i2c_bus, struct i2c_msg* msgs, int nmsgs) {
+	struct i2c_rdwr_ioctl_data rdwr;
+
+	rdwr.msgs = msgs;
+	rdwr.nmsgs = nmsgs;
+
+	return ioctl(i2c_bus->bus_fd, I2C_RDWR, &rdwr);
+}
+
+const t_bus_backend kernel_backend = {
+		.name = "kernel",
+		.open = kernel_open,
+		.close = kernel_close,
+		.funcs = kernel_funcs,
+		.set_address = kernel_set_address,
+		.smbus = kernel_smbus,
+		.rdwr = kernel_rdwr,
+		.release = NULL
+};
+
+t_i2c_bus* open_bus(int bus_number, const t_bus_backend* backend) {
+	t_i2c_bus *i2c_bus = NULL;
+	int i;
+
+	if (bus_number < 0 || bus_number >= I2C_MAX_BUSES) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (!(i2c_bus = (t_i2c_bus*)calloc(1, sizeof(t_i2c_bus)))) {
+		return NULL;
+	}
+
+	i2c_bus->backend = backend;
+	i2c_bus->bus_number = bus_number;
+
+	if (asprintf(&i2c_bus->bus_device, "/dev/i2c-%d", bus_number) < 0) {
+		free(i2c_bus);
+		return NULL;
+	}
+
+	if ((i2c_bus->bus_fd = backend->open(i2c_bus)) < 0) {
+		if (backend->release) {
+			backend->release(i2c_bus);
+		}
+
+		free(i2c_bus->bus_device);
+		free(i2c_bus);
+		return NULL;
+	}
+
+	i2c_bus->device_address = 0;
+	i2c_bus->device_register = 0;
+	i2c_bus->refs = 1;
+	i2c_bus->stats = new_stats();
+
+	// an adapter that can't tell is assumed to do what every
+	// transfer relied on before - SMBus blocks and I2C_RDWR
+	if (backend->funcs(i2c_bus, i2c_bus->bus_fd, &i2c_bus->funcs) < 0) {
+		i2c_bus->funcs = I2C_FUNC_I2C | I2C_FUNC_SMBUS_I2C_BLOCK;
+	}
+
+	i2c_bus->rdwr_unsupported = !(i2c_bus->funcs & I2C_FUNC_I2C);
+
+	// allocated with the bus rather than per write - the scratch buffer
+	// of the thread may hold a read waiting for held back writes
+	if ((i2c_bus->funcs & I2C_FUNC_I2C) &&
+			!(i2c_bus->funcs & (I2C_FUNC_NOSTART | I2C_FUNC_PROTOCOL_MANGLING)) &&
+			!(i2c_bus->write_msg = (__u8*) malloc(I2C_RDWR_MAX_LEN))) {
+		backend->close(i2c_bus, i2c_bus->bus_fd);
+
+		if (backend->release) {
+			backend->release(i2c_bus);
+		}
+
+		free(i2c_bus->stats);
+		free(i2c_bus->bus_device);
+		free(i2c_bus);
+		return NULL;
+	}
+
+	for (i = 0; i < I2C_MAX_DEVICES; i++) {
+		i2c_bus->device_fds[i] = -1;
+	}
+
+	pthread_mutex_init(&i2c_bus->lock, NULL);
+
+	return i2c_bus;
+}
+
+void destroy_bus(t_i2c_bus* i2c_bus) {
+	const t_bus_backend* backend = i2c_bus->backend;
+	int i;
+
+	destroy_worker(&i2c_bus->worker);
+	free_write_buffers(i2c_bus);
+	free_shadows(i2c_bus);
+
+	for (i = 0; i < I2C_MAX_DEVICES; i++) {
+		if (i2c_bus->device_fds[i] >= 0) {
+			backend->close(i2c_bus, i2c_bus->device_fds[i]);
+		}
+	}
+
+	backend->close(i2c_bus, i2c_bus->bus_fd);
+
+	if (backend->release) {
+		backend->release(i2c_bus);
+	}
+
+	pthread_mutex_destroy(&i2c_bus->lock);
+
+	free(i2c_bus->write_msg);
+	free(i2c_bus->stats);
+	free(i2c_bus->bus_device);
+	free(i2c_bus);
+}
+
+/*
+ * returns the open bus with a reference taken - to be given back
+ * with release_bus()
+ */
+t_i2c_bus* acquire_bus(int bus_number, t_cnode_state* state) {
+	t_i2c_bus* i2c_bus = NULL;
+
+	if (bus_number < 0 || bus_number >= I2C_MAX_BUSES) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&state->lock);
+
+	if ((i2c_bus = state->i2c_buses[bus_number])) {
+		__atomic_add_fetch(&i2c_bus->refs, 1, __ATOMIC_ACQ_REL);
+	}
+
+	pthread_mutex_unlock(&state->lock);
+
+	return i2c_bus;
+}
+
+/*
+ * the last one closes the light
+ */
+void release_bus(t_i2c_bus* i2c_bus) {
+	if (i2c_bus && __atomic_sub_fetch(&i2c_bus->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		destroy_bus(i2c_bus);
+	}
+}
+
+/*
+ * the table takes over the reference open_bus() returned
+ */
+int add_bus(t_i2c_bus* i2c_bus, t_cnode_state* state) {
+	pthread_mutex_lock(&state->lock);
+
+	if (state->i2c_buses[i2c_bus->bus_number]) {
+		pthread_mutex_unlock(&state->lock);
+		return -1;
+	}
+
+	state->i2c_buses[i2c_bus->bus_number] = i2c_bus;
+	state->open_buses++;
+
+	pthread_mutex_unlock(&state->lock);
+
+	return 0;
+}
+
+/*
+ * takes the bus out of the table - the reference of the table is
+ * handed to the caller
+ */
+t_i2c_bus* remove_bus(int bus_number, t_cnode_state* state) {
+	t_i2c_bus *i2c_bus = NULL;
+
+	if (bus_number < 0 || bus_number >= I2C_MAX_BUSES) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&state->lock);
+
+	if ((i2c_bus = state->i2c_buses[bus_number])) {
+		state->i2c_buses[bus_number] = NULL;
+		state->open_buses--;
+	}
+
+	pthread_mutex_unlock(&state->lock);
+
+	return i2c_bus;
+}
+
+bool any_bus_open(t_cnode_state* state) {
+	bool open;
+
+	pthread_mutex_lock(&state->lock);
+	open = (state->open_buses > 0);
+	pthread_mutex_unlock(&state->lock);
+
+	return open;
+}
+
+int i2c_set_address(t_i2c_bus* i2c_bus, int handle, int device_address) {
+	return i2c_bus->backend->set_address(i2c_bus, handle, device_address);
+}
+
+/*
+ * returns the handle bound to the device for smbus-transfers - opened
+ * and bound on first use, after that it's just a table lookup;
+ * i2c_bus->lock must be held
+ */
+int i2c_device_fd(t_i2c_bus* i2c_bus, int device_address) {
+	int device_fd;
+
+	if (device_address < 0 || device_address >= I2C_MAX_DEVICES) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if ((device_fd = i2c_bus->device_fds[device_address]) < 0) {
+		if ((device_fd = i2c_bus->backend->open(i2c_bus)) < 0) {
+			return -1;
+		}
+
+		if (i2c_set_address(i2c_bus, device_fd, device_address) < 0) {
+			i2c_bus->backend->close(i2c_bus, device_fd);
+			return -1;
+		}
+
+		i2c_bus->device_fds[device_address] = device_fd;
+	}
+
+	return device_fd;
+}
+
+/*
+ * every transfer on a bus goes through backend_rdwr() or
+ * backend_smbus() - the time spent in them adds up per thread, the
+ * stats take it as the ioctl phase of the request running
+ */
+static __thread unsigned long long ioctl_ns = 0;
+
+unsigned long long bus_ioctl_ns(void) {
+	return ioctl_ns;
+}
+
+// started and done (may be NULL) get the timestamps for the trace
+static int backend_rdwr(t_i2c_bus* i2c_bus, struct i2c_msg* msgs, int nmsgs,
+		struct timespec* started, struct timespec* done) {
+	struct timespec from, to;
+	int result;
+
+	clock_gettime(CLOCK_MONOTONIC, &from);
+	result = i2c_bus->backend->rdwr(i2c_bus, msgs, nmsgs);
+	clock_gettime(CLOCK_MONOTONIC, &to);
+
+	ioctl_ns += elapsed_ns(&from, &to);
+
+	if (started) {
+		*started = from;
+		*done = to;
+	}
+
+	return result;
+}
+
+static int backend_smbus(t_i2c_bus* i2c_bus, int handle, char read_write, __u8 command,
+		int size, union i2c_smbus_data* data) {
+	struct timespec started, done;
+	int result;
+
+	clock_gettime(CLOCK_MONOTONIC, &started);
+	result = i2c_bus->backend->smbus(i2c_bus, handle, read_write, command, size, data);
+	clock_gettime(CLOCK_MONOTONIC, &done);
+
+	ioctl_ns += elapsed_ns(&started, &done);
+
+	return result;
+}
+
+/*
+ * runs all messages as one combined transfer with repeated starts
+ * and only one stop at the end
+ */
+int i2c_rdwr(t_i2c_bus* i2c_bus, struct i2c_msg* msgs, int nmsgs) {
+	struct timespec started, done;
+	int result;
+
+	result = backend_rdwr(i2c_bus, msgs, nmsgs, &started, &done);
+
+	if (!i2c_bus->trace) {
+		return result;
+	}
+
+	trace_rdwr(i2c_bus->trace, i2c_bus, msgs, nmsgs, &started, &done, result);
+
+	return result;
+}
+
+/*
+ * the SMBus transfers of i2c-dev.h on the backend of the bus - same
+ * results, -1 with errno set on errors
+ */
+static __s32 smbus_write_quick(t_i2c_bus* i2c_bus, int handle, __u8 value) {
+	return backend_smbus(i2c_bus, handle, value, 0, I2C_SMBUS_QUICK, NULL);
+}
+
+static __s32 smbus_read_byte(t_i2c_bus* i2c_bus, int handle) {
+	union i2c_smbus_data data;
+
+	if (backend_smbus(i2c_bus, handle, I2C_SMBUS_READ, 0, I2C_SMBUS_BYTE, &data)) {
+		return -1;
+	}
+
+	return data.byte;
+}
+
+static __s32 smbus_read_byte_data(t_i2c_bus* i2c_bus, int handle, __u8 command) {
+	union i2c_smbus_data data;
+
+	if (backend_smbus(i2c_bus, handle, I2C_SMBUS_READ, command,
+			I2C_SMBUS_BYTE_DATA, &data)) {
+		return -1;
+	}
+
+	return data.byte;
+}
+
+static __s32 smbus_write_byte_data(t_i2c_bus* i2c_bus, int handle, __u8 command, __u8 value) {
+	union i2c_smbus_data data;
+
+	data.byte = value;
+
+	return backend_smbus(i2c_bus, handle, I2C_SMBUS_WRITE, command,
+			I2C_SMBUS_BYTE_DATA, &data);
+}
+
+static __s32 smbus_read_word_data(t_i2c_bus* i2c_bus, int handle, __u8 command) {
+	union i2c_smbus_data data;
+
+	if (backend_smbus(i2c_bus, handle, I2C_SMBUS_READ, command,
+			I2C_SMBUS_WORD_DATA, &data)) {
+		return -1;
+	}
+
+	return data.word;
+}
+
+static __s32 smbus_write_word_data(t_i2c_bus* i2c_bus, int handle, __u8 command, __u16 value) {
+	union i2c_smbus_data data;
+
+	data.word = value;
+
+	return backend_smbus(i2c_bus, handle, I2C_SMBUS_WRITE, command,
+			I2C_SMBUS_WORD_DATA, &data);
+}
+
+static __s32 smbus_read_i2c_block_data(t_i2c_bus* i2c_bus, int handle, __u8 command,
+		__u8 length, __u8* values) {
+	union i2c_smbus_data data;
+
+	if (length > I2C_SMBUS_I2C_BLOCK_MAX) {
+		length = I2C_SMBUS_I2C_BLOCK_MAX;
+	}
+
+	data.block[0] = length;
+
+	if (backend_smbus(i2c_bus, handle, I2C_SMBUS_READ, command,
+			length == I2C_SMBUS_I2C_BLOCK_MAX ? I2C_SMBUS_I2C_BLOCK_BROKEN : I2C_SMBUS_I2C_BLOCK_DATA,
+			&data)) {
+		return -1;
+	}
+
+	memcpy(values, data.block + 1, data.block[0]);
+
+	return data.block[0];
+}
+
+static __s32 smbus_write_i2c_block_data(t_i2c_bus* i2c_bus, int handle, __u8 command,
+		__u8 length, const __u8* values) {
+	union i2c_smbus_data data;
+
+	if (length > I2C_SMBUS_I2C_BLOCK_MAX) {
+		length = I2C_SMBUS_I2C_BLOCK_MAX;
+	}
+
+	data.block[0] = length;
+	memcpy(data.block + 1, values, length);
+
+	return backend_smbus(i2c_bus, handle, I2C_SMBUS_WRITE, command,
+			I2C_SMBUS_I2C_BLOCK_BROKEN, &data);
+}
+
+/*
+ * one probe of a scan - a quick write or a read byte on the unbound fd,
+ * bound to the address for it (I2C_RDWR doesn't care what it's bound
+ * to); traced as a transaction of its own. An address used by a kernel
+ * driver isn't probed and counts as present
+ *
+ * returns >= 0 if something answered, -1 otherwise; i2c_bus->lock must
+ * be held
+ */
+int i2c_probe(t_i2c_bus* i2c_bus, int address, bool quick) {
+	struct timespec started, done;
+	__u8 data = 0;
+	int result;
+
+	if (i2c_set_address(i2c_bus, i2c_bus->bus_fd, address) < 0) {
+		return (errno == EBUSY) ? 0 : -1;
+	}
+
+	if (i2c_bus->trace) {
+		clock_gettime(CLOCK_MONOTONIC, &started);
+	}
+
+	if (quick) {
+		result = smbus_write_quick(i2c_bus, i2c_bus->bus_fd, I2C_SMBUS_WRITE);
+	} else if ((result = smbus_read_byte(i2c_bus, i2c_bus->bus_fd)) >= 0) {
+		data = result;
+	}
+
+	if (i2c_bus->trace) {
+		clock_gettime(CLOCK_MONOTONIC, &done);
+		trace_data(i2c_bus->trace, TRACE_PROBE, i2c_bus, address,
+				quick ? TRACE_PROBE_QUICK : TRACE_PROBE_READ, &started, &done, result,
+				&data, quick ? 0 : 1);
+	}
+
+	return result;
+}
+
+/*
+ * probes every 7-bit address outside the reserved ones (0x03 .. 0x77)
+ * the way i2cdetect does - a quick write where it's safe and the
+ * adapter can do it, a read byte otherwise (quick writes are known to
+ * corrupt some EEPROMs and to lock up some sensors); addresses used by
+ * a kernel driver count as present
+ *
+ * fills i2c_bus->inventory and returns the number of devices found or
+ * -1; takes i2c_bus->lock per address so other requests aren't held
+ * up for the whole scan
+ */
+int i2c_scan(t_i2c_bus* i2c_bus) {
+	unsigned char inventory[I2C_MAX_DEVICES / 8];
+	unsigned long funcs = i2c_bus->funcs;
+	int address, result, found = 0;
+	bool quick;
+
+	if (!(funcs & (I2C_FUNC_SMBUS_QUICK | I2C_FUNC_SMBUS_READ_BYTE))) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	memset(inventory, 0, sizeof(inventory));
+
+	for (address = 0x03; address <= 0x77; address++) {
+		quick = (funcs & I2C_FUNC_SMBUS_QUICK) &&
+				!((address >= 0x30 && address <= 0x37) || (address >= 0x50 && address <= 0x5f));
+
+		if (!quick && !(funcs & I2C_FUNC_SMBUS_READ_BYTE)) {
+			continue;
+		}
+
+		pthread_mutex_lock(&i2c_bus->lock);
+		result = i2c_probe(i2c_bus, address, quick);
+		pthread_mutex_unlock(&i2c_bus->lock);
+
+		if (result >= 0) {
+			inventory[address / 8] |= 0x80 >> (address % 8);
+			found++;
+		}
+	}
+
+	pthread_mutex_lock(&i2c_bus->lock);
+	memcpy(i2c_bus->inventory, inventory, sizeof(inventory));
+	i2c_bus->scanned = true;
+	pthread_mutex_unlock(&i2c_bus->lock);
+
+	return found;
+}
+
+/*
+ * the register-counting fallback for adapters without I2C_RDWR - 32
+ * byte SMBus blocks, or single bytes where even those are missing;
+ * neither can go beyond register 255
+ */
+static int smbus_read_chunks(t_i2c_bus* i2c_bus, int device_fd,
+		int device_register, int len, __u8* data) {
+	int offset, chunk, result;
+
+	if (device_register + len > I2C_MAX_REGISTERS) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	for (offset = 0; offset < len; offset += chunk) {
+		if (i2c_bus->funcs & I2C_FUNC_SMBUS_READ_I2C_BLOCK) {
+			chunk = (len - offset > I2C_SMBUS_I2C_BLOCK_MAX) ? I2C_SMBUS_I2C_BLOCK_MAX : len - offset;
+
+			if ((chunk = smbus_read_i2c_block_data(i2c_bus, device_fd, device_register + offset,
+					chunk, data + offset)) <= 0) {
+				return -1;
+			}
+		} else {
+			if ((result = smbus_read_byte_data(i2c_bus, device_fd, device_register + offset)) < 0) {
+				return -1;
+			}
+
+			data[offset] = result;
+			chunk = 1;
+		}
+	}
+
+	return len;
+}
+
+static int smbus_write_chunks(t_i2c_bus* i2c_bus, int device_fd,
+		int device_register, int len, const __u8* data) {
+	int offset, chunk;
+
+	if (device_register + len > I2C_MAX_REGISTERS) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	for (offset = 0; offset < len; offset += chunk) {
+		if (i2c_bus->funcs & I2C_FUNC_SMBUS_WRITE_I2C_BLOCK) {
+			chunk = (len - offset > I2C_SMBUS_I2C_BLOCK_MAX) ? I2C_SMBUS_I2C_BLOCK_MAX : len - offset;
+
+			if (smbus_write_i2c_block_data(i2c_bus, device_fd, device_register + offset,
+					chunk, data + offset) < 0) {
+				return -1;
+			}
+		} else {
+			if (smbus_write_byte_data(i2c_bus, device_fd, device_register + offset, data[offset]) < 0) {
+				return -1;
+			}
+
+			chunk = 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * reads len bytes starting at device_register with the cheapest
+ * transfer the adapter can do - byte data for one byte, word data for
+ * two, one SMBus block read up to 32 bytes, longer as I2C_RDWR
+ * (register pointer write, then reads of up to I2C_RDWR_MAX_LEN
+ * continuing where the device's pointer is); adapters without
+ * I2C_RDWR get SMBus blocks with the register counted up
+ *
+ * returns the number of bytes read or -1
+ */
+static int read_data(t_i2c_bus* i2c_bus, int device_fd, int device_address,
+		int device_register, int len, __u8* data) {
+	struct i2c_msg msgs[2];
+	__u8 reg = device_register;
+	int offset = 0, chunk, result;
+
+	if (len == 1 && (i2c_bus->funcs & I2C_FUNC_SMBUS_READ_BYTE_DATA)) {
+		if ((result = smbus_read_byte_data(i2c_bus, device_fd, device_register)) < 0) {
+			return -1;
+		}
+
+		data[0] = result;
+
+		return 1;
+	}
+
+	// SMBus words are little endian - the low byte is the first on the wire
+	if (len == 2 && (i2c_bus->funcs & I2C_FUNC_SMBUS_READ_WORD_DATA)) {
+		if ((result = smbus_read_word_data(i2c_bus, device_fd, device_register)) < 0) {
+			return -1;
+		}
+
+		data[0] = result & 0xff;
+		data[1] = (result >> 8) & 0xff;
+
+		return 2;
+	}
+
+	if (len <= I2C_SMBUS_I2C_BLOCK_MAX && (i2c_bus->funcs & I2C_FUNC_SMBUS_READ_I2C_BLOCK)) {
+		return smbus_read_i2c_block_data(i2c_bus, device_fd, device_register, len, data);
+	}
+
+	if (!i2c_bus->rdwr_unsupported) {
+		while (offset < len) {
+			chunk = (len - offset > I2C_RDWR_MAX_LEN) ? I2C_RDWR_MAX_LEN : len - offset;
+
+			msgs[0].addr = device_address;
+			msgs[0].flags = 0;
+			msgs[0].len = 1;
+			msgs[0].buf = (char*) &reg;
+
+			msgs[1].addr = device_address;
+			msgs[1].flags = I2C_M_RD;
+			msgs[1].len = chunk;
+			msgs[1].buf = (char*) data + offset;
+
+			// the register pointer is only set for the first chunk
+			if (backend_rdwr(i2c_bus, offset ? msgs + 1 : msgs, offset ? 1 : 2, NULL, NULL) >= 0) {
+				offset += chunk;
+			} else if (errno == EOPNOTSUPP && offset == 0) {
+				i2c_bus->rdwr_unsupported = true;
+				break;
+			} else {
+				return -1;
+			}
+		}
+
+		if (offset == len) {
+			return len;
+		}
+	}
+
+	return smbus_read_chunks(i2c_bus, device_fd, device_register, len, data);
+}
+
+/*
+ * a write as I2C_RDWR - the register byte, then the data in messages of
+ * up to I2C_RDWR_MAX_LEN continued with I2C_M_NOSTART, so the device
+ * sees one write however long it is (a new start would make it take
+ * the next byte for a register). Adapters that can't leave out the
+ * start get a single message with the register in front of the data,
+ * put together in i2c_bus->write_msg
+ */
+static int rdwr_write_data(t_i2c_bus* i2c_bus, int device_address,
+		int device_register, int len, const __u8* data) {
+	struct i2c_msg msgs[I2C_RDWR_MAX_MSGS];
+	__u8 reg = device_register;
+	int nmsgs, offset;
+
+	if (i2c_bus->funcs & (I2C_FUNC_NOSTART | I2C_FUNC_PROTOCOL_MANGLING)) {
+		if (len > (I2C_RDWR_MAX_MSGS - 1) * I2C_RDWR_MAX_LEN) {
+			errno = EMSGSIZE;
+			return -1;
+		}
+
+		msgs[0].addr = device_address;
+		msgs[0].flags = 0;
+		msgs[0].len = 1;
+		msgs[0].buf = (char*) &reg;
+
+		for (nmsgs = 1, offset = 0; offset < len; nmsgs++) {
+			msgs[nmsgs].addr = device_address;
+			msgs[nmsgs].flags = I2C_M_NOSTART;
+			msgs[nmsgs].len = (len - offset > I2C_RDWR_MAX_LEN) ? I2C_RDWR_MAX_LEN : len - offset;
+			msgs[nmsgs].buf = (char*) data + offset;
+
+			offset += msgs[nmsgs].len;
+		}
+
+		return backend_rdwr(i2c_bus, msgs, nmsgs, NULL, NULL);
+	}
+
+	if (len + 1 > I2C_RDWR_MAX_LEN) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	i2c_bus->write_msg[0] = device_register;
+	memcpy(i2c_bus->write_msg + 1, data, len);
+
+	msgs[0].addr = device_address;
+	msgs[0].flags = 0;
+	msgs[0].len = len + 1;
+	msgs[0].buf = (char*) i2c_bus->write_msg;
+
+	return backend_rdwr(i2c_bus, msgs, 1, NULL, NULL);
+}
+
+/*
+ * writes len bytes starting at device_register with the cheapest
+ * transfer the adapter can do - byte data for one byte, word data for
+ * two, one SMBus block write up to 32 bytes, longer as I2C_RDWR (see
+ * rdwr_write_data()); adapters without I2C_RDWR get SMBus blocks with
+ * the register counted up
+ *
+ * returns 0 or -1
+ */
+static int write_data(t_i2c_bus* i2c_bus, int device_fd, int device_address,
+		int device_register, int len, const __u8* data) {
+	if (len == 1 && (i2c_bus->funcs & I2C_FUNC_SMBUS_WRITE_BYTE_DATA)) {
+		return smbus_write_byte_data(i2c_bus, device_fd, device_register, data[0]) < 0 ? -1 : 0;
+	}
+
+	if (len == 2 && (i2c_bus->funcs & I2C_FUNC_SMBUS_WRITE_WORD_DATA)) {
+		return smbus_write_word_data(i2c_bus, device_fd, device_register,
+				data[0] | (data[1] << 8)) < 0 ? -1 : 0;
+	}
+
+	if (len <= I2C_SMBUS_I2C_BLOCK_MAX && (i2c_bus->funcs & I2C_FUNC_SMBUS_WRITE_I2C_BLOCK)) {
+		return smbus_write_i2c_block_data(i2c_bus, device_fd, device_register, len, data) < 0 ? -1 : 0;
+	}
+
+	if (!i2c_bus->rdwr_unsupported) {
+		if (rdwr_write_data(i2c_bus, device_address, device_register, len, data) >= 0) {
+			return 0;
+		}
+
+		if (errno != EOPNOTSUPP) {
+			return -1;
+		}
+
+		i2c_bus->rdwr_unsupported = true;
+	}
+
+	return smbus_write_chunks(i2c_bus, device_fd, device_register, len, data);
+}
+
+/*
+ * read_data() and write_data() as one traced transaction each, however
+ * many transfers they take; i2c_bus->lock must be held
+ */
+int i2c_read_data(t_i2c_bus* i2c_bus, int device_fd, int device_address,
+		int device_register, int len, __u8* data) {
+	struct timespec started, done;
+	int result;
+
+	if (!i2c_bus->trace) {
+		return read_data(i2c_bus, device_fd, device_address, device_register, len, data);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &started);
+	result = read_data(i2c_bus, device_fd, device_address, device_register, len, data);
+	clock_gettime(CLOCK_MONOTONIC, &done);
+
+	trace_data(i2c_bus->trace, TRACE_READ, i2c_bus, device_address, device_register,
+			&started, &done, result, data, len);
+
+	return result;
+}
+
+int i2c_write_data(t_i2c_bus* i2c_bus, int device_fd, int device_address,
+		int device_register, int len, const __u8* data) {
+	struct timespec started, done;
+	int result;
+
+	if (!i2c_bus->trace) {
+		return write_data(i2c_bus, device_fd, device_address, device_register, len, data);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &started);
+	result = write_data(i2c_bus, device_fd, device_address, device_register, len, data);
+	clock_gettime(CLOCK_MONOTONIC, &done);
+
+	trace_data(i2c_bus->trace, TRACE_WRITE, i2c_bus, device_address, device_register,
+			&started, &done, result, data, len);
+
+	return result;
+}
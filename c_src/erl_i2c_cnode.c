@@ -21,41 +21,26 @@
  *   MA 02110-1301 USA.
  *
  */
-#define _GNU_SOURCE
-
 #include <errno.h>
-#include <stdbool.h>
+#include <getopt.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <fcntl.h>
 #include <unistd.h>
 
-#include "erl_interface.h"
-#include "ei.h"
-
-#include <sys/ioctl.h>
-
-#include "include/linux/i2c-dev.h"
+#include <sys/socket.h>
+#include <netinet/in.h>
 
-#ifndef __u8
-typedef unsigned char __u8;
-#endif
-
-#define BUFSIZE 4096
-#define PORTBASE 4200
+#include "erl_i2c_cnode.h"
 
-typedef struct s_i2c_bus {
-	int bus_number;
-	char* bus_device;
-	int bus_fd;
-	char device_address;
-	char device_register;
-	struct s_i2c_bus *next;
-} t_i2c_bus;
-
-int erl_i2c_listen(int port) {
+/*
+ * listens on *port - 0 lets the kernel pick a free one, which is
+ * written back to *port
+ */
+int erl_i2c_listen(int* port) {
 	int listen_fd;
 	struct sockaddr_in addr;
+	socklen_t addr_len = sizeof(addr);
 	int on = 1;
 
 	if ((listen_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
@@ -67,866 +52,709 @@ int erl_i2c_listen(int port) {
 	memset((void*) &addr, 0, (size_t) sizeof(addr));
 
 	addr.sin_family = AF_INET;
-	addr.sin_port = htons(port);
+	addr.sin_port = htons(*port);
 	addr.sin_addr.s_addr = htonl(INADDR_ANY);
 
-	if (bind(listen_fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+	if (bind(listen_fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+			getsockname(listen_fd, (struct sockaddr*) &addr, &addr_len) < 0) {
+		close(listen_fd);
 		return (-1);
 	}
 
+	*port = ntohs(addr.sin_port);
+
 	listen(listen_fd, 5);
 
 	return listen_fd;
 }
 
-t_i2c_bus* get_bus(int bus_number, t_i2c_bus* i2c_bus_list) {
-	t_i2c_bus* i2c_bus = i2c_bus_list;
+/*
+ * replies and samples are sent from all workers over the one
+ * connection to the erlang node - in port mode messages for other
+ * processes (samples) go to the frontend as <<0:32, {Pid, Message}>>
+ */
+int send_reply(t_cnode_state* state, erlang_pid* to, ei_x_buff* reply) {
+	ei_x_buff* packet;
+	int result;
+
+	if (state->port) {
+		packet = scratch_x_buff(state, SCRATCH_PACKET);
+
+		ei_x_append_buf(packet, "\0\0\0\0", 4);
+		ei_x_encode_version(packet);
+		ei_x_encode_tuple_header(packet, 2);
+		ei_x_encode_pid(packet, to);
+		// the message without its version byte
+		ei_x_append_buf(packet, reply->buff + 1, reply->index - 1);
+
+		return send_packet(state, packet->buff, packet->index);
+	}
+
+	pthread_mutex_lock(&state->send_lock);
+	result = ei_send(state->erl_fd, to, reply->buff, reply->index);
+	pthread_mutex_unlock(&state->send_lock);
+
+	return result;
+}
+
+void cnode_quit(const char* message) {
+	fprintf(stderr, "%s\n", message);
+	exit(1);
+}
+
+/*
+ * hands the request to the worker it belongs to - requests for a bus
+ * go to the worker of that bus, everything else (and requests for a
+ * bus that isn't open, to get their error) to the control worker
+ */
+void dispatch_job(t_job* job, t_cnode_state* state) {
+	char command[MAXATOMLEN_UTF8];
+	const t_command* cmd = NULL;
+	t_i2c_bus* i2c_bus = NULL;
+	int index = job->ref_len, arity;
+
+	if (ei_decode_tuple_header(job->data, &index, &arity) == 0 && arity >= 1 &&
+			ei_decode_atom(job->data, &index, command) == 0) {
+		cmd = find_command(command);
+	}
+
+	if (cmd && (cmd->flags & CMD_ON_BUS)) {
+		i2c_bus = resolve_bus(cmd, job->data, index, arity, state);
+	}
 
-	while (i2c_bus) {
-		if (i2c_bus->bus_number == bus_number) {
-			return i2c_bus;
+	if (!i2c_bus || enqueue_job(&i2c_bus->worker, job) < 0) {
+		if (enqueue_job(&state->control, job) < 0) {
+			free_job(state, job);
 		}
-		i2c_bus = i2c_bus->next;
 	}
 
-	return NULL;
+	release_bus(i2c_bus);
 }
 
-t_i2c_bus* open_bus(int bus_number) {
-	int bus_fd = -1;
-	t_i2c_bus *i2c_bus = NULL;
-	char* bus_device;
+/*
+ * receives {call, From, Ref, Command} (or {call, From, Command}) from
+ * the erlang node until the connection is gone or exit was requested
+ */
+static void cnode_loop(t_cnode_state* state, ei_x_buff* reply) {
+	int erl_got, index, version, arity, ref_start, ref_end, term_end, request_size;
+	char tag[MAXATOMLEN_UTF8], command[MAXATOMLEN_UTF8];
+	const t_command* cmd;
+	erlang_msg emsg;
+	erlang_pid from;
+	ei_x_buff request;
+	t_job *job, inline_job;
+	struct timespec received;
+
+	// grows as needed and is reused for every request
+	ei_x_new(&request);
+
+	while (state->mainloop) {
+		request_size = request.buffsz;
+		request.index = 0;
+		erl_got = ei_xreceive_msg(state->erl_fd, &emsg, &request);
+
+		clock_gettime(CLOCK_MONOTONIC, &received);
+
+		if (request.buffsz != request_size) {
+			COUNT_ALLOCATION(state);
+		}
 
-	asprintf(&bus_device, "/dev/i2c-%d", bus_number);
+		if (erl_got == ERL_TICK) {
+			// got an ERL_TICK .. and ignoring it silently
+			continue;
+		} else if (erl_got == ERL_ERROR) {
+			state->mainloop = false;
+		} else if (emsg.msgtype == ERL_EXIT) {
+			state->mainloop = false;
+		} else if (emsg.msgtype == ERL_REG_SEND) {
+			// {call, From, Ref, Command} - or {call, From, Command} from
+			// frontends not correlating their requests
+			index = 0;
+
+			if (ei_decode_version(request.buff, &index, &version) < 0 ||
+					ei_decode_tuple_header(request.buff, &index, &arity) < 0 ||
+					(arity != 3 && arity != 4) ||
+					ei_decode_atom(request.buff, &index, tag) < 0 ||
+					strcmp(tag, "call") != 0 ||
+					ei_decode_pid(request.buff, &index, &from) < 0) {
+				continue;
+			}
 
-	if ((bus_fd = open(bus_device, O_RDWR)) > 0) {
-		i2c_bus = (t_i2c_bus*)malloc(sizeof(t_i2c_bus));
+			ref_start = ref_end = index;
 
-		i2c_bus->bus_device = bus_device;
-		i2c_bus->bus_fd = bus_fd;
-		i2c_bus->bus_number = bus_number;
-		i2c_bus->device_address = 0;
-		i2c_bus->device_register = 0;
-		i2c_bus->next = NULL;
-	} else {
-		free(bus_device);
+			if (arity == 4 && ei_skip_term(request.buff, &ref_end) < 0) {
+				continue;
+			}
+
+			term_end = index = ref_end;
+
+			if (ei_skip_term(request.buff, &term_end) < 0) {
+				continue;
+			}
+
+			cmd = NULL;
+
+			if (ei_decode_tuple_header(request.buff, &index, &arity) == 0 &&
+					ei_decode_atom(request.buff, &index, command) == 0) {
+				cmd = find_command(command);
+			}
+
+			if (cmd && (cmd->flags & CMD_INLINE)) {
+				// reference and command are contiguous in the request
+				inline_job.from = from;
+				inline_job.ref_len = ref_end - ref_start;
+				inline_job.len = term_end - ref_start;
+				inline_job.data = request.buff + ref_start;
+				inline_job.command = cmd;
+				inline_job.received = received;
+				clock_gettime(CLOCK_MONOTONIC, &inline_job.queued);
+
+				run_job(&inline_job, NULL, reply, state);
+			} else if ((job = new_job(state, &from, request.buff + ref_start, ref_end - ref_start,
+					request.buff + ref_end, term_end - ref_end))) {
+				job->command = cmd;
+				job->received = received;
+
+				dispatch_job(job, state);
+			}
+		}
 	}
 
-	return i2c_bus;
+	ei_x_free(&request);
 }
 
-void close_bus(int bus_number, t_i2c_bus* i2c_bus_list) {
-	t_i2c_bus * i2c_bus = NULL;
+static int read_full(int fd, char* buf, int len) {
+	int offset, got;
 
-	if (i2c_bus_list != NULL) {
-		if ((i2c_bus = get_bus(bus_number, i2c_bus_list))){
+	for (offset = 0; offset < len; offset += got) {
+		if ((got = read(fd, buf + offset, len - offset)) <= 0) {
+			if (got < 0 && errno == EINTR) {
+				got = 0;
+				continue;
+			}
 
-			i2c_bus->bus_fd = close(i2c_bus->bus_fd);
+			return -1;
 		}
 	}
+
+	return len;
 }
 
-t_i2c_bus* append_bus(t_i2c_bus* i2c_bus, t_i2c_bus* i2c_bus_list) {
-	if (i2c_bus_list == NULL) {
-		return i2c_bus;
-	} else {
-		i2c_bus->next = i2c_bus_list;
-		return i2c_bus;
+/*
+ * reads one {packet, 4} framed packet from stdin into *buf (grown as
+ * needed) - returns its length or -1 once stdin is closed
+ */
+static int read_packet(t_cnode_state* state, char** buf, int* size) {
+	unsigned char header[4];
+	char* grown;
+	int len;
+
+	if (read_full(STDIN_FILENO, (char*) header, sizeof(header)) < 0) {
+		return -1;
 	}
+
+	len = (header[0] << 24) | (header[1] << 16) | (header[2] << 8) | header[3];
+
+	if (len < 0) {
+		return -1;
+	}
+
+	if (len > *size) {
+		if (!(grown = realloc(*buf, len))) {
+			return -1;
+		}
+
+		COUNT_ALLOCATION(state);
+
+		*buf = grown;
+		*size = len;
+	}
+
+	return read_full(STDIN_FILENO, *buf, len);
 }
 
-t_i2c_bus* remove_bus(int bus_number, t_i2c_bus* i2c_bus_list) {
-	t_i2c_bus *i2c_bus_last = NULL, *i2c_bus;
+// nesting accepted in a port request - a batch of transfers is the deepest
+#define PACKET_MAX_DEPTH 16
 
-	// remove first i2c-bus - lazy lazy lazy .. but works
-	if (i2c_bus_list->bus_number == bus_number) {
-		i2c_bus = i2c_bus_list->next;
+static unsigned int packet_u16(const char* buf, int index) {
+	return ((unsigned char) buf[index] << 8) | (unsigned char) buf[index + 1];
+}
 
-		free(i2c_bus_list->bus_device);
-		free(i2c_bus_list);
+static unsigned int packet_u32(const char* buf, int index) {
+	return (packet_u16(buf, index) << 16) | packet_u16(buf, index + 2);
+}
 
-		return i2c_bus;
+/*
+ * a pid, port or reference - header bytes, the node name and tail bytes
+ * of numbers
+ */
+static int skip_packet_node_term(const char* buf, int* index, int len, int header, int tail) {
+	int node = *index + header, end;
+
+	if (node + 3 > len) {
+		return -1;
 	}
 
-	i2c_bus = i2c_bus_list;
+	switch (buf[node]) {
+	case ERL_SMALL_ATOM_EXT:
+	case ERL_SMALL_ATOM_UTF8_EXT:
+		end = node + 2 + (unsigned char) buf[node + 1];
+		break;
 
-	while (i2c_bus->next != NULL) {
-		if (i2c_bus->bus_number == bus_number) {
-			if (i2c_bus_last == NULL) {
-				i2c_bus_last = i2c_bus->next;
+	case ERL_ATOM_EXT:
+	case ERL_ATOM_UTF8_EXT:
+		end = node + 3 + packet_u16(buf, node + 1);
+		break;
 
-				free(i2c_bus->bus_device);
-				free(i2c_bus);
+	default:
+		return -1;
+	}
 
-				return i2c_bus_last;
-			} else {
-				i2c_bus_last->next = i2c_bus->next;
+	if ((end += tail) > len) {
+		return -1;
+	}
 
-				free(i2c_bus->bus_device);
-				free(i2c_bus);
+	*index = end;
 
-				return i2c_bus_list;
-			}
+	return 0;
+}
+
+/*
+ * ei_skip_term() within the len bytes of a packet - every size field
+ * is checked against len before it is used, so a truncated or corrupt
+ * term fails instead of being read past the end of what was received.
+ * Funs aren't expected in a request and fail as well
+ */
+static int skip_packet_term(const char* buf, int* index, int len, int depth) {
+	unsigned long long size, elements = 0;
+	int i;
+
+	if (depth > PACKET_MAX_DEPTH || *index >= len) {
+		return -1;
+	}
+
+	// the fixed part of the term including its tag, then what follows it
+	switch (buf[*index]) {
+	case ERL_NIL_EXT:
+		size = 1;
+		break;
+
+	case ERL_SMALL_INTEGER_EXT:
+		size = 2;
+		break;
+
+	case ERL_INTEGER_EXT:
+		size = 5;
+		break;
+
+	case NEW_FLOAT_EXT:
+		size = 9;
+		break;
+
+	case ERL_FLOAT_EXT:
+		size = 32;
+		break;
+
+	case ERL_SMALL_ATOM_EXT:
+	case ERL_SMALL_ATOM_UTF8_EXT:
+		if (*index + 2 > len) {
+			return -1;
+		}
+
+		size = 2 + (unsigned char) buf[*index + 1];
+		break;
+
+	// the sign byte after the length
+	case ERL_SMALL_BIG_EXT:
+		if (*index + 2 > len) {
+			return -1;
+		}
+
+		size = 3 + (unsigned char) buf[*index + 1];
+		break;
+
+	case ERL_SMALL_TUPLE_EXT:
+		if (*index + 2 > len) {
+			return -1;
+		}
+
+		elements = (unsigned char) buf[*index + 1];
+		size = 2;
+		break;
+
+	case ERL_ATOM_EXT:
+	case ERL_ATOM_UTF8_EXT:
+	case ERL_STRING_EXT:
+		if (*index + 3 > len) {
+			return -1;
+		}
+
+		size = 3 + packet_u16(buf, *index + 1);
+		break;
+
+	case ERL_BINARY_EXT:
+	case ERL_BIT_BINARY_EXT:
+	case ERL_LARGE_BIG_EXT:
+	case ERL_LARGE_TUPLE_EXT:
+	case ERL_LIST_EXT:
+	case ERL_MAP_EXT:
+		if (*index + 5 > len) {
+			return -1;
+		}
+
+		size = packet_u32(buf, *index + 1);
+
+		switch (buf[*index]) {
+		case ERL_BINARY_EXT:
+			size += 5;
+			break;
+
+		case ERL_BIT_BINARY_EXT:
+		case ERL_LARGE_BIG_EXT:
+			size += 6;
+			break;
+
+		case ERL_LARGE_TUPLE_EXT:
+			elements = size;
+			size = 5;
+			break;
+
+		case ERL_LIST_EXT:
+			// and the tail
+			elements = size + 1;
+			size = 5;
+			break;
+
+		default:
+			elements = 2 * size;
+			size = 5;
 		}
-		i2c_bus_last = i2c_bus;
-		i2c_bus = i2c_bus->next;
+		break;
+
+	case ERL_PID_EXT:
+		return skip_packet_node_term(buf, index, len, 1, 4 + 4 + 1);
+
+	case ERL_NEW_PID_EXT:
+		return skip_packet_node_term(buf, index, len, 1, 4 + 4 + 4);
+
+	case ERL_PORT_EXT:
+	case ERL_REFERENCE_EXT:
+		return skip_packet_node_term(buf, index, len, 1, 4 + 1);
+
+	case ERL_NEW_PORT_EXT:
+		return skip_packet_node_term(buf, index, len, 1, 4 + 4);
+
+#ifdef ERL_V4_PORT_EXT
+	case ERL_V4_PORT_EXT:
+		return skip_packet_node_term(buf, index, len, 1, 8 + 4);
+#endif
+
+	// Len:16 words of id after the node - at most 5 of them
+	case ERL_NEW_REFERENCE_EXT:
+	case ERL_NEWER_REFERENCE_EXT:
+		if (*index + 3 > len || (size = packet_u16(buf, *index + 1)) > 5) {
+			return -1;
+		}
+
+		return skip_packet_node_term(buf, index, len, 3,
+				(buf[*index] == ERL_NEW_REFERENCE_EXT ? 1 : 4) + 4 * size);
+
+	default:
+		return -1;
 	}
 
-	return i2c_bus_list;
-}
+	if (size > (unsigned long long) (len - *index) || elements > (unsigned long long) (len - *index)) {
+		return -1;
+	}
 
-int get_bus_fd(int bus_number, t_i2c_bus* i2c_bus_list) {
-	t_i2c_bus* i2c_bus = get_bus(bus_number, i2c_bus_list);
+	*index += size;
 
-	if (i2c_bus) {
-		return i2c_bus->bus_fd;
+	for (i = 0; i < (int) elements; i++) {
+		if (skip_packet_term(buf, index, len, depth + 1) < 0) {
+			return -1;
+		}
 	}
 
-	return -1;
+	return 0;
 }
 
-int i2c_set_address(int bus_fd, int device_address) {
-	return ioctl(bus_fd, I2C_SLAVE, device_address);
+/*
+ * a packet that can't be decoded is answered with <<Id:32, {error, badarg}>>
+ * so its caller isn't left waiting for the timeout - Id 0 is taken by
+ * messages for other processes, and a packet shorter than an Id can't
+ * be answered at all
+ */
+static void reply_bad_packet(t_cnode_state* state, ei_x_buff* reply, const char* packet, int len) {
+	if (len < 4 || packet_u32(packet, 0) == 0) {
+		return;
+	}
+
+	reply->index = 0;
+
+	ei_x_append_buf(reply, packet, 4);
+	ei_x_encode_version(reply);
+	ei_x_encode_tuple_header(reply, 2);
+	ei_x_encode_atom(reply, "error");
+	ei_x_encode_atom(reply, "badarg");
+
+	send_packet(state, reply->buff, reply->index);
 }
 
-int get_bus_device_address(int bus_number, t_i2c_bus* i2c_bus_list) {
-	t_i2c_bus* i2c_bus = get_bus(bus_number, i2c_bus_list);
+/*
+ * port mode - <<Id:32, Command/binary>> with Command in external
+ * format on stdin, answered with <<Id:32, Reply/binary>> on stdout
+ * (<<Id:32, {error, badarg}>> if Command can't be decoded); runs until
+ * stdin is closed or exit was requested
+ */
+static void port_loop(t_cnode_state* state, ei_x_buff* reply) {
+	char* request = NULL;
+	char command[MAXATOMLEN_UTF8];
+	int size = 0, len, index, version, arity, term_start, term_end;
+	const t_command* cmd;
+	erlang_pid from;
+	t_job *job, inline_job;
+	struct timespec received;
+
+	// replies go back the way the request came - there's no pid to send to
+	memset(&from, 0, sizeof(from));
+
+	while (state->mainloop && (len = read_packet(state, &request, &size)) >= 0) {
+		clock_gettime(CLOCK_MONOTONIC, &received);
+
+		index = 4;
+
+		if (len <= 5 || ei_decode_version(request, &index, &version) < 0) {
+			reply_bad_packet(state, reply, request, len);
+			continue;
+		}
 
-	if (i2c_bus) {
-		return i2c_bus->device_address;
+		term_start = term_end = index;
+
+		// nothing past the packet is read - not even by ei_skip_term()
+		if (skip_packet_term(request, &term_end, len, 0) < 0) {
+			reply_bad_packet(state, reply, request, len);
+			continue;
+		}
+
+		cmd = NULL;
+
+		if (ei_decode_tuple_header(request, &index, &arity) == 0 &&
+				ei_decode_atom(request, &index, command) == 0) {
+			cmd = find_command(command);
+		}
+
+		if (cmd && (cmd->flags & CMD_INLINE)) {
+			// dropping the version byte makes id and command contiguous
+			memmove(request + 1, request, 4);
+
+			inline_job.from = from;
+			inline_job.ref_len = 4;
+			inline_job.len = term_end - 1;
+			inline_job.data = request + 1;
+			inline_job.command = cmd;
+			inline_job.received = received;
+			clock_gettime(CLOCK_MONOTONIC, &inline_job.queued);
+
+			run_job(&inline_job, NULL, reply, state);
+		} else if ((job = new_job(state, &from, request, 4,
+				request + term_start, term_end - term_start))) {
+			job->command = cmd;
+			job->received = received;
+
+			dispatch_job(job, state);
+		}
 	}
 
-	return -1;
+	free(request);
 }
 
-ETERM* get_bus_info(t_i2c_bus* i2c_bus) {
-	return erl_format(
-			"[{bus_number, ~i},"\
-			" {bus_device, ~s},"\
-			" {bus_fd, ~i},"\
-			" {device_address, ~i}"\
-			" {device_register, ~i}]",
-			i2c_bus->bus_number,
-			i2c_bus->bus_device,
-			i2c_bus->bus_fd,
-			i2c_bus->device_address,
-			i2c_bus->device_register);
-}
+#define USAGE "usage: erl_i2c_cnode [Options] Cookie [Instance Instances] | " \
+		"erl_i2c_cnode [Options] --port\n" \
+		"  --simulate              simulated buses instead of /dev/i2c-N\n" \
+		"  --sim-clock Hz          their bus clock - 100000 by default\n" \
+		"  --sim-devices A,B,...   addresses devices answer at - 0x48 by default\n" \
+		"  --sim-nak [Address:]N   N NAKs per million transfers (to Address)\n" \
+		"  --trace File            append every transaction to the ring file File\n" \
+		"  --trace-size MB         size of its ring - 64 by default"
 
 int main(int argc, char **argv) {
 	// erlang c-node vars
 	int erl_port = -1;
 	int erl_listen = -1;
-	int erl_fd = -1;
-	int erl_got = -1;
-	unsigned char erl_buf[BUFSIZE] __attribute__ ((aligned));
 	char* erl_cookie;
+	char erl_alive[32];
+	ei_cnode erl_node;
 	ErlConnect erl_conn;
-	ErlMessage emsg;
-	ETERM *fromp, *tuplep, *fnp, *argp, *resp;
-	t_i2c_bus *i2c_bus_list = NULL, *i2c_bus = NULL;
+	ei_x_buff reply;
+	t_i2c_bus *i2c_bus = NULL;
+	int bus_number;
 
-	ETERM *Bus_Num, *Dev_Addr, *Dev_Reg, *Dev_Data, *Dev_Data_Len,
-			*Pat1, *Pat2, *Pat3, *Pat4;
+	t_cnode_state state = {
+			.i2c_buses = { NULL },
+			.open_buses = 0,
+			.current_bus = 0,
+			.erl_fd = -1,
+			.port = false,
+			.instance = 0,
+			.instances = 1,
+			.backend = &kernel_backend,
+			.mainloop = true
+	};
+
+	static const struct option options[] = {
+			{ "port", no_argument, NULL, 'p' },
+			{ "simulate", no_argument, NULL, 's' },
+			{ "sim-clock", required_argument, NULL, 'c' },
+			{ "sim-devices", required_argument, NULL, 'd' },
+			{ "sim-nak", required_argument, NULL, 'n' },
+			{ "trace", required_argument, NULL, 't' },
+			{ "trace-size", required_argument, NULL, 'z' },
+			{ NULL, 0, NULL, 0 }
+	};
+	const char* trace_path = NULL;
+	long trace_size = TRACE_DEFAULT_RING;
+	int option;
+
+	while ((option = getopt_long(argc, argv, "", options, NULL)) != -1) {
+		switch (option) {
+		case 'p':
+			state.port = true;
+			break;
+
+		case 's':
+			state.backend = &sim_backend;
+			break;
+
+		case 'c':
+			if (sim_set_clock(atol(optarg)) < 0) {
+				cnode_quit("--sim-clock takes the bus clock in Hz (0 for no delay)");
+			}
+			break;
+
+		case 'd':
+			if (sim_add_devices(optarg) < 0) {
+				cnode_quit("--sim-devices takes a list of addresses like 0x48,0x50");
+			}
+			break;
 
-	unsigned char current_bus = 0;
-	unsigned char current_address = 0;
-	unsigned char current_register = 0;
+		case 'n':
+			if (sim_set_nak(optarg) < 0) {
+				cnode_quit("--sim-nak takes [Address:]NAKs per million transfers");
+			}
+			break;
 
-	unsigned char bus_number;
-	unsigned char device_address;
-	unsigned char device_register;
-	char *device_data = NULL;
-	unsigned char device_data_len = 0;
-	int device_data_read;
+		case 't':
+			trace_path = optarg;
+			break;
 
-	bool cont = true;
-	bool got_data = false;
-	bool mainloop = true;
+		case 'z':
+			trace_size = atol(optarg) * 1024 * 1024;
+			break;
 
-	// first setup erlang-node and connection to epmd
-	erl_port = PORTBASE;
+		default:
+			cnode_quit(USAGE);
+		}
+	}
 
-	erl_init(NULL, 0);
+	if (!state.port && optind >= argc) {
+		cnode_quit(USAGE);
+	}
 
-	erl_cookie = argv[1];
+	// one of several C-Nodes sharing the buses of this host
+	if (!state.port && argc - optind >= 3) {
+		state.instance = atoi(argv[optind + 1]);
+		state.instances = atoi(argv[optind + 2]);
 
-	if (!erl_connect_init(0, erl_cookie, 0)) {
-		erl_err_quit("\nerl_connect_init");
+		if (state.instance < 0 || state.instances < 1 || state.instance >= state.instances) {
+			cnode_quit("Instance must be between 0 and Instances - 1");
+		}
 	}
 
-	// make a listen socket
-	if ((erl_listen = erl_i2c_listen(erl_port)) <= 0) {
-		erl_err_quit(
-				"error during erl_i2c_listen\nunable to create listen-socket\n"
-				"already running for this port?");
+	pthread_mutex_init(&state.lock, NULL);
+	pthread_mutex_init(&state.send_lock, NULL);
+	pthread_mutex_init(&state.pool_lock, NULL);
+
+	state.stats = new_stats();
+
+	if (trace_path && !(state.trace = open_trace(trace_path, trace_size))) {
+		cnode_quit("unable to open the trace file");
 	}
 
-	// publish listen port via epmd
-	if (erl_publish(erl_port) == -1) {
-		erl_err_quit("error during erl_publish - epmd not running?");
+	ei_init();
+
+	init_command_table();
+
+	if (!state.port) {
+		// first setup erlang-node and connection to epmd - every
+		// instance gets its own node name and any free port
+		erl_port = 0;
+
+		erl_cookie = argv[optind];
+
+		snprintf(erl_alive, sizeof(erl_alive), "c%d", state.instance);
+
+		if (ei_connect_init(&erl_node, erl_alive, erl_cookie, 0) < 0) {
+			cnode_quit("error during ei_connect_init");
+		}
+
+		// make a listen socket
+		if ((erl_listen = erl_i2c_listen(&erl_port)) <= 0) {
+			cnode_quit(
+					"error during erl_i2c_listen\nunable to create listen-socket");
+		}
+
+		// publish listen port via epmd
+		if (ei_publish(&erl_node, erl_port) == -1) {
+			cnode_quit("error during ei_publish - epmd not running?");
+		}
+
+		// to tell calling erlang our nodename
+		fprintf(stderr, "this.nodename: %s\n", ei_thisnodename(&erl_node));
+
+		// erlang.cookie _must_ be set properly
+		if ((state.erl_fd = ei_accept(&erl_node, erl_listen, &erl_conn)) == ERL_ERROR) {
+			cnode_quit("error on ei_accept - erlang-cookie properly set?");
+		}
 	}
 
-	// to tell calling erlang our nodename
-	fprintf(stderr, "this.nodename: %s\n", erl_thisnodename());
+	if (start_worker(&state.control, NULL, &state) < 0) {
+		cnode_quit("unable to start control worker");
+	}
+
+	// grows as needed and is reused for every inline request
+	ei_x_new(&reply);
 
-	// erlang.cookie _must_ be set properly
-	if ((erl_fd = erl_accept(erl_listen, &erl_conn)) == ERL_ERROR) {
-		erl_err_quit("error on erl_accept - erlang-cookie properly set?");
+	if (state.port) {
+		port_loop(&state, &reply);
+	} else {
+		cnode_loop(&state, &reply);
 	}
 
-	while (mainloop) {
-		erl_got = erl_receive_msg(erl_fd, erl_buf, BUFSIZE, &emsg);
+	ei_x_free(&reply);
 
-		if (erl_got == ERL_TICK) {
-			// got an ERL_TICK .. and ignoring it silently
-			continue;
-		} else if (erl_got == ERL_ERROR) {
-			mainloop = false;
-		} else if (erl_got == ERL_EXIT) {
-			mainloop = false;
-		} else {
-			if (emsg.type == ERL_SEND) {
-			} else if (emsg.type == ERL_REG_SEND) {
-				fromp = erl_element(2, emsg.msg);
-				tuplep = erl_element(3, emsg.msg);
-
-				fnp = erl_element(1, tuplep);
-				resp = NULL;
-
-/*************
- * open_bus
- * {open_bus, Bus_Number}
- */
-				if (strncmp(ERL_ATOM_PTR(fnp), "open_bus", 8) == 0) {
-					if ((argp = erl_element(2, tuplep)) && ERL_IS_INTEGER(argp)) {
-						bus_number = ERL_INT_VALUE(argp);
-
-						if (get_bus_fd(bus_number, i2c_bus_list) < 0) {
-							if ((i2c_bus = open_bus(bus_number)) != NULL) {
-								i2c_bus_list = append_bus(i2c_bus, i2c_bus_list);
-								current_bus = bus_number;
-
-								resp = erl_format(
-										"{erl_i2c_cnode, {open_bus, ok, ~i}}",
-										bus_number);
-							} else {
-								resp = erl_format(
-										"{erl_i2c_cnode, {open_bus, error, ~s}}",
-										strerror(errno));
-							}
-						} else {
-							resp = erl_format(
-									"{erl_i2c_cnode, {open_bus, error, already_open}}");
-						}
-					} else {
-						resp = erl_format(
-								"{erl_i2c_cnode, {open_bus, error, badarg}}");
-					}
-
-					erl_free_term(argp);
-
-					erl_send(erl_fd, fromp, resp);
-				}
-/**************
- * close bus
- * {close_bus, Bus_Number}
- */
-				else if (strncmp(ERL_ATOM_PTR(fnp), "close_bus", 9) == 0) {
-					if (!i2c_bus_list) {
-						resp = erl_format(
-								"{erl_i2c_cnode, {close_bus, error, no_open_bus}}");
-					} else {
-						if ((argp = erl_element(2, tuplep)) && ERL_IS_INTEGER(argp)) {
-							bus_number = ERL_INT_VALUE(argp);
-
-							if (!get_bus(bus_number, i2c_bus_list)) {
-								resp = erl_format(
-										"{erl_i2c_cnode, {close_bus, error, bus_not_open}}");
-							} else {
-								close_bus(bus_number, i2c_bus_list);
-								i2c_bus_list = remove_bus(bus_number, i2c_bus_list);
-
-								resp = erl_format(
-										"{erl_i2c_cnode, {close_bus, ok}}");
-							}
-						} else {
-							resp = erl_format(
-									"{erl_i2c_cnode, {close_bus, error, badarg}}");
-						}
-
-						erl_free_term(argp);
-					}
-
-					erl_send(erl_fd, fromp, resp);
-				}
-/**************
- * read byte
- * {read_byte, Data_Len}
- * {read_byte, Register, Data_Len}
- * {read_byte, Device_Address, Register, Data_Len}
- * {read_byte, Bus_Number, Device_Address, Register, Data_Len}
- **************/
-				else if (strncmp(ERL_ATOM_PTR(fnp), "read_byte", 9) == 0) {
-					if (i2c_bus_list) {
-						got_data = false;
-
-						Bus_Num = NULL;
-						Dev_Addr = NULL;
-						Dev_Reg = NULL;
-						Dev_Data_Len = NULL;
-
-						Pat1 = erl_format("{read_byte, Bus_Num, Dev_Addr, Dev_Reg, Dev_Data_Len}");
-						Pat2 = erl_format("{read_byte, Dev_Addr, Dev_Reg, Dev_Data_Len}");
-						Pat3 = erl_format("{read_byte, Dev_Reg, Dev_Data_Len}");
-						Pat4 = erl_format("{read_byte, Dev_Data_Len}");
-
-						bus_number      = current_bus;
-						device_address  = current_address;
-						device_register = current_register;
-
-						if (erl_match(Pat1, tuplep)) {
-							Bus_Num = erl_var_content(Pat1, "Bus_Num");
-							Dev_Addr = erl_var_content(Pat1, "Dev_Addr");
-							Dev_Reg = erl_var_content(Pat1, "Dev_Reg");
-							Dev_Data_Len = erl_var_content(Pat1, "Dev_Data_Len");
-
-							if (ERL_IS_INTEGER(Bus_Num) &&
-									ERL_IS_INTEGER(Dev_Addr) &&
-									ERL_IS_INTEGER(Dev_Reg) &&
-									ERL_IS_INTEGER(Dev_Data_Len)) {
-								bus_number      = (unsigned char)ERL_INT_UVALUE(Bus_Num);
-								device_address  = (unsigned char)ERL_INT_UVALUE(Dev_Addr);
-								device_register = (unsigned char)ERL_INT_UVALUE(Dev_Reg);
-								device_data_len = (unsigned char)ERL_INT_UVALUE(Dev_Data_Len);
-
-								got_data = true;
-							}
-						} else if (erl_match(Pat2, tuplep)) {
-							Dev_Addr = erl_var_content(Pat2, "Dev_Addr");
-							Dev_Reg = erl_var_content(Pat2, "Dev_Reg");
-							Dev_Data_Len = erl_var_content(Pat2, "Dev_Data_Len");
-
-							if (ERL_IS_INTEGER(Dev_Addr) &&
-									ERL_IS_INTEGER(Dev_Reg) &&
-									ERL_IS_INTEGER(Dev_Data_Len)) {
-								device_address  = (unsigned char)ERL_INT_UVALUE(Dev_Addr);
-								device_register = (unsigned char)ERL_INT_UVALUE(Dev_Reg);
-								device_data_len = (unsigned char)ERL_INT_UVALUE(Dev_Data_Len);
-
-								got_data = true;
-							}
-						} else if (erl_match(Pat3, tuplep)) {
-							Dev_Reg = erl_var_content(Pat3, "Dev_Reg");
-							Dev_Data_Len = erl_var_content(Pat3, "Dev_Data_Len");
-
-							if (ERL_IS_INTEGER(Dev_Reg) &&
-									ERL_IS_INTEGER(Dev_Data_Len)) {
-								device_register = (unsigned char)ERL_INT_UVALUE(Dev_Reg);
-								device_data_len = (unsigned char)ERL_INT_UVALUE(Dev_Data_Len);
-
-								got_data = true;
-							}
-						} else if (erl_match(Pat4, tuplep)) {
-							Dev_Data_Len = erl_var_content(Pat4, "Dev_Data_Len");
-
-							if (ERL_IS_INTEGER(Dev_Data_Len)) {
-								device_data_len = (unsigned char)ERL_INT_UVALUE(Dev_Data_Len);
-
-								got_data = true;
-							}
-						} else {
-							resp = erl_format(
-									"{erl_i2c_cnode, {read_byte, error, badarg}}");
-						}
-
-						if (got_data) {
-							cont = true;
-
-							if ((i2c_bus = get_bus(bus_number, i2c_bus_list))) {
-								if (device_address != i2c_bus->device_address) {
-									if (i2c_set_address(i2c_bus->bus_fd, device_address) < 0) {
-										resp = erl_format(
-												"{erl_i2c_cnode, {read_byte, address_error, ~s}}",
-												strerror(errno));
-										cont = false;
-									} else {
-										current_address = device_address;
-										i2c_bus->device_address = device_address;
-									}
-								}
-
-								if (cont) {
-									if (device_data_len <= 32) {
-										device_data = calloc(device_data_len, sizeof(char));
-
-										if ((device_data_read =
-												i2c_smbus_read_i2c_block_data(
-														i2c_bus->bus_fd,
-														device_register,
-														device_data_len,
-														(__u8*) device_data)) < 0) {
-											resp = erl_format(
-													"{erl_i2c_cnode, {read_byte, i2c_error, ~s}}",
-													strerror(errno));
-										} else {
-											current_register = device_register;
-											i2c_bus->device_register = device_register;
-											resp = erl_format(
-													"{erl_i2c_cnode, {read_byte, ok, ~i, ~w}}",
-													device_data_read, erl_mk_binary(device_data, device_data_read));
-										}
-
-										free(device_data);
-									} else {
-										resp = erl_format(
-												"{erl_i2c_cnode, {read_byte, error, too_much_data_requested}}");
-									}
-								}
-
-								// at the end
-								current_bus = bus_number;
-								current_address = device_address;
-								current_register = device_register;
-							} else {
-								resp = erl_format(
-										"{erl_i2c_cnode, {read_byte, error, bus_not_open}}");
-							}
-						} else {
-							resp = erl_format(
-									"{erl_i2c_cnode, {read_byte, error, badarg}}");
-						}
-
-						erl_free_term(Bus_Num);
-						erl_free_term(Dev_Addr);
-						erl_free_term(Dev_Reg);
-						erl_free_term(Dev_Data_Len);
-						erl_free_term(Pat1);
-						erl_free_term(Pat2);
-						erl_free_term(Pat3);
-						erl_free_term(Pat4);
-					} else {
-						resp = erl_format(
-								"{erl_i2c_cnode, {read_byte, error, no_open_bus}}");
-					}
-					erl_send(erl_fd, fromp, resp);
-				}
-/**************
- * write byte
- * {write_byte, Data_Byte}
- * {write_byte, Register, Data_Byte}
- * {write_byte, Device_Address, Register, Data_Byte}
- * {write_byte, Bus_Number, Device_Address, Register, Data_Byte}
- */
-				else if (strncmp(ERL_ATOM_PTR(fnp), "write_byte", 10) == 0) {
-					if (i2c_bus_list) {
-						got_data = false;
-
-						Bus_Num = NULL;
-						Dev_Addr = NULL;
-						Dev_Reg = NULL;
-						Dev_Data = NULL;
-
-						Pat1 = erl_format("{write_byte, Bus_Num, Dev_Addr, Dev_Reg, Dev_Data}");
-						Pat2 = erl_format("{write_byte, Dev_Addr, Dev_Reg, Dev_Data}");
-						Pat3 = erl_format("{write_byte, Dev_Reg, Dev_Data}");
-						Pat4 = erl_format("{write_byte, Dev_Data}");
-
-						bus_number = current_bus;
-						device_address = current_address;
-						device_register = current_register;
-
-						if (erl_match(Pat1, tuplep)) {
-							Bus_Num = erl_var_content(Pat1, "Bus_Num");
-							Dev_Addr = erl_var_content(Pat1, "Dev_Addr");
-							Dev_Reg = erl_var_content(Pat1, "Dev_Reg");
-							Dev_Data = erl_var_content(Pat1, "Dev_Data");
-
-							if (ERL_IS_INTEGER(Bus_Num) &&
-									ERL_IS_INTEGER(Dev_Addr) &&
-									ERL_IS_INTEGER(Dev_Reg) &&
-									ERL_IS_BINARY(Dev_Data)) {
-								bus_number = ERL_INT_UVALUE(Bus_Num);
-								device_address = (char)ERL_INT_UVALUE(Dev_Addr);
-								device_register = (char)ERL_INT_UVALUE(Dev_Reg);
-
-								device_data_len = ERL_BIN_SIZE(Dev_Data);
-								device_data = calloc(device_data_len, sizeof(char));
-								memcpy(device_data, ERL_BIN_PTR(Dev_Data), device_data_len);
-
-								got_data = true;
-							}
-						} else if (erl_match(Pat2, tuplep)) {
-							Dev_Addr = erl_var_content(Pat2, "Dev_Addr");
-							Dev_Reg = erl_var_content(Pat2, "Dev_Reg");
-							Dev_Data = erl_var_content(Pat2, "Dev_Data");
-
-							if (ERL_IS_INTEGER(Dev_Addr) &&
-									ERL_IS_INTEGER(Dev_Reg) &&
-									ERL_IS_BINARY(Dev_Data)) {
-								device_address = (char)ERL_INT_UVALUE(Dev_Addr);
-								device_register = (char)ERL_INT_UVALUE(Dev_Reg);
-
-								device_data_len = ERL_BIN_SIZE(Dev_Data);
-								device_data = calloc(device_data_len, sizeof(char));
-								memcpy(device_data, ERL_BIN_PTR(Dev_Data), device_data_len);
-
-								got_data = true;
-							}
-						} else if (erl_match(Pat3, tuplep)) {
-							Dev_Reg = erl_var_content(Pat3, "Dev_Reg");
-							Dev_Data = erl_var_content(Pat3, "Dev_Data");
-
-							if (ERL_IS_INTEGER(Dev_Reg) &&
-									ERL_IS_BINARY(Dev_Data)) {
-								device_register = (char)ERL_INT_UVALUE(Dev_Reg);
-
-								device_data_len = ERL_BIN_SIZE(Dev_Data);
-								device_data = calloc(device_data_len, sizeof(char));
-								memcpy(device_data, ERL_BIN_PTR(Dev_Data), device_data_len);
-
-								got_data = true;
-							}
-						} else if (erl_match(Pat4, tuplep)) {
-							Dev_Data = erl_var_content(Pat4, "Dev_Data");
-
-							if (ERL_IS_BINARY(Dev_Data)) {
-								device_data_len = ERL_BIN_SIZE(Dev_Data);
-								device_data = calloc(device_data_len, sizeof(char));
-								memcpy(device_data, ERL_BIN_PTR(Dev_Data), device_data_len);
-
-								got_data = true;
-							}
-						} else {
-							resp = erl_format(
-									"{erl_i2c_cnode, {write_byte, error, badarg}}");
-						}
-
-						if (got_data) {
-							cont = true;
-
-							if ((i2c_bus = get_bus(bus_number, i2c_bus_list))) {
-								if (device_address != i2c_bus->device_address) {
-									if (i2c_set_address(i2c_bus->bus_fd, device_address) < 0) {
-										resp = erl_format(
-												"{erl_i2c_cnode, {write_byte, address_error, ~s}}",
-												strerror(errno));
-										cont = false;
-									} else {
-										current_address = device_address;
-										i2c_bus->device_address = device_address;
-									}
-								}
-
-								if (cont) {
-									if (device_data_len <= 32) {
-										if (i2c_smbus_write_i2c_block_data(
-												i2c_bus->bus_fd,
-												device_register,
-												device_data_len,
-												(__u8*) device_data) < 0) {
-											resp = erl_format(
-													"{erl_i2c_cnode, {write_byte, i2c_error, ~s}}",
-													strerror(errno));
-										} else {
-											current_register = device_register;
-											i2c_bus->device_register = device_register;
-
-											resp = erl_format(
-													"{erl_i2c_cnode, {write_byte, ok, ~i}}",
-													device_data_len);
-										}
-									} else {
-										resp = erl_format(
-												"{erl_i2c_cnode, {write_byte, error, too_much_data}}");
-									}
-								}
-
-								// at the end
-								current_bus = bus_number;
-								current_address = device_address;
-								current_register = device_register;
-							} else {
-								resp = erl_format(
-										"{erl_i2c_cnode, {write_byte, error, bus_not_open}}");
-							}
-						} else {
-							resp = erl_format(
-									"{erl_i2c_cnode, {write_byte, error, badarg}}");
-						}
-
-						if (device_data) {
-							free(device_data);
-						}
-
-						erl_free_term(Bus_Num);
-						erl_free_term(Dev_Addr);
-						erl_free_term(Dev_Reg);
-						erl_free_term(Dev_Data);
-						erl_free_term(Pat1);
-						erl_free_term(Pat2);
-						erl_free_term(Pat3);
-						erl_free_term(Pat4);
-					} else {
-						resp = erl_format(
-								"{erl_i2c_cnode, {write_byte, error, no_open_bus}}");
-					}
-
-					erl_send(erl_fd, fromp, resp);
-				}
-/**************
- * get_address
- * {get_address} - returns device_address set on current bus
- * {get_address, Bus_Number}
- */
-				else if (strncmp(ERL_ATOM_PTR(fnp), "get_address", 8) == 0) {
-					if ((argp = erl_element(2, tuplep))) {
-						if (ERL_IS_INTEGER(argp)) {
-							bus_number = ERL_INT_VALUE(argp);
-							if ((i2c_bus = get_bus(bus_number, i2c_bus_list))) {
-								resp = erl_format(
-										"{erl_i2c_cnode, {get_address, ok, ~i}}",
-										i2c_bus->device_address);
-							} else {
-								resp = erl_format(
-										"{erl_i2c_cnode, {get_address, error, bus_not_open}}");
-
-							}
-						} else {
-							resp = erl_format(
-									"{erl_i2c_cnode, {get_address, error, badarg}}");
-						}
-					} else {
-						if (current_bus >= 0) {
-							resp = erl_format(
-									"{erl_i2c_cnode, {get_address, ok, ~i}}",
-									get_bus_device_address(current_bus, i2c_bus_list));
-						} else {
-							resp = erl_format(
-									"{erl_i2c_conde, {get_address, error, no_bus_set}}");
-						}
-					}
-
-					erl_free_term(argp);
-
-					erl_send(erl_fd, fromp, resp);
-				}
-/**************
- * set_address
- * {set_address, Device_Address}
- * {set_address, Bus_Number, Device_Address}
- */
-				else if (strncmp(ERL_ATOM_PTR(fnp), "set_address", 8) == 0) {
-					if (i2c_bus_list) {
-						ETERM *Dev_Addr = NULL, *Bus_Num = NULL, *Pat1 = NULL, *Pat2 = NULL;
-						Pat1 = erl_format("{set_address, Device_Address}");
-						Pat2 = erl_format("{set_address, Bus_Number, Device_Address}");
-
-						if (erl_match(Pat1, tuplep)) {
-							Dev_Addr = erl_var_content(Pat1, "Device_Address");
-
-							if (current_bus >= 0) {
-								if (ERL_IS_INTEGER(Dev_Addr)) {
-									device_address = ERL_INT_UVALUE(Dev_Addr);
-
-									i2c_bus = get_bus(current_bus, i2c_bus_list);
-
-									if (i2c_set_address(i2c_bus->bus_fd, device_address) < 0) {
-										resp = erl_format(
-												"{erl_i2c_cnode, {set_address, error, ~s}}",
-												strerror(errno));
-									} else {
-										i2c_bus->device_address = device_address;
-										current_address = device_address;
-										resp = erl_format(
-												"{erl_i2c_cnode, {set_address, ok, ~i}}",
-												device_address);
-									}
-								} else {
-									resp = erl_format(
-											"{erl_i2c_cnode, {set_address, error, badarg}}");
-								}
-							} else {
-								resp = erl_format(
-										"{erl_i2c_cnode, {set_address, error, no_current_bus_set}}");
-							}
-
-							erl_free_term(Dev_Addr);
-						} else if (erl_match(Pat2, tuplep)) {
-							Dev_Addr = erl_var_content(Pat2, "Device_Address");
-							Bus_Num  = erl_var_content(Pat2, "Bus_Number");
-
-							if (ERL_IS_INTEGER(Dev_Addr) &&
-									ERL_IS_INTEGER(Bus_Num)) {
-								bus_number = ERL_INT_UVALUE(Bus_Num);
-								device_address = ERL_INT_UVALUE(Dev_Addr);
-
-								if ((i2c_bus = get_bus(bus_number, i2c_bus_list))) {
-									current_bus = bus_number;
-									if (i2c_set_address(i2c_bus->bus_fd, device_address) < 0) {
-										resp = erl_format(
-												"{erl_i2c_cnode, {set_address, error, ~s}}",
-												strerror(errno));
-									} else {
-										i2c_bus->device_address = device_address;
-										current_address = device_address;
-										resp = erl_format(
-												"{erl_i2c_cnode, {set_address, ok, ~i}}",
-												device_address);
-									}
-								} else {
-									resp = erl_format(
-											"{erl_i2c_cnode, {set_address, error, bus_not_open}}");
-								}
-							} else {
-								resp = erl_format(
-										"{erl_i2c_cnode, {set_address, error, badarg}}");
-							}
-						} else {
-							resp = erl_format(
-									"{erl_i2c_cnode, {set_address, error, badarg}}");
-						}
-
-						erl_free_term(Dev_Addr);
-						erl_free_term(Bus_Num);
-						erl_free_term(Pat1);
-						erl_free_term(Pat2);
-					} else {
-						resp = erl_format(
-								"{erl_i2c_cnode, {set_address, error, no_open_bus}}");
-					}
-
-					erl_send(erl_fd, fromp, resp);
-				}
-/**************
- * TODO: bus_info
- * {bus_info}
- * {bus_info, Bus_Number}
- */
-				else if (strncmp(ERL_ATOM_PTR(fnp), "bus_info", 8) == 0) {
-					if (i2c_bus_list) {
-						if ((argp = erl_element(2, tuplep)) && ERL_IS_INTEGER(argp)) {
-							bus_number = ERL_INT_VALUE(argp);
-							if ((i2c_bus = get_bus(bus_number, i2c_bus_list))) {
-								resp = erl_format(
-										"{erl_i2c_cnode, {bus_info, ~w}}",
-										get_bus_info(i2c_bus));
-							} else {
-								resp = erl_format(
-										"{erl_i2c_cnode, {bus_info, error, bus_not_open}}");
-							}
-						} else {
-// constructing list of bus_info
-							resp = erl_format(
-									"{erl_i2c_cnode, {bus_info, list_not_implemented_yet}}");
-						}
-
-						erl_free_term(argp);
-					} else {
-						resp = erl_format(
-								"{erl_i2c_cnode, {bus_info, error, no_open_bus}}");
-					}
-
-					erl_send(erl_fd, fromp, resp);
-				}
-/**************
- * get_bus
- * {get_bus}
- */
-				else if (strncmp(ERL_ATOM_PTR(fnp), "get_bus", 7) == 0) {
-					if (i2c_bus_list) {
-						if (current_bus >= 0) {
-							resp = erl_format(
-									"{erl_i2c_cnode, {get_bus, ok, ~i}}",
-									current_bus);
-						} else {
-							resp = erl_format(
-									"{erl_i2c_cnode, {get_bus, error, no_current_bus}}");
-						}
-					} else {
-						resp = erl_format(
-								"{erl_i2c_cnode, {get_bus, error, no_bus_open}}");
-					}
-
-					erl_send(erl_fd, fromp, resp);
-				}
-/**************
- * set_bus
- * {set_bus, Bus_Number}
- */
-				else if (strncmp(ERL_ATOM_PTR(fnp), "set_bus", 7) == 0) {
-					if (i2c_bus_list) {
-						if ((argp = erl_element(2, tuplep)) && ERL_IS_INTEGER(argp)) {
-							bus_number = ERL_INT_VALUE(argp);
-							if ((i2c_bus = get_bus(bus_number, i2c_bus_list))) {
-								current_bus = bus_number;
-								resp = erl_format(
-										"{erl_i2c_cnode, {set_bus, ok, ~i}}",
-										bus_number);
-							} else {
-								resp = erl_format(
-										"{erl_i2c_cnode, {set_bus, error, bus_not_open}}");
-							}
-						} else {
-							resp = erl_format(
-									"{erl_i2c_cnode, {set_bus, error, badarg}}");
-						}
-
-						erl_free_term(argp);
-					} else {
-						resp = erl_format(
-								"{erl_i2c_cnode, {set_bus, error, no_bus_open}}");
-					}
-
-					erl_send(erl_fd, fromp, resp);
-				}
-/**************
- * exit
- */
-				else if (strncmp(ERL_ATOM_PTR(fnp), "exit", 4) == 0) {
-					mainloop = false;
-
-					resp = erl_format(
-							"{erl_i2c_cnode, {ok, exiting}}");
-					erl_send(erl_fd, fromp, resp);
-				}
-/**************
- * unknown command
- */
-				else {
-					// What should I say?!
-					// I didn't even understand what you just said!
-					resp = erl_format(
-							"{erl_i2c_cnode, {error, unknown_command, ~w}}",
-							tuplep);
-
-					erl_send(erl_fd, fromp, resp);
-				}
-
-				erl_free_term(fromp);
-				erl_free_term(tuplep);
-				erl_free_term(fnp);
-				erl_free_term(emsg.from);
-				erl_free_term(emsg.msg);
-				erl_free_compound(resp);
-			}
+	// let the workers answer what they already have queued
+	stop_worker(&state.control);
+	destroy_worker(&state.control);
+
+	for (bus_number = 0; bus_number < I2C_MAX_BUSES; bus_number++) {
+		if ((i2c_bus = remove_bus(bus_number, &state))) {
+			stop_worker(&i2c_bus->worker);
+			release_bus(i2c_bus);
 		}
 	}
 
-	if (erl_fd) {
-		erl_close_connection(erl_fd);
+	if (state.erl_fd >= 0) {
+		close(state.erl_fd);
 	}
 
-	// cleanup i2c-buslist
-	while (i2c_bus_list != NULL) {
-		i2c_bus = i2c_bus_list;
-		i2c_bus_list = i2c_bus_list->next;
-
-		close(i2c_bus->bus_fd);
-		free(i2c_bus->bus_device);
-		free(i2c_bus);
+	if (state.trace) {
+		close_trace(state.trace);
 	}
 
+	free_job_pool(&state);
+
+	free(state.stats);
+
 	exit(0);
 }
 
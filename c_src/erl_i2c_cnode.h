@@ -0,0 +1,594 @@
+/*
+ * erl_i2c_cnode.h
+ *
+ *  Created on: 09.09.2012
+ *      Author: Christian Adams <morlac78@googlemail.com>
+ *   Copyright: (c) 2012 by Christian Adams
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *   MA 02110-1301 USA.
+ *
+ */
+#ifndef ERL_I2C_CNODE_H
+#define ERL_I2C_CNODE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "ei.h"
+
+#include "include/linux/i2c-dev.h"
+
+#ifndef __u8
+typedef unsigned char __u8;
+#endif
+
+// newer kernels report I2C_M_NOSTART on its own, older ones with
+// I2C_FUNC_PROTOCOL_MANGLING
+#ifndef I2C_FUNC_NOSTART
+#define I2C_FUNC_NOSTART 0x00000010
+#endif
+
+// limits enforced by the kernel for a single I2C_RDWR ioctl (see i2c-dev.c)
+#define I2C_RDWR_MAX_MSGS 42
+#define I2C_RDWR_MAX_LEN 8192
+
+// longest read_byte - longer than 32 bytes are read in chunks
+#define I2C_MAX_DATA_LEN 65536
+
+// buses are looked up by number - /dev/i2c-0 .. /dev/i2c-255
+#define I2C_MAX_BUSES 256
+// one fd per 7-bit device address
+#define I2C_MAX_DEVICES 128
+
+struct s_i2c_bus;
+struct s_cnode_state;
+struct s_command;
+
+/*
+ * layout of a 24Cxx-type EEPROM - page_size 0 if the device isn't one
+ */
+typedef struct s_eeprom {
+	int page_size;
+	// bytes of memory address sent before the data - 1 or 2
+	int address_width;
+} t_eeprom;
+
+/*
+ * writes to a device held back to be merged into block writes - a
+ * later write to a register replaces an earlier one
+ */
+typedef struct s_write_buffer {
+	// microseconds a write may be held back
+	long window;
+	bool pending[256];
+	unsigned char value[256];
+	int npending;
+	// CLOCK_MONOTONIC - window after the first write held back
+	struct timespec due;
+	// errno of a held back write that failed, reported by the next flush
+	int deferred_errno;
+} t_write_buffer;
+
+// register modes of the shadow - volatile registers are always read
+// from the device, cacheable ones from the shadow once known and
+// write-only ones are never read from the device
+#define REGISTER_VOLATILE 0
+#define REGISTER_CACHEABLE 1
+#define REGISTER_WRITE_ONLY 2
+
+#define I2C_MAX_REGISTERS 256
+
+/*
+ * what is known about the registers of one device - kept up to date
+ * by every write and every read of a cacheable register
+ */
+typedef struct s_register_shadow {
+	unsigned char mode[I2C_MAX_REGISTERS];
+	bool valid[I2C_MAX_REGISTERS];
+	unsigned char value[I2C_MAX_REGISTERS];
+} t_register_shadow;
+
+// phases of a request timed by the stats - envelope decoded and
+// queued, waiting in the queue, run by the handler (arguments, ioctls
+// and reply), of that the time in bus transfers and the rest, reply
+// sent
+#define STATS_DECODE 0
+#define STATS_QUEUE 1
+#define STATS_EXECUTE 2
+#define STATS_IOCTL 3
+#define STATS_ENCODE 4
+#define STATS_SEND 5
+#define STATS_PHASES 6
+
+// log-linear buckets of nanoseconds - 4 per power of two up to 2^36
+// (about 68s), everything longer lands in the last one
+#define STATS_SUB_BUCKET_BITS 2
+#define STATS_BUCKETS 144
+// room in the stats for every entry of the command table
+#define STATS_MAX_COMMANDS 32
+// errors are counted by errno - 0 for errors without one
+#define STATS_MAX_ERRNO 134
+
+/*
+ * updated with relaxed atomics from every thread, never locked
+ */
+typedef struct s_histogram {
+	unsigned long long count;
+	unsigned long long sum;
+	unsigned long long max;
+	unsigned int buckets[STATS_BUCKETS];
+} t_histogram;
+
+typedef struct s_stats {
+	t_histogram phases[STATS_MAX_COMMANDS][STATS_PHASES];
+	unsigned int errors[STATS_MAX_COMMANDS][STATS_MAX_ERRNO];
+} t_stats;
+
+// kinds of traced transactions - register reads and writes (reg is
+// the register), combined transfers (reg is the number of messages),
+// scan probes (reg is how it probed, the payload the byte read)
+#define TRACE_READ 1
+#define TRACE_WRITE 2
+#define TRACE_RDWR 3
+#define TRACE_PROBE 4
+#define TRACE_PROBE_QUICK 0
+#define TRACE_PROBE_READ 1
+// the rest of the ring up to its end is unused
+#define TRACE_PAD 0xff
+
+#define TRACE_MAGIC "erli2ctr"
+#define TRACE_VERSION 1
+// the ring size of a trace if not given
+#define TRACE_DEFAULT_RING (64 * 1024 * 1024)
+#define TRACE_MIN_RING (64 * 1024)
+
+/*
+ * start of a trace file - the ring follows right after it; head and
+ * tail are byte offsets counting up since the trace was opened, the
+ * ring position being offset % ring_size
+ */
+typedef struct s_trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+	uint64_t ring_size;
+	// next record written, oldest record kept
+	uint64_t head;
+	uint64_t tail;
+	// records written, and too big to be written
+	uint64_t records;
+	uint64_t dropped;
+} t_trace_header;
+
+/*
+ * 8 byte aligned - followed by len bytes of payload and padding up to size
+ */
+typedef struct s_trace_record {
+	uint32_t size;
+	uint8_t type;
+	uint8_t bus;
+	uint8_t address;
+	uint8_t reg;
+	// CLOCK_MONOTONIC nanoseconds at the start of the transaction
+	uint64_t timestamp;
+	uint32_t duration;
+	// errno of a failed transaction - 0 for success
+	int32_t result;
+	uint32_t len;
+	uint32_t reserved;
+} t_trace_record;
+
+#define TRACE_PAYLOAD(record) ((unsigned char*) (record) + sizeof(t_trace_record))
+
+// one message of a TRACE_RDWR record, followed by its len bytes of data
+typedef struct s_trace_msg {
+	uint16_t addr;
+	uint16_t flags;
+	uint16_t len;
+} t_trace_msg;
+
+typedef struct s_trace {
+	// held while a record is written
+	pthread_mutex_t lock;
+	int fd;
+	size_t map_len;
+	t_trace_header* header;
+	unsigned char* ring;
+	bool writable;
+} t_trace;
+
+/*
+ * one request waiting in a worker queue - data holds the encoded
+ * reference (ref_len bytes, 0 if the request was untagged) followed
+ * by the encoded command term
+ */
+typedef struct s_job {
+	erlang_pid from;
+	int ref_len;
+	int len;
+	char* data;
+	// bytes allocated for data - kept with the job in the pool
+	int size;
+	// for the stats - NULL for unknown commands
+	const struct s_command* command;
+	// CLOCK_MONOTONIC - when the request came in and was queued
+	struct timespec received;
+	struct timespec queued;
+	struct s_job *next;
+} t_job;
+
+typedef struct s_job_queue {
+	pthread_mutex_t lock;
+	// waits on CLOCK_MONOTONIC, so it can time out at the next sample
+	pthread_cond_t cond;
+	t_job *head;
+	t_job *tail;
+	bool stopping;
+	// the subscriptions changed - the deadline waited for may be stale
+	bool rescheduled;
+} t_job_queue;
+
+/*
+ * a register of one device polled periodically by the worker of its
+ * bus - every sample is sent to the subscriber as
+ * {erl_i2c_sample, Id, Timestamp, Data} or, if batched, collected in
+ * records and sent packed as {erl_i2c_samples, Id, Data_Len, Records}
+ */
+typedef struct s_subscription {
+	long id;
+	erlang_pid to;
+	int device_address;
+	int device_register;
+	int len;
+	// microseconds
+	long interval;
+	// CLOCK_MONOTONIC
+	struct timespec due;
+	// samples per message - 1 sends every sample on its own
+	int batch_count;
+	// microseconds the first sample in records may wait, 0 for no limit
+	long flush_after;
+	struct timespec flush_due;
+	// batch_count records of SAMPLE_RECORD_SIZE(len) bytes
+	unsigned char* records;
+	int nrecords;
+	// a watch only notifies {erl_i2c_change, Id, Timestamp, Data} if the
+	// masked value differs from the last one notified - by more than
+	// hysteresis if that's not 0 (the value read as unsigned big endian)
+	bool watch;
+	unsigned char mask[I2C_SMBUS_I2C_BLOCK_MAX];
+	long hysteresis;
+	unsigned char last[I2C_SMBUS_I2C_BLOCK_MAX];
+	// -1 before the first notification, 0 if the last read failed
+	int last_len;
+	// set while the worker reads and sends without the subscription
+	// lock - an unsubscribe meanwhile leaves freeing it to the worker
+	bool polling;
+	bool removed;
+	// the subscriber is gone (sending to it failed) - dropped after the poll
+	bool failed;
+	struct s_subscription *next;
+	// the subscriptions of one poll
+	struct s_subscription *next_due;
+} t_subscription;
+
+/*
+ * a thread working off one queue - either the worker of one bus
+ * (bus != NULL) or the control worker running everything not bound
+ * to a single bus (open_bus, close_bus, batch, ...)
+ */
+typedef struct s_worker {
+	pthread_t thread;
+	t_job_queue queue;
+	// only ever used by the worker of a bus
+	pthread_mutex_t subscription_lock;
+	t_subscription *subscriptions;
+	struct s_i2c_bus *bus;
+	struct s_cnode_state *state;
+	ei_x_buff reply;
+	bool running;
+} t_worker;
+
+/*
+ * what is behind a bus - the i2c-dev driver of the kernel or simulated
+ * devices. handles are what a backend hands out for the bus and for
+ * every device bound to one (fds for the kernel); everything but
+ * open_bus runs with i2c_bus->lock held. returns and errno as the
+ * I2C_FUNCS, I2C_SLAVE, I2C_SMBUS and I2C_RDWR ioctls
+ */
+typedef struct s_bus_backend {
+	const char* name;
+	// a new unbound handle or -1
+	int (*open)(struct s_i2c_bus* i2c_bus);
+	void (*close)(struct s_i2c_bus* i2c_bus, int handle);
+	int (*funcs)(struct s_i2c_bus* i2c_bus, int handle, unsigned long* funcs);
+	int (*set_address)(struct s_i2c_bus* i2c_bus, int handle, int device_address);
+	int (*smbus)(struct s_i2c_bus* i2c_bus, int handle, char read_write, __u8 command,
+			int size, union i2c_smbus_data* data);
+	int (*rdwr)(struct s_i2c_bus* i2c_bus, struct i2c_msg* msgs, int nmsgs);
+	// after the last handle is closed - NULL if there is nothing to free
+	void (*release)(struct s_i2c_bus* i2c_bus);
+} t_bus_backend;
+
+typedef struct s_i2c_bus {
+	int bus_number;
+	char* bus_device;
+	const t_bus_backend* backend;
+	// whatever the backend keeps for the bus
+	void* backend_data;
+	// unbound handle, used for I2C_RDWR which addresses every message itself
+	int bus_fd;
+	// one handle per device, bound with I2C_SLAVE when first used - so
+	// switching between devices costs no ioctl (-1 if not opened yet)
+	int device_fds[I2C_MAX_DEVICES];
+	// NULL until a register map is set for the device
+	t_register_shadow *shadows[I2C_MAX_DEVICES];
+	t_eeprom eeproms[I2C_MAX_DEVICES];
+	// NULL unless writes to the device are coalesced
+	t_write_buffer *write_buffers[I2C_MAX_DEVICES];
+	int device_address;
+	int device_register;
+	// I2C_FUNC_* bits the adapter reported when the bus was opened
+	unsigned long funcs;
+	// set once I2C_RDWR failed with EOPNOTSUPP - SMBus blocks only then
+	bool rdwr_unsupported;
+	// register and data of a long write as one message, for adapters
+	// that can't continue a message with I2C_M_NOSTART - NULL otherwise
+	__u8 *write_msg;
+	// NULL if it couldn't be allocated - the bus isn't timed then
+	t_stats *stats;
+	// NULL unless transactions are traced
+	t_trace *trace;
+	// devices found by the last scan - bit 7 of byte 0 is address 0
+	unsigned char inventory[I2C_MAX_DEVICES / 8];
+	bool scanned;
+	// held around every transaction on the bus
+	pthread_mutex_t lock;
+	// one reference for the bus list, one for the worker and one
+	// for every request currently using the bus
+	int refs;
+	t_worker worker;
+} t_i2c_bus;
+
+typedef struct s_cnode_state {
+	// protects i2c_buses, open_buses and current_bus
+	pthread_mutex_t lock;
+	t_i2c_bus *i2c_buses[I2C_MAX_BUSES];
+	int open_buses;
+	int current_bus;
+	// replies are sent from several threads over the one connection
+	// (C-Node only - the NIF sends with enif_send)
+	pthread_mutex_t send_lock;
+	int erl_fd;
+	// run as a port program - {packet, 4} framed requests on stdin,
+	// replies and messages on stdout instead of erl_fd
+	bool port;
+	t_worker control;
+	// this C-Node's share of several - subscription ids are unique
+	// across all of them (id % instances == instance)
+	int instance;
+	int instances;
+	long last_subscription_id;
+	// requests not run for an open bus
+	t_stats *stats;
+	// what buses are opened with - kernel_backend unless simulated
+	const t_bus_backend* backend;
+	// given to every bus opened - NULL unless tracing
+	t_trace *trace;
+	// jobs done with, kept for the next requests
+	pthread_mutex_t pool_lock;
+	t_job *job_pool;
+	int pooled_jobs;
+	// every allocation made for a request - flat once the pool and the
+	// buffers have grown to what the traffic needs
+	unsigned long allocations;
+	volatile bool mainloop;
+} t_cnode_state;
+
+/*
+ * one decoded request - the command atom and the arity are already
+ * consumed, index points to the first argument; bus is the bus the
+ * request was resolved to (NULL if not open)
+ */
+typedef struct s_request {
+	const char* buf;
+	int index;
+	int arity;
+	const char* command;
+	t_i2c_bus *bus;
+} t_request;
+
+/* erl_i2c_cnode.c or erl_i2c_nif.c - whichever frontend is linked */
+int send_reply(t_cnode_state* state, erlang_pid* to, ei_x_buff* reply);
+
+/* erl_i2c_bus.c */
+extern const t_bus_backend kernel_backend;
+
+t_i2c_bus* open_bus(int bus_number, const t_bus_backend* backend);
+t_i2c_bus* acquire_bus(int bus_number, t_cnode_state* state);
+void release_bus(t_i2c_bus* i2c_bus);
+int add_bus(t_i2c_bus* i2c_bus, t_cnode_state* state);
+t_i2c_bus* remove_bus(int bus_number, t_cnode_state* state);
+bool any_bus_open(t_cnode_state* state);
+int i2c_set_address(t_i2c_bus* i2c_bus, int handle, int device_address);
+unsigned long long bus_ioctl_ns(void);
+int i2c_device_fd(t_i2c_bus* i2c_bus, int device_address);
+int i2c_rdwr(t_i2c_bus* i2c_bus, struct i2c_msg* msgs, int nmsgs);
+int i2c_probe(t_i2c_bus* i2c_bus, int address, bool quick);
+int i2c_scan(t_i2c_bus* i2c_bus);
+int i2c_read_data(t_i2c_bus* i2c_bus, int device_fd, int device_address,
+		int device_register, int len, __u8* data);
+int i2c_write_data(t_i2c_bus* i2c_bus, int device_fd, int device_address,
+		int device_register, int len, const __u8* data);
+
+/* erl_i2c_sim.c */
+// clock of the simulated buses if not set - standard mode
+#define SIM_DEFAULT_CLOCK 100000
+// handles a simulated bus can hand out - the bus and every device
+#define SIM_MAX_HANDLES (I2C_MAX_DEVICES + 1)
+
+extern const t_bus_backend sim_backend;
+
+int sim_set_clock(long clock_hz);
+int sim_add_devices(const char* addresses);
+int sim_set_nak(const char* spec);
+
+/* erl_i2c_trace.c */
+t_trace* open_trace(const char* path, size_t ring_size);
+t_trace* map_trace(const char* path);
+void close_trace(t_trace* trace);
+void trace_data(t_trace* trace, int type, t_i2c_bus* i2c_bus, int device_address,
+		int device_register, const struct timespec* started, const struct timespec* done,
+		int result, const __u8* data, int len);
+void trace_rdwr(t_trace* trace, t_i2c_bus* i2c_bus, struct i2c_msg* msgs, int nmsgs,
+		const struct timespec* started, const struct timespec* done, int result);
+const t_trace_record* next_trace_record(t_trace* trace, uint64_t* offset);
+
+/* erl_i2c_worker.c */
+// jobs kept in the pool - and the longest data a pooled job keeps
+#define JOB_POOL_MAX 256
+#define JOB_POOL_MAX_DATA (64 * 1024)
+// data allocated for a job at least - most requests fit
+#define JOB_MIN_DATA 256
+
+// encode buffers of a thread - see scratch_x_buff()
+#define SCRATCH_BATCH 0
+#define SCRATCH_PACKET 1
+#define SCRATCH_REPLY 2
+#define SCRATCH_SAMPLES 3
+#define SCRATCH_X_BUFFS 4
+
+#define COUNT_ALLOCATION(state) \
+	__atomic_add_fetch(&(state)->allocations, 1, __ATOMIC_RELAXED)
+
+int start_worker(t_worker* worker, t_i2c_bus* i2c_bus, t_cnode_state* state);
+void stop_worker(t_worker* worker);
+void destroy_worker(t_worker* worker);
+int enqueue_job(t_worker* worker, t_job* job);
+t_job* new_job(t_cnode_state* state, const erlang_pid* from, const char* ref, int ref_len,
+		const char* term, int term_len);
+void free_job(t_cnode_state* state, t_job* job);
+void free_job_pool(t_cnode_state* state);
+void* scratch_buffer(t_cnode_state* state, size_t len);
+ei_x_buff* scratch_x_buff(t_cnode_state* state, int which);
+void free_scratch(void);
+void run_job(t_job* job, t_i2c_bus* i2c_bus, ei_x_buff* reply, t_cnode_state* state);
+int send_packet(t_cnode_state* state, const char* buf, int len);
+void reschedule_worker(t_worker* worker);
+void timespec_add_us(struct timespec* ts, long us);
+bool timespec_before(const struct timespec* a, const struct timespec* b);
+
+/* erl_i2c_stats.c */
+t_stats* new_stats(void);
+unsigned long long elapsed_ns(const struct timespec* from, const struct timespec* to);
+void stats_phase(t_stats* stats, const struct s_command* cmd, int phase,
+		const struct timespec* from, const struct timespec* to);
+void stats_record(t_stats* stats, const struct s_command* cmd, int phase,
+		unsigned long long ns);
+void stats_error(t_stats* stats, const struct s_command* cmd, int errnum);
+void encode_stats(ei_x_buff* reply, t_stats* stats, bool reset);
+
+/* erl_i2c_shadow.c */
+// results of shadow_read()
+#define SHADOW_MISS 0
+#define SHADOW_HIT 1
+#define SHADOW_WRITE_ONLY -1
+
+int shadow_set_mode(t_i2c_bus* i2c_bus, int device_address, int device_register, int mode);
+int shadow_read(t_i2c_bus* i2c_bus, int device_address, int device_register, int len,
+		__u8* data);
+void shadow_update(t_i2c_bus* i2c_bus, int device_address, int device_register,
+		const __u8* data, int len, bool written);
+void shadow_invalidate(t_i2c_bus* i2c_bus, int device_address, int device_register);
+int shadow_sync(t_i2c_bus* i2c_bus, int device_address);
+void free_shadows(t_i2c_bus* i2c_bus);
+
+/* erl_i2c_coalesce.c */
+int coalesce_set_window(t_i2c_bus* i2c_bus, int device_address, long window);
+bool coalesce_write(t_i2c_bus* i2c_bus, int device_address, int device_register,
+		const __u8* data, int len);
+int flush_writes(t_i2c_bus* i2c_bus, int device_address, bool report);
+bool next_write_due(t_i2c_bus* i2c_bus, struct timespec* due);
+void run_due_writes(t_i2c_bus* i2c_bus);
+void free_write_buffers(t_i2c_bus* i2c_bus);
+
+/* erl_i2c_eeprom.c */
+#define EEPROM_MAX_PAGE_SIZE 256
+// largest part addressed - 24C1024 and alike
+#define EEPROM_MAX_LEN (128 * 1024)
+// a write cycle takes 5ms (10ms for old parts) - give up after that
+#define EEPROM_WRITE_TIMEOUT 50000
+
+int eeprom_read(t_i2c_bus* i2c_bus, int device_address, long offset, long len, __u8* data);
+int eeprom_write(t_i2c_bus* i2c_bus, int device_address, long offset, long len,
+		const __u8* data);
+
+/* erl_i2c_subscription.c */
+// shortest interval a register may be polled with (microseconds)
+#define SUBSCRIPTION_MIN_INTERVAL 100
+// most samples sent in one message
+#define SUBSCRIPTION_MAX_BATCH 4096
+// watches with hysteresis compare the value as one integer
+#define WATCH_MAX_NUMERIC_LEN 8
+// <<Timestamp:64, Read_Len:8, Data:Len/binary>> - Read_Len 0 for a failed read
+#define SAMPLE_RECORD_SIZE(len) (8 + 1 + (len))
+
+t_subscription* new_subscription(const erlang_pid* to, int device_address,
+		int device_register, int len, long interval, int batch_count,
+		long flush_after, t_cnode_state* state);
+void set_watch(t_subscription* subscription, const char* mask, long mask_len,
+		long hysteresis);
+void free_subscription(t_subscription* subscription);
+int flush_samples(t_subscription* subscription, ei_x_buff* buf, t_cnode_state* state);
+void add_subscription(t_worker* worker, t_subscription* subscription);
+bool remove_subscription(t_worker* worker, long id, ei_x_buff* buf);
+void free_subscriptions(t_worker* worker);
+bool next_subscription_due(t_worker* worker, struct timespec* due);
+void run_due_subscriptions(t_worker* worker);
+int encode_subscriptions(ei_x_buff* list, t_worker* worker);
+
+/* erl_i2c_commands.c */
+#define CMD_ALLOW_IN_BATCH 0x01
+// runs on the worker of the bus it addresses
+#define CMD_ON_BUS 0x02
+// cheap and answered right away by the receiving thread
+#define CMD_INLINE 0x04
+// naming a bus makes it the current bus
+#define CMD_SELECTS_BUS 0x08
+
+typedef int (*t_command_handler)(t_request* req, ei_x_buff* reply, t_cnode_state* state);
+
+typedef struct s_command {
+	const char* name;
+	t_command_handler handler;
+	int flags;
+	// requests with at least this arity name the bus in their first
+	// argument, shorter ones go to the current bus
+	int bus_arity;
+} t_command;
+
+void init_command_table(void);
+const t_command* find_command(const char* name);
+int command_index(const t_command* cmd);
+const t_command* command_at(int index);
+t_i2c_bus* resolve_bus(const t_command* cmd, const char* buf, int index, int arity,
+		t_cnode_state* state);
+int execute_command(const char* buf, int* index, ei_x_buff* reply,
+		t_cnode_state* state, t_i2c_bus* i2c_bus);
+
+#endif /* ERL_I2C_CNODE_H */
@@ -0,0 +1,253 @@
+/*
+ * erl_i2c_coalesce.c
+ *
+ *  Created on: 09.09.2012
+ *      Author: Christian Adams <morlac78@googlemail.com>
+ *   Copyright: (c) 2012 by Christian Adams
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *   MA 02110-1301 USA.
+ *
+ */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "erl_i2c_cnode.h"
+
+/*
+ * write coalescing - writes to a device are held back for a short
+ * window and then sent as few block writes as possible, one per run
+ * of consecutive registers (so devices have to auto-increment the
+ * register pointer)
+ *
+ * everything here must be called with i2c_bus->lock held - except
+ * next_write_due() and run_due_writes() used by the worker of the bus
+ * and free_write_buffers() which runs once nobody uses the bus anymore
+ */
+
+static t_write_buffer* get_write_buffer(t_i2c_bus* i2c_bus, int device_address) {
+	if (device_address < 0 || device_address >= I2C_MAX_DEVICES) {
+		return NULL;
+	}
+
+	return i2c_bus->write_buffers[device_address];
+}
+
+/*
+ * sends what the device has pending - returns the number of block
+ * writes; with report set -1 if one failed (now or earlier, in a flush
+ * nobody could be told about), otherwise the failure is kept for later
+ */
+static int flush_device(t_i2c_bus* i2c_bus, int device_address, bool report) {
+	t_write_buffer* buffer = get_write_buffer(i2c_bus, device_address);
+	int device_fd, first, len, writes = 0;
+
+	if (!buffer) {
+		return 0;
+	}
+
+	if (buffer->npending > 0) {
+		if ((device_fd = i2c_device_fd(i2c_bus, device_address)) < 0) {
+			buffer->deferred_errno = errno;
+		} else {
+			for (first = 0; first < 256; first += len) {
+				for (len = 0; first + len < 256 && len < I2C_SMBUS_I2C_BLOCK_MAX &&
+						buffer->pending[first + len]; len++);
+
+				if (len == 0) {
+					len = 1;
+					continue;
+				}
+
+				if (i2c_write_data(i2c_bus, device_fd, device_address, first, len,
+						buffer->value + first) < 0) {
+					buffer->deferred_errno = errno;
+				} else {
+					shadow_update(i2c_bus, device_address, first, buffer->value + first, len, true);
+					writes++;
+				}
+			}
+		}
+
+		memset(buffer->pending, 0, sizeof(buffer->pending));
+		buffer->npending = 0;
+	}
+
+	if (report && buffer->deferred_errno) {
+		errno = buffer->deferred_errno;
+		buffer->deferred_errno = 0;
+
+		return -1;
+	}
+
+	return writes;
+}
+
+/*
+ * starts holding back writes to the device for window microseconds -
+ * a window of 0 flushes and stops coalescing
+ */
+int coalesce_set_window(t_i2c_bus* i2c_bus, int device_address, long window) {
+	t_write_buffer* buffer;
+	int result = 0;
+
+	if (device_address < 0 || device_address >= I2C_MAX_DEVICES || window < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (window == 0) {
+		if ((buffer = i2c_bus->write_buffers[device_address])) {
+			result = flush_device(i2c_bus, device_address, true);
+
+			free(buffer);
+			i2c_bus->write_buffers[device_address] = NULL;
+		}
+
+		return result < 0 ? -1 : 0;
+	}
+
+	if (!(buffer = i2c_bus->write_buffers[device_address])) {
+		if (!(buffer = (t_write_buffer*)calloc(1, sizeof(t_write_buffer)))) {
+			return -1;
+		}
+
+		i2c_bus->write_buffers[device_address] = buffer;
+	}
+
+	buffer->window = window;
+
+	return 0;
+}
+
+/*
+ * holds the write back if writes to the device are coalesced - false
+ * if the caller has to write it itself
+ */
+bool coalesce_write(t_i2c_bus* i2c_bus, int device_address, int device_register,
+		const __u8* data, int len) {
+	t_write_buffer* buffer = get_write_buffer(i2c_bus, device_address);
+	int i;
+
+	if (!buffer || device_register + len > 256) {
+		return false;
+	}
+
+	if (buffer->npending == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &buffer->due);
+		timespec_add_us(&buffer->due, buffer->window);
+
+		// the worker of the bus has to wake up in time for the flush
+		reschedule_worker(&i2c_bus->worker);
+	}
+
+	for (i = 0; i < len; i++) {
+		if (!buffer->pending[device_register + i]) {
+			buffer->pending[device_register + i] = true;
+			buffer->npending++;
+		}
+
+		buffer->value[device_register + i] = data[i];
+	}
+
+	return true;
+}
+
+/*
+ * flushes one device - or all devices of the bus if device_address is
+ * -1; report as in flush_device()
+ */
+int flush_writes(t_i2c_bus* i2c_bus, int device_address, bool report) {
+	int writes = 0, result, i;
+	bool failed = false;
+
+	if (device_address >= 0) {
+		return flush_device(i2c_bus, device_address, report);
+	}
+
+	for (i = 0; i < I2C_MAX_DEVICES; i++) {
+		if ((result = flush_device(i2c_bus, i, report)) < 0) {
+			failed = true;
+		} else {
+			writes += result;
+		}
+	}
+
+	return failed ? -1 : writes;
+}
+
+/*
+ * false if there's nothing held back on the bus
+ */
+bool next_write_due(t_i2c_bus* i2c_bus, struct timespec* due) {
+	t_write_buffer* buffer;
+	bool found = false;
+	int i;
+
+	pthread_mutex_lock(&i2c_bus->lock);
+
+	for (i = 0; i < I2C_MAX_DEVICES; i++) {
+		if ((buffer = i2c_bus->write_buffers[i]) && buffer->npending > 0 &&
+				(!found || timespec_before(&buffer->due, due))) {
+			*due = buffer->due;
+			found = true;
+		}
+	}
+
+	pthread_mutex_unlock(&i2c_bus->lock);
+
+	return found;
+}
+
+/*
+ * flushes every device whose window is over - called by the worker of
+ * the bus, which takes the bus lock itself; failures are kept for the
+ * next explicit flush
+ */
+void run_due_writes(t_i2c_bus* i2c_bus) {
+	t_write_buffer* buffer;
+	struct timespec now;
+	int i;
+
+	pthread_mutex_lock(&i2c_bus->lock);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	for (i = 0; i < I2C_MAX_DEVICES; i++) {
+		if ((buffer = i2c_bus->write_buffers[i]) && buffer->npending > 0 &&
+				!timespec_before(&now, &buffer->due)) {
+			flush_device(i2c_bus, i, false);
+		}
+	}
+
+	pthread_mutex_unlock(&i2c_bus->lock);
+}
+
+/*
+ * what's still held back is written before the bus goes away
+ */
+void free_write_buffers(t_i2c_bus* i2c_bus) {
+	int i;
+
+	for (i = 0; i < I2C_MAX_DEVICES; i++) {
+		if (i2c_bus->write_buffers[i]) {
+			flush_device(i2c_bus, i, false);
+
+			free(i2c_bus->write_buffers[i]);
+			i2c_bus->write_buffers[i] = NULL;
+		}
+	}
+}
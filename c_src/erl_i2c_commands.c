@@ -0,0 +1,1739 @@
+/*
+ * erl_i2c_commands.c
+ *
+ *  Created on: 09.09.2012
+ *      Author: Christian Adams <morlac78@googlemail.com>
+ *   Copyright: (c) 2012 by Christian Adams
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *   MA 02110-1301 USA.
+ *
+ */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "erl_i2c_cnode.h"
+
+static const struct {
+	unsigned long func;
+	const char* name;
+} functionality[] = {
+	{ I2C_FUNC_I2C, "i2c" },
+	{ I2C_FUNC_10BIT_ADDR, "ten_bit_addr" },
+	{ I2C_FUNC_PROTOCOL_MANGLING, "protocol_mangling" },
+	{ I2C_FUNC_NOSTART, "nostart" },
+	{ I2C_FUNC_SMBUS_PEC, "smbus_pec" },
+	{ I2C_FUNC_SMBUS_QUICK, "smbus_quick" },
+	{ I2C_FUNC_SMBUS_READ_BYTE, "smbus_read_byte" },
+	{ I2C_FUNC_SMBUS_WRITE_BYTE, "smbus_write_byte" },
+	{ I2C_FUNC_SMBUS_READ_BYTE_DATA, "smbus_read_byte_data" },
+	{ I2C_FUNC_SMBUS_WRITE_BYTE_DATA, "smbus_write_byte_data" },
+	{ I2C_FUNC_SMBUS_READ_WORD_DATA, "smbus_read_word_data" },
+	{ I2C_FUNC_SMBUS_WRITE_WORD_DATA, "smbus_write_word_data" },
+	{ I2C_FUNC_SMBUS_PROC_CALL, "smbus_proc_call" },
+	{ I2C_FUNC_SMBUS_READ_BLOCK_DATA, "smbus_read_block_data" },
+	{ I2C_FUNC_SMBUS_WRITE_BLOCK_DATA, "smbus_write_block_data" },
+	{ I2C_FUNC_SMBUS_READ_I2C_BLOCK, "smbus_read_i2c_block" },
+	{ I2C_FUNC_SMBUS_WRITE_I2C_BLOCK, "smbus_write_i2c_block" },
+};
+
+// [atom()] of what the adapter can do
+static void encode_functionality(ei_x_buff* reply, unsigned long funcs) {
+	int i;
+
+	for (i = 0; i < sizeof(functionality) / sizeof(functionality[0]); i++) {
+		if (funcs & functionality[i].func) {
+			ei_x_encode_list_header(reply, 1);
+			ei_x_encode_atom(reply, functionality[i].name);
+		}
+	}
+
+	ei_x_encode_empty_list(reply);
+}
+
+void encode_bus_info(ei_x_buff* reply, t_i2c_bus* i2c_bus) {
+	ei_x_encode_list_header(reply, 8);
+
+	ei_x_encode_tuple_header(reply, 2);
+	ei_x_encode_atom(reply, "bus_number");
+	ei_x_encode_long(reply, i2c_bus->bus_number);
+
+	ei_x_encode_tuple_header(reply, 2);
+	ei_x_encode_atom(reply, "bus_device");
+	ei_x_encode_string(reply, i2c_bus->bus_device);
+
+	ei_x_encode_tuple_header(reply, 2);
+	ei_x_encode_atom(reply, "backend");
+	ei_x_encode_atom(reply, i2c_bus->backend->name);
+
+	ei_x_encode_tuple_header(reply, 2);
+	ei_x_encode_atom(reply, "bus_fd");
+	ei_x_encode_long(reply, i2c_bus->bus_fd);
+
+	ei_x_encode_tuple_header(reply, 2);
+	ei_x_encode_atom(reply, "device_address");
+	ei_x_encode_long(reply, i2c_bus->device_address);
+
+	ei_x_encode_tuple_header(reply, 2);
+	ei_x_encode_atom(reply, "device_register");
+	ei_x_encode_long(reply, i2c_bus->device_register);
+
+	ei_x_encode_tuple_header(reply, 2);
+	ei_x_encode_atom(reply, "funcs");
+	ei_x_encode_ulong(reply, i2c_bus->funcs);
+
+	ei_x_encode_tuple_header(reply, 2);
+	ei_x_encode_atom(reply, "functionality");
+	encode_functionality(reply, i2c_bus->funcs);
+
+	ei_x_encode_empty_list(reply);
+}
+
+/*
+ * reply helpers - all of them return -1 so handlers can
+ * "return reply_error(...)" for failed commands
+ */
+
+// {Command, error, Reason}
+int reply_error(ei_x_buff* reply, const char* command, const char* reason) {
+	ei_x_encode_tuple_header(reply, 3);
+	ei_x_encode_atom(reply, command);
+	ei_x_encode_atom(reply, "error");
+	ei_x_encode_atom(reply, reason);
+
+	return -1;
+}
+
+// {Command, Status, "strerror(errno)"}
+// errno of the last reply_errno() on this thread - for the stats
+static __thread int replied_errno = 0;
+
+int reply_errno(ei_x_buff* reply, const char* command, const char* status) {
+	replied_errno = errno;
+
+	ei_x_encode_tuple_header(reply, 3);
+	ei_x_encode_atom(reply, command);
+	ei_x_encode_atom(reply, status);
+	ei_x_encode_string(reply, strerror(errno));
+
+	return -1;
+}
+
+// {Command, ok, Value}
+int reply_ok_long(ei_x_buff* reply, const char* command, long value) {
+	ei_x_encode_tuple_header(reply, 3);
+	ei_x_encode_atom(reply, command);
+	ei_x_encode_atom(reply, "ok");
+	ei_x_encode_long(reply, value);
+
+	return 0;
+}
+
+/*
+ * decodes count integers in a row
+ */
+int decode_longs(const char* buf, int* index, int count, long* values) {
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (ei_decode_long(buf, index, &values[i]) < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * points data right into the request buffer instead of copying
+ * the binary - valid as long as the request buffer is
+ */
+int decode_binary_ref(const char* buf, int* index, const char** data, long* len) {
+	int type, size;
+
+	if (ei_get_type(buf, index, &type, &size) < 0 || type != ERL_BINARY_EXT) {
+		return -1;
+	}
+
+	// BINARY_EXT: tag (1 byte), length (4 bytes), data
+	*data = buf + *index + 5;
+	*len = size;
+
+	return ei_skip_term(buf, index);
+}
+
+/*
+ * replies no_open_bus if there is no bus at all and
+ * bus_not_open if just the requested one isn't
+ */
+int reply_no_bus(t_request* req, ei_x_buff* reply, t_cnode_state* state) {
+	return reply_error(reply, req->command,
+			any_bus_open(state) ? "bus_not_open" : "no_open_bus");
+}
+
+/*************
+ * open_bus
+ * {open_bus, Bus_Number}
+ */
+int cmd_open_bus(t_request* req, ei_x_buff* reply, t_cnode_state* state) {
+	long args[1];
+	t_i2c_bus *i2c_bus;
+
+	if (req->arity != 2 || decode_longs(req->buf, &req->index, 1, args) < 0) {
+		return reply_error(reply, req->command, "badarg");
+	}
+
+	if ((i2c_bus = acquire_bus(args[0], state))) {
+		release_bus(i2c_bus);
+		return reply_error(reply, req->command, "already_open");
+	}
+
+	if ((i2c_bus = open_bus(args[0], state->backend)) == NULL) {
+		return reply_errno(reply, req->command, "error");
+	}
+
+	i2c_bus->trace = state->trace;
+
+	// the worker has to run before requests can be routed to the bus
+	if (start_worker(&i2c_bus->worker, i2c_bus, state) < 0) {
+		release_bus(i2c_bus);
+		return reply_errno(reply, req->command, "error");
+	}
+
+	add_bus(i2c_bus, state);
+
+	pthread_mutex_lock(&state->lock);
+	state->current_bus = args[0];
+	pthread_mutex_unlock(&state->lock);
+
+	return reply_ok_long(reply, req->command, args[0]);
+}
+
+/**************
+ * close bus
+ * {close_bus, Bus_Number}
+ */
+int cmd_close_bus(t_request* req, ei_x_buff* reply, t_cnode_state* state) {
+	long args[1];
+	t_i2c_bus *i2c_bus;
+
+	if (!any_bus_open(state)) {
+		return reply_error(reply, req->command, "no_open_bus");
+	}
+
+	if (req->arity != 2 || decode_longs(req->buf, &req->index, 1, args) < 0) {
+		return reply_error(reply, req->command, "badarg");
+	}
+
+	if (!(i2c_bus = remove_bus(args[0], state))) {
+		return reply_error(reply, req->command, "bus_not_open");
+	}
+
+	// requests already queued for the bus are still answered
+	stop_worker(&i2c_bus->worker);
+	release_bus(i2c_bus);
+
+	ei_x_encode_tuple_header(reply, 2);
+	ei_x_encode_atom(reply, req->command);
+	ei_x_encode_atom(reply, "ok");
+
+	return 0;
+}
+
+/**************
+ * read byte
+ * {read_byte, Data_Len}
+ * {read_byte, Register, Data_Len}
+ * {read_byte, Device_Address, Register, Data_Len}
+ * {read_byte, Bus_Number, Device_Address, Register, Data_Len}
+ *
+ * address and register not given are the ones last used on the bus
+ *
+ * registers the device's register map marks cacheable are served
+ * from the shadow once known
+ **************/
+int cmd_read_byte(t_request* req, ei_x_buff* reply, t_cnode_state* state) {
+	long args[4];
+	t_i2c_bus *i2c_bus = req->bus;
+	int arity = req->arity;
+
+	int device_address;
+	int device_register;
+	int device_fd;
+	long device_data_len;
+	__u8 block_data[I2C_SMBUS_I2C_BLOCK_MAX];
+	__u8 *read_data = block_data;
+	int device_data_read;
+
+	if (!i2c_bus && !any_bus_open(state)) {
+		return reply_error(reply, req->command, "no_open_bus");
+	}
+
+	if (arity < 2 || arity > 5 || decode_longs(req->buf, &req->index, arity - 1, args) < 0) {
+		return reply_error(reply, req->command, "badarg");
+	}
+
+	if (!i2c_bus) {
+		return reply_error(reply, req->command, "bus_not_open");
+	}
+
+	device_data_len = args[arity - 2];
+
+	if (device_data_len < 0 || device_data_len > I2C_MAX_DATA_LEN) {
+		return reply_error(reply, req->command, "too_much_data_requested");
+	}
+
+	// anything longer than one SMBus block is read in chunks - into the
+	// scratch buffer of the thread
+	if (device_data_len > I2C_SMBUS_I2C_BLOCK_MAX &&
+			!(read_data = scratch_buffer(state, device_data_len))) {
+		return reply_error(reply, req->command, "enomem");
+	}
+
+	pthread_mutex_lock(&i2c_bus->lock);
+
+	device_address  = (arity >= 4) ? (unsigned char) args[arity - 4] : i2c_bus->device_address;
+	device_register = (arity >= 3) ? (unsigned char) args[arity - 3] : i2c_bus->device_register;
+
+	if ((device_fd = i2c_device_fd(i2c_bus, device_address)) < 0) {
+		pthread_mutex_unlock(&i2c_bus->lock);
+		return reply_errno(reply, req->command, "address_error");
+	}
+
+	// held back writes have to reach the device before it's read
+	flush_writes(i2c_bus, device_address, false);
+
+	switch (shadow_read(i2c_bus, device_address, device_register, device_data_len, read_data)) {
+	case SHADOW_HIT:
+		device_data_read = device_data_len;
+		break;
+
+	case SHADOW_WRITE_ONLY:
+		pthread_mutex_unlock(&i2c_bus->lock);
+		return reply_error(reply, req->command, "write_only");
+
+	default:
+		if ((device_data_read =
+				i2c_read_data(
+						i2c_bus,
+						device_fd,
+						device_address,
+						device_register,
+						device_data_len,
+						read_data)) < 0) {
+			pthread_mutex_unlock(&i2c_bus->lock);
+			return reply_errno(reply, req->command, "i2c_error");
+		}
+
+		shadow_update(i2c_bus, device_address, device_register, read_data, device_data_read, false);
+	}
+
+	i2c_bus->device_address = device_address;
+	i2c_bus->device_register = device_register;
+
+	pthread_mutex_unlock(&i2c_bus->lock);
+
+	ei_x_encode_tuple_header(reply, 4);
+	ei_x_encode_atom(reply, req->command);
+	ei_x_encode_atom(reply, "ok");
+	ei_x_encode_long(reply, device_data_read);
+	ei_x_encode_binary(reply, read_data, device_data_read);
+
+	return 0;
+}
+
+/**************
+ * write byte
+ * {write_byte, Data_Byte}
+ * {write_byte, Register, Data_Byte}
+ * {write_byte, Device_Address, Register, Data_Byte}
+ * {write_byte, Bus_Number, Device_Address, Register, Data_Byte}
+ *
+ * address and register not given are the ones last used on the bus
+ *
+ * writes to a device coalescing its writes are only held back and
+ * answered right away - failures are reported by the next flush
+ */
+int cmd_write_byte(t_request* req, ei_x_buff* reply, t_cnode_state* state) {
+	long args[4];
+	t_i2c_bus *i2c_bus = req->bus;
+	int arity = req->arity;
+
+	int device_address;
+	int device_register;
+	int device_fd;
+	const char *device_data = NULL;
+	long device_data_len = 0;
+
+	if (!i2c_bus && !any_bus_open(state)) {
+		return reply_error(reply, req->command, "no_open_bus");
+	}
+
+	if (arity < 2 || arity > 5 ||
+			decode_longs(req->buf, &req->index, arity - 2, args) < 0 ||
+			decode_binary_ref(req->buf, &req->index, &device_data, &device_data_len) < 0) {
+		return reply_error(reply, req->command, "badarg");
+	}
+
+	if (!i2c_bus) {
+		return reply_error(reply, req->command, "bus_not_open");
+	}
+
+	pthread_mutex_lock(&i2c_bus->lock);
+
+	device_address  = (arity >= 4) ? (unsigned char) args[arity - 4] : i2c_bus->device_address;
+	device_register = (arity >= 3) ? (unsigned char) args[arity - 3] : i2c_bus->device_register;
+
+	if ((device_fd = i2c_device_fd(i2c_bus, device_address)) < 0) {
+		pthread_mutex_unlock(&i2c_bus->lock);
+		return reply_errno(reply, req->command, "address_error");
+	}
+
+	// as long as a read - whether the adapter can send it is up to
+	// write_data()
+	if (device_data_len > I2C_MAX_DATA_LEN) {
+		pthread_mutex_unlock(&i2c_bus->lock);
+		return reply_error(reply, req->command, "too_much_data");
+	}
+
+	if (coalesce_write(i2c_bus, device_address, device_register,
+			(const __u8*) device_data, device_data_len)) {
+		i2c_bus->device_address = device_address;
+		i2c_bus->device_register = device_register;
+
+		pthread_mutex_unlock(&i2c_bus->lock);
+
+		return reply_ok_long(reply, req->command, device_data_len);
+	}
+
+	// keeps the order with writes held back before
+	flush_writes(i2c_bus, device_address, false);
+
+	if (i2c_write_data(
+			i2c_bus,
+			device_fd,
+			device_address,
+			device_register,
+			device_data_len,
+			(const __u8*) device_data) < 0) {
+		pthread_mutex_unlock(&i2c_bus->lock);
+		return reply_errno(reply, req->command, "i2c_error");
+	}
+
+	shadow_update(i2c_bus, device_address, device_register,
+			(const __u8*) device_data, device_data_len, true);
+
+	i2c_bus->device_address = device_address;
+	i2c_bus->device_register = device_register;
+
+	pthread_mutex_unlock(&i2c_bus->lock);
+
+	return reply_ok_long(reply, req->command, device_data_len);
+}
+
+/**************
+ * transfer
+ * {transfer, Bus_Number, [{write, Device_Address, Data} |
+ *                         {read, Device_Address, Data_Len}]}
+ *
+ * all segments are sent as one I2C_RDWR - repeated start between
+ * the segments, only one stop at the end
+ */
+int cmd_transfer(t_request* req, ei_x_buff* reply, t_cnode_state* state) {
+	struct i2c_msg msgs[I2C_RDWR_MAX_MSGS];
+	char segment_op[MAXATOMLEN_UTF8];
+	int nmsgs = 0, nreads = 0, segment_arity, i;
+	long args[1], segment_addr, segment_len;
+	const char *segment_data;
+	t_i2c_bus *i2c_bus = req->bus;
+	long read_len = 0;
+	char *read_data = NULL;
+	int result;
+
+	if (!i2c_bus && !any_bus_open(state)) {
+		return reply_error(reply, req->command, "no_open_bus");
+	}
+
+	if (req->arity != 3 || decode_longs(req->buf, &req->index, 1, args) < 0 ||
+			ei_decode_list_header(req->buf, &req->index, &nmsgs) < 0 || nmsgs <= 0) {
+		return reply_error(reply, req->command, "badarg");
+	}
+
+	if (nmsgs > I2C_RDWR_MAX_MSGS) {
+		return reply_error(reply, req->command, "too_many_messages");
+	}
+
+	if (!i2c_bus) {
+		return reply_error(reply, req->command, "bus_not_open");
+	}
+
+	memset(msgs, 0, sizeof(msgs));
+
+	for (i = 0; i < nmsgs; i++) {
+		if (ei_decode_tuple_header(req->buf, &req->index, &segment_arity) < 0 ||
+				segment_arity != 3 ||
+				ei_decode_atom(req->buf, &req->index, segment_op) < 0 ||
+				ei_decode_long(req->buf, &req->index, &segment_addr) < 0) {
+			break;
+		}
+
+		msgs[i].addr = segment_addr;
+
+		if (strcmp(segment_op, "write") == 0 &&
+				decode_binary_ref(req->buf, &req->index, &segment_data, &segment_len) == 0 &&
+				segment_len <= I2C_RDWR_MAX_LEN) {
+			// data is sent straight from the request buffer
+			msgs[i].flags = 0;
+			msgs[i].len = segment_len;
+			msgs[i].buf = (char*) segment_data;
+		} else if (strcmp(segment_op, "read") == 0 &&
+				ei_decode_long(req->buf, &req->index, &segment_len) == 0 &&
+				segment_len > 0 && segment_len <= I2C_RDWR_MAX_LEN) {
+			// placed in the scratch buffer once all are known
+			msgs[i].flags = I2C_M_RD;
+			msgs[i].len = segment_len;
+			read_len += segment_len;
+			nreads++;
+		} else {
+			break;
+		}
+	}
+
+	if (i < nmsgs) {
+		return reply_error(reply, req->command, "badarg");
+	}
+
+	if (nreads > 0 && !(read_data = scratch_buffer(state, read_len))) {
+		return reply_error(reply, req->command, "enomem");
+	}
+
+	for (i = 0; i < nmsgs; i++) {
+		if (msgs[i].flags & I2C_M_RD) {
+			msgs[i].buf = read_data;
+			read_data += msgs[i].len;
+		}
+	}
+
+	pthread_mutex_lock(&i2c_bus->lock);
+
+	flush_writes(i2c_bus, -1, false);
+
+	result = i2c_rdwr(i2c_bus, msgs, nmsgs);
+
+	// raw writes can't be mapped to registers - whatever the shadow
+	// knew about the devices written to may be stale now
+	for (i = 0; i < nmsgs; i++) {
+		if (!(msgs[i].flags & I2C_M_RD)) {
+			shadow_invalidate(i2c_bus, msgs[i].addr, -1);
+		}
+	}
+
+	pthread_mutex_unlock(&i2c_bus->lock);
+
+	if (result < 0) {
+		return reply_errno(reply, req->command, "i2c_error");
+	}
+
+	ei_x_encode_tuple_header(reply, 3);
+	ei_x_encode_atom(reply, req->command);
+	ei_x_encode_atom(reply, "ok");
+
+	if (nreads > 0) {
+		ei_x_encode_list_header(reply, nreads);
+
+		for (i = 0; i < nmsgs; i++) {
+			if (msgs[i].flags & I2C_M_RD) {
+				ei_x_encode_binary(reply, msgs[i].buf, msgs[i].len);
+			}
+		}
+	}
+
+	ei_x_encode_empty_list(reply);
+
+	return 0;
+}
+
+/**************
+ * get_address
+ * {get_address} - returns device_address set on current bus
+ * {get_address, Bus_Number}
+ */
+int cmd_get_address(t_request* req, ei_x_buff* reply, t_cnode_state* state) {
+	long args[1];
+	int device_address = -1;
+
+	if (req->arity == 1) {
+		if (req->bus) {
+			pthread_mutex_lock(&req->bus->lock);
+			device_address = req->bus->device_address;
+			pthread_mutex_unlock(&req->bus->lock);
+		}
+
+		return reply_ok_long(reply, req->command, device_address);
+	}
+
+	if (req->arity != 2 || decode_longs(req->buf, &req->index, 1, args) < 0) {
+		return reply_error(reply, req->command, "badarg");
+	}
+
+	if (!req->bus) {
+		return reply_error(reply, req->command, "bus_not_open");
+	}
+
+	pthread_mutex_lock(&req->bus->lock);
+	device_address = req->bus->device_address;
+	pthread_mutex_unlock(&req->bus->lock);
+
+	return reply_ok_long(reply, req->command, device_address);
+}
+
+/**************
+ * set_address
+ * {set_address, Device_Address}
+ * {set_address, Bus_Number, Device_Address}
+ */
+int cmd_set_address(t_request* req, ei_x_buff* reply, t_cnode_state* state) {
+	long args[2];
+	t_i2c_bus *i2c_bus = req->bus;
+	int device_address;
+
+	if (!i2c_bus && !any_bus_open(state)) {
+		return reply_error(reply, req->command, "no_open_bus");
+	}
+
+	if (req->arity < 2 || req->arity > 3 ||
+			decode_longs(req->buf, &req->index, req->arity - 1, args) < 0) {
+		return reply_error(reply, req->command, "badarg");
+	}
+
+	if (!i2c_bus) {
+		return reply_error(reply, req->command, "bus_not_open");
+	}
+
+	device_address = (unsigned char) args[req->arity - 2];
+
+	pthread_mutex_lock(&i2c_bus->lock);
+
+	if (i2c_device_fd(i2c_bus, device_address) < 0) {
+		pthread_mutex_unlock(&i2c_bus->lock);
+		return reply_errno(reply, req->command, "error");
+	}
+
+	i2c_bus->device_address = device_address;
+
+	pthread_mutex_unlock(&i2c_bus->lock);
+
+	return reply_ok_long(reply, req->command, device_address);
+}
+
+/**************
+ * TODO: bus_info
+ * {bus_info}
+ * {bus_info, Bus_Number}
+ */
+int cmd_bus_info(t_request* req, ei_x_buff* reply, t_cnode_state* state) {
+	long args[1];
+
+	if (!req->bus && !any_bus_open(state)) {
+		return reply_error(reply, req->command, "no_open_bus");
+	}
+
+	if (req->arity == 2 && decode_longs(req->buf, &req->index, 1, args) == 0) {
+		if (!req->bus) {
+			return reply_error(reply, req->command, "bus_not_open");
+		}
+
+		ei_x_encode_tuple_header(reply, 2);
+		ei_x_encode_atom(reply, req->command);
+
+		pthread_mutex_lock(&req->bus->lock);
+		encode_bus_info(reply, req->bus);
+		pthread_mutex_unlock(&req->bus->lock);
+	} else {
+// constructing list of bus_info
+		ei_x_encode_tuple_header(reply, 2);
+		ei_x_encode_atom(reply, req->command);
+		ei_x_encode_atom(reply, "list_not_implemented_yet");
+	}
+
+	return 0;
+}
+
+/**************
+ * get_bus
+ * {get_bus}
+ */
+int cmd_get_bus(t_request* req, ei_x_buff* reply, t_cnode_state* state) {
+	int current_bus;
+
+	if (!any_bus_open(state)) {
+		return reply_error(reply, req->command, "no_bus_open");
+	}
+
+	pthread_mutex_lock(&state->lock);
+	current_bus = state->current_bus;
+	pthread_mutex_unlock(&state->lock);
+
+	return reply_ok_long(reply, req->command, current_bus);
+}
+
+/**************
+ * set_bus
+ * {set_bus, Bus_Number}
+ */
+int cmd_set_bus(t_request* req, ei_x_buff* reply, t_cnode_state* state) {
+	long args[1];
+	t_i2c_bus *i2c_bus;
+
+	if (!any_bus_open(state)) {
+		return reply_error(reply, req->command, "no_bus_open");
+	}
+
+	if (req->arity != 2 || decode_longs(req->buf, &req->index, 1, args) < 0) {
+		return reply_error(reply, req->command, "badarg");
+	}
+
+	if (!(i2c_bus = acquire_bus(args[0], state))) {
+		return reply_error(reply, req->command, "bus_not_open");
+	}
+
+	release_bus(i2c_bus);
+
+	pthread_mutex_lock(&state->lock);
+	state->current_bus = args[0];
+	pthread_mutex_unlock(&state->lock);
+
+	return reply_ok_long(reply, req->command, args[0]);
+}
+
+/**************
+ * scan
+ * {scan, Bus_Number}
+ *
+ * probes all addresses of the bus and replies with a 128 bit bitmap
+ * (bit N set - counted from the first bit - if a device answered at
+ * address N) which is kept as the bus's inventory
+ */
+int cmd_scan(t_request* req, ei_x_buff* reply, t_cnode_state* state) {
+	long args[1];
+
+	if (!req->bus && !any_bus_open(state)) {
+		return reply_error(reply, req->command, "no_open_bus");
+	}
+
+	if (req->arity != 2 || decode_longs(req->buf, &req->index, 1, args) < 0) {
+		return reply_error(reply, req->command, "badarg");
+	}
+
+	if (!req->bus) {
+		return reply_error(reply, req->command, "bus_not_open");
+	}
+
+	if (i2c_scan(req->bus) < 0) {
+		return reply_errno(reply, req->command, "i2c_error");
+	}
+
+	ei_x_encode_tuple_header(reply, 3);
+	ei_x_encode_atom(reply, req->command);
+	ei_x_encode_atom(reply, "ok");
+
+	pthread_mutex_lock(&req->bus->lock);
+	ei_x_encode_binary(reply, req->bus->inventory, sizeof(req->bus->inventory));
+	pthread_mutex_unlock(&req->bus->lock);
+
+	return 0;
+}
+
+/**************
+ * inventory
+ * {inventory, Bus_Number}
+ *
+ * the bitmap of the last scan - without touching the bus
+ */
+int cmd_inventory(t_request* req, ei_x_buff* reply, t_cnode_state* state) {
+	long args[1];
+	int result = 0;
+
+	if (!req->bus && !any_bus_open(state)) {
+		return reply_error(reply, req->command, "no_open_bus");
+	}
+
+	if (req->arity != 2 || decode_longs(req->buf, &req->index, 1, args) < 0) {
+		return reply_error(reply, req->command, "badarg");
+	}
+
+	if (!req->bus) {
+		return reply_error(reply, req->command, "bus_not_open");
+	}
+
+	pthread_mutex_lock(&req->bus->lock);
+
+	if (!req->bus->scanned) {
+		result = reply_error(reply, req->command, "not_scanned");
+	} else {
+		ei_x_encode_tuple_header(reply, 3);
+		ei_x_encode_atom(reply, req->command);
+		ei_x_encode_atom(reply, "ok");
+		ei_x_encode_binary(reply, req->bus->inventory, sizeof(req->bus->inventory));
+	}
+
+	pthread_mutex_unlock(&req->bus->lock);
+
+	return result;
+}
+
+/**************
+ * register_map
+ * {register_map, Bus_Number, Device_Address, [{Register, Mode}]}
+ *
+ * Mode is volatile (the default - always read from the device),
+ * cacheable (read from the shadow once known) or write_only (never
+ * read from the device, only what was written is known)
+ */
+int cmd_register_map(t_request* req, ei_x_buff* reply, t_cnode_state* state) {
+	long args[2], device_register;
+	char mode[MAXATOMLEN_UTF8];
+	t_i2c_bus *i2c_bus = req->bus;
+	int nregisters = 0, entry_arity, mode_value, i;
+
+	if (!i2c_bus && !any_bus_open(state)) {
+		return reply_error(reply, req->command, "no_open_bus");
+	}
+
+	if (req->arity != 4 || decode_longs(req->buf, &req->index, 2, args) < 0 ||
+			ei_decode_list_header(req->buf, &req->index, &nregisters) < 0) {
+		return reply_error(reply, req->command, "badarg");
+	}
+
+	if (!i2c_bus) {
+		return reply_error(reply, req->command, "bus_not_open");
+	}
+
+	pthread_mutex_lock(&i2c_bus->lock);
+
+	for (i = 0; i < nregisters; i++) {
+		if (ei_decode_tuple_header(req->buf, &req->index, &entry_arity) < 0 ||
+				entry_arity != 2 ||
+				ei_decode_long(req->buf, &req->index, &device_register) < 0 ||
+				ei_decode_atom(req->buf, &req->index, mode) < 0) {
+			break;
+		}
+
+		if (strcmp(mode, "volatile") == 0) {
+			mode_value = REGISTER_VOLATILE;
+		} else if (strcmp(mode, "cacheable") == 0) {
+			mode_value = REGISTER_CACHEABLE;
+		} else if (strcmp(mode, "write_only") == 0) {
+			mode_value = REGISTER_WRITE_ONLY;
+		} else {
+			break;
+		}
+
+		if (shadow_set_mode(i2c_bus, args[1], device_register, mode_value) < 0) {
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&i2c_bus->lock);
+
+	if (i < nregisters) {
+		return reply_error(reply, req->command, "badarg");
+	}
+
+	return reply_ok_long(reply, req->command, nregisters);
+}
+
+/**************
+ * invalidate
+ * {invalidate, Bus_Number, Device_Address}
+ * {invalidate, Bus_Number, Device_Address, Register}
+ *
+ * makes the next read of the register(s) go to the device
+ */
+int cmd_invalidate(t_request* req, ei_x_buff* reply, t_cnode_state* state) {
+	long args[3];
+
+	if (!req->bus && !any_bus_open(state)) {
+		return reply_error(reply, req->command, "no_open_bus");
+	}
+
+	if ((req->arity != 3 && req->arity != 4) ||
+			decode_longs(req->buf, &req->index, req->arity - 1, args) < 0) {
+		return reply_error(reply, req->command, "badarg");
+	}
+
+	if (!req->bus) {
+		return reply_error(reply, req->command, "bus_not_open");
+	}
+
+	pthread_mutex_lock(&req->bus->lock);
+	shadow_invalidate(req->bus, args[1], (req->arity == 4) ? args[2] : -1);
+	pthread_mutex_unlock(&req->bus->lock);
+
+	ei_x_encode_tuple_header(reply, 2);
+	ei_x_encode_atom(reply, req->command);
+	ei_x_encode_atom(reply, "ok");
+
+	return 0;
+}
+
+/**************
+ * sync
+ * {sync, Bus_Number, Device_Address}
+ *
+ * reads all cacheable registers of the device into the shadow again
+ */
+int cmd_sync(t_request* req, ei_x_buff* reply, t_cnode_state* state) {
+	long args[2];
+	int synced;
+
+	if (!req->bus && !any_bus_open(state)) {
+		return reply_error(reply, req->command, "no_open_bus");
+	}
+
+	if (req->arity != 3 || decode_longs(req->buf, &req->index, 2, args) < 0) {
+		return reply_error(reply, req->command, "badarg");
+	}
+
+	if (!req->bus) {
+		return reply_error(reply, req->command, "bus_not_open");
+	}
+
+	pthread_mutex_lock(&req->bus->lock);
+	flush_writes(req->bus, args[1], false);
+	synced = shadow_sync(req->bus, args[1]);
+	pthread_mutex_unlock(&req->bus->lock);
+
+	if (synced < 0) {
+		return reply_errno(reply, req->command, "i2c_error");
+	}
+
+	return reply_ok_long(reply, req->command, synced);
+}
+
+/**************
+ * eeprom
+ * {eeprom, Bus_Number, Device_Address, Page_Size, Address_Width}
+ *
+ * makes the device a 24Cxx-type EEPROM for eeprom_read/eeprom_write -
+ * Address_Width is the number of memory address bytes (1 or 2)
+ */
+int cmd_eeprom(t_request* req, ei_x_buff* reply, t_cnode_state* state) {
+	long args[4];
+
+	if (!req->bus && !any_bus_open(state)) {
+		return reply_error(reply, req->command, "no_open_bus");
+	}
+
+	if (req->arity != 5 || decode_longs(req->buf, &req->index, 4, args) < 0 ||
+			args[1] < 0 || args[1] >= I2C_MAX_DEVICES ||
+			args[2] <= 0 || args[2] > EEPROM_MAX_PAGE_SIZE ||
+			(args[3] != 1 && args[3] != 2)) {
+		return reply_error(reply, req->command, "badarg");
+	}
+
+	if (!req->bus) {
+		return reply_error(reply, req->command, "bus_not_open");
+	}
+
+	pthread_mutex_lock(&req->bus->lock);
+	req->bus->eeproms[args[1]].page_size = args[2];
+	req->bus->eeproms[args[1]].address_width = args[3];
+	pthread_mutex_unlock(&req->bus->lock);
+
+	return reply_ok_long(reply, req->command, args[1]);
+}
+
+/*
+ * common checks of eeprom_read and eeprom_write - replies and returns
+ * -1 if the request can't be run
+ */
+int check_eeprom_request(t_request* req, ei_x_buff* reply, long device_address,
+		long offset, long len) {
+	int page_size;
+
+	if (device_address < 0 || device_address >= I2C_MAX_DEVICES ||
+			offset < 0 || len < 0 || offset + len > EEPROM_MAX_LEN) {
+		return reply_error(reply, req->command, "badarg");
+	}
+
+	pthread_mutex_lock(&req->bus->lock);
+	page_size = req->bus->eeproms[device_address].page_size;
+
+	// what's held back for the device would be sent as register writes
+	flush_writes(req->bus, device_address, false);
+	pthread_mutex_unlock(&req->bus->lock);
+
+	if (page_size == 0) {
+		return reply_error(reply, req->command, "not_an_eeprom");
+	}
+
+	return 0;
+}
+
+/**************
+ * eeprom_read
+ * {eeprom_read, Bus_Number, Device_Address, Offset, Data_Len}
+ */
+int cmd_eeprom_read(t_request* req, ei_x_buff* reply, t_cnode_state* state) {
+	long args[4];
+	__u8 *data;
+	int result;
+
+	if (!req->bus && !any_bus_open(state)) {
+		return reply_error(reply, req->command, "no_open_bus");
+	}
+
+	if (req->arity != 5 || decode_longs(req->buf, &req->index, 4, args) < 0) {
+		return reply_error(reply, req->command, "badarg");
+	}
+
+	if (!req->bus) {
+		return reply_error(reply, req->command, "bus_not_open");
+	}
+
+	if (check_eeprom_request(req, reply, args[1], args[2], args[3]) < 0) {
+		return -1;
+	}
+
+	if (!(data = scratch_buffer(state, args[3] ? args[3] : 1))) {
+		return reply_error(reply, req->command, "enomem");
+	}
+
+	pthread_mutex_lock(&req->bus->lock);
+	result = eeprom_read(req->bus, args[1], args[2], args[3], data);
+	pthread_mutex_unlock(&req->bus->lock);
+
+	if (result < 0) {
+		result = reply_errno(reply, req->command, "i2c_error");
+	} else {
+		ei_x_encode_tuple_header(reply, 3);
+		ei_x_encode_atom(reply, req->command);
+		ei_x_encode_atom(reply, "ok");
+		ei_x_encode_binary(reply, data, args[3]);
+	}
+
+	return result;
+}
+
+/**************
+ * eeprom_write
+ * {eeprom_write, Bus_Number, Device_Address, Offset, Data}
+ *
+ * split on page boundaries, every page is waited for by polling the
+ * device until it acknowledges again
+ */
+int cmd_eeprom_write(t_request* req, ei_x_buff* reply, t_cnode_state* state) {
+	long args[3], len;
+	const char *data;
+
+	if (!req->bus && !any_bus_open(state)) {
+		return reply_error(reply, req->command, "no_open_bus");
+	}
+
+	if (req->arity != 5 || decode_longs(req->buf, &req->index, 3, args) < 0 ||
+			decode_binary_ref(req->buf, &req->index, &data, &len) < 0) {
+		return reply_error(reply, req->command, "badarg");
+	}
+
+	if (!req->bus) {
+		return reply_error(reply, req->command, "bus_not_open");
+	}
+
+	if (check_eeprom_request(req, reply, args[1], args[2], len) < 0) {
+		return -1;
+	}
+
+	if (eeprom_write(req->bus, args[1], args[2], len, (const __u8*) data) < 0) {
+		return reply_errno(reply, req->command, "i2c_error");
+	}
+
+	return reply_ok_long(reply, req->command, len);
+}
+
+/**************
+ * coalesce
+ * {coalesce, Bus_Number, Device_Address, Window}
+ *
+ * holds write_byte to the device back for up to Window microseconds
+ * and merges them into block writes of consecutive registers - a
+ * Window of 0 flushes and stops coalescing
+ */
+int cmd_coalesce(t_request* req, ei_x_buff* reply, t_cnode_state* state) {
+	long args[3];
+	int result;
+
+	if (!req->bus && !any_bus_open(state)) {
+		return reply_error(reply, req->command, "no_open_bus");
+	}
+
+	if (req->arity != 4 || decode_longs(req->buf, &req->index, 3, args) < 0) {
+		return reply_error(reply, req->command, "badarg");
+	}
+
+	if (!req->bus) {
+		return reply_error(reply, req->command, "bus_not_open");
+	}
+
+	pthread_mutex_lock(&req->bus->lock);
+	result = coalesce_set_window(req->bus, args[1], args[2]);
+	pthread_mutex_unlock(&req->bus->lock);
+
+	if (result < 0) {
+		return reply_errno(reply, req->command, "error");
+	}
+
+	return reply_ok_long(reply, req->command, args[2]);
+}
+
+/**************
+ * flush
+ * {flush, Bus_Number}
+ * {flush, Bus_Number, Device_Address}
+ *
+ * sends the writes held back for the device (or all devices of the
+ * bus) - replies with the number of block writes or the error of a
+ * held back write which failed since the last flush
+ */
+int cmd_flush(t_request* req, ei_x_buff* reply, t_cnode_state* state) {
+	long args[2];
+	int writes;
+
+	if (!req->bus && !any_bus_open(state)) {
+		return reply_error(reply, req->command, "no_open_bus");
+	}
+
+	if ((req->arity != 2 && req->arity != 3) ||
+			decode_longs(req->buf, &req->index, req->arity - 1, args) < 0) {
+		return reply_error(reply, req->command, "badarg");
+	}
+
+	if (!req->bus) {
+		return reply_error(reply, req->command, "bus_not_open");
+	}
+
+	pthread_mutex_lock(&req->bus->lock);
+	writes = flush_writes(req->bus, (req->arity == 3) ? args[1] : -1, true);
+	pthread_mutex_unlock(&req->bus->lock);
+
+	if (writes < 0) {
+		return reply_errno(reply, req->command, "i2c_error");
+	}
+
+	return reply_ok_long(reply, req->command, writes);
+}
+
+/**************
+ * subscribe
+ * {subscribe, Bus_Number, Device_Address, Register, Data_Len, Interval, Pid}
+ * {subscribe, Bus_Number, Device_Address, Register, Data_Len, Interval, Pid,
+ *             Batch_Count, Flush_After}
+ *
+ * polls the register every Interval microseconds and sends each
+ * sample to Pid as {erl_i2c_sample, Subscription_Id, Timestamp, Data}
+ * - or Batch_Count samples at once as packed records
+ * {erl_i2c_samples, Subscription_Id, Data_Len, Records}, sent early
+ * if the first one waited Flush_After microseconds (0: no limit)
+ */
+int cmd_subscribe(t_request* req, ei_x_buff* reply, t_cnode_state* state) {
+	long args[5], batch[2] = {1, 0};
+	erlang_pid to;
+	t_i2c_bus *i2c_bus = req->bus;
+	t_subscription *subscription;
+	int device_address, device_fd;
+
+	if (!i2c_bus && !any_bus_open(state)) {
+		return reply_error(reply, req->command, "no_open_bus");
+	}
+
+	if ((req->arity != 7 && req->arity != 9) ||
+			decode_longs(req->buf, &req->index, 5, args) < 0 ||
+			ei_decode_pid(req->buf, &req->index, &to) < 0 ||
+			(req->arity == 9 && decode_longs(req->buf, &req->index, 2, batch) < 0)) {
+		return reply_error(reply, req->command, "badarg");
+	}
+
+	if (!i2c_bus) {
+		return reply_error(reply, req->command, "bus_not_open");
+	}
+
+	if (args[3] <= 0 || args[3] > I2C_SMBUS_I2C_BLOCK_MAX) {
+		return reply_error(reply, req->command, "too_much_data_requested");
+	}
+
+	if (args[4] < SUBSCRIPTION_MIN_INTERVAL) {
+		return reply_error(reply, req->command, "interval_too_short");
+	}
+
+	if (batch[0] < 1 || batch[0] > SUBSCRIPTION_MAX_BATCH || batch[1] < 0) {
+		return reply_error(reply, req->command, "badarg");
+	}
+
+	device_address = (unsigned char) args[1];
+
+	// bind the device now, so a bad address is reported here and
+	// not with every sample
+	pthread_mutex_lock(&i2c_bus->lock);
+	device_fd = i2c_device_fd(i2c_bus, device_address);
+	pthread_mutex_unlock(&i2c_bus->lock);
+
+	if (device_fd < 0) {
+		return reply_errno(reply, req->command, "address_error");
+	}
+
+	if (!(subscription = new_subscription(&to, device_address,
+			(unsigned char) args[2], args[3], args[4], batch[0], batch[1], state))) {
+		return reply_error(reply, req->command, "enomem");
+	}
+
+	add_subscription(&i2c_bus->worker, subscription);
+
+	return reply_ok_long(reply, req->command, subscription->id);
+}
+
+/**************
+ * watch
+ * {watch, Bus_Number, Device_Address, Register, Data_Len, Interval, Pid,
+ *         Mask, Hysteresis}
+ *
+ * polls the register like subscribe but only sends
+ * {erl_i2c_change, Subscription_Id, Timestamp, Data} if the bits set in
+ * Mask (Data_Len bytes, <<>> for all) changed - and with a Hysteresis
+ * above 0 only if the masked value moved by more than that
+ * (Data_Len up to 8); stopped with unsubscribe
+ */
+int cmd_watch(t_request* req, ei_x_buff* reply, t_cnode_state* state) {
+	long args[5], hysteresis, mask_len;
+	const char *mask;
+	erlang_pid to;
+	t_i2c_bus *i2c_bus = req->bus;
+	t_subscription *subscription;
+	int device_address, device_fd;
+
+	if (!i2c_bus && !any_bus_open(state)) {
+		return reply_error(reply, req->command, "no_open_bus");
+	}
+
+	if (req->arity != 9 ||
+			decode_longs(req->buf, &req->index, 5, args) < 0 ||
+			ei_decode_pid(req->buf, &req->index, &to) < 0 ||
+			decode_binary_ref(req->buf, &req->index, &mask, &mask_len) < 0 ||
+			decode_longs(req->buf, &req->index, 1, &hysteresis) < 0) {
+		return reply_error(reply, req->command, "badarg");
+	}
+
+	if (!i2c_bus) {
+		return reply_error(reply, req->command, "bus_not_open");
+	}
+
+	if (args[3] <= 0 || args[3] > I2C_SMBUS_I2C_BLOCK_MAX) {
+		return reply_error(reply, req->command, "too_much_data_requested");
+	}
+
+	if (args[4] < SUBSCRIPTION_MIN_INTERVAL) {
+		return reply_error(reply, req->command, "interval_too_short");
+	}
+
+	if ((mask_len != 0 && mask_len != args[3]) || hysteresis < 0 ||
+			(hysteresis > 0 && args[3] > WATCH_MAX_NUMERIC_LEN)) {
+		return reply_error(reply, req->command, "badarg");
+	}
+
+	device_address = (unsigned char) args[1];
+
+	pthread_mutex_lock(&i2c_bus->lock);
+	device_fd = i2c_device_fd(i2c_bus, device_address);
+	pthread_mutex_unlock(&i2c_bus->lock);
+
+	if (device_fd < 0) {
+		return reply_errno(reply, req->command, "address_error");
+	}
+
+	if (!(subscription = new_subscription(&to, device_address,
+			(unsigned char) args[2], args[3], args[4], 1, 0, state))) {
+		return reply_error(reply, req->command, "enomem");
+	}
+
+	set_watch(subscription, mask, mask_len, hysteresis);
+
+	add_subscription(&i2c_bus->worker, subscription);
+
+	return reply_ok_long(reply, req->command, subscription->id);
+}
+
+/**************
+ * unsubscribe
+ * {unsubscribe, Subscription_Id}
+ */
+int cmd_unsubscribe(t_request* req, ei_x_buff* reply, t_cnode_state* state) {
+	long args[1];
+	t_i2c_bus *i2c_bus;
+	ei_x_buff* samples;
+	bool removed = false;
+	int bus_number;
+
+	if (req->arity != 2 || decode_longs(req->buf, &req->index, 1, args) < 0) {
+		return reply_error(reply, req->command, "badarg");
+	}
+
+	// samples collected so far aren't lost - sent from a buffer of the
+	// thread, not one allocated per request
+	samples = scratch_x_buff(state, SCRATCH_SAMPLES);
+
+	for (bus_number = 0; bus_number < I2C_MAX_BUSES && !removed; bus_number++) {
+		if ((i2c_bus = acquire_bus(bus_number, state))) {
+			removed = remove_subscription(&i2c_bus->worker, args[0], samples);
+			release_bus(i2c_bus);
+		}
+	}
+
+	if (!removed) {
+		return reply_error(reply, req->command, "not_subscribed");
+	}
+
+	ei_x_encode_tuple_header(reply, 2);
+	ei_x_encode_atom(reply, req->command);
+	ei_x_encode_atom(reply, "ok");
+
+	return 0;
+}
+
+/**************
+ * subscriptions
+ * {subscriptions}
+ */
+int cmd_subscriptions(t_request* req, ei_x_buff* reply, t_cnode_state* state) {
+	t_i2c_bus *i2c_bus;
+	int bus_number;
+
+	ei_x_encode_tuple_header(reply, 3);
+	ei_x_encode_atom(reply, req->command);
+	ei_x_encode_atom(reply, "ok");
+
+	for (bus_number = 0; bus_number < I2C_MAX_BUSES; bus_number++) {
+		if ((i2c_bus = acquire_bus(bus_number, state))) {
+			encode_subscriptions(reply, &i2c_bus->worker);
+			release_bus(i2c_bus);
+		}
+	}
+
+	ei_x_encode_empty_list(reply);
+
+	return 0;
+}
+
+/**************
+ * stats
+ * {stats, Reset}
+ * {stats, Reset, Bus_Number}
+ *
+ * {stats, ok, [{Bus_Number, Command_Stats}]} - for all open buses (and
+ * none for requests not run for one) or just Bus_Number; Reset clears
+ * the counters once they're encoded
+ */
+int cmd_stats(t_request* req, ei_x_buff* reply, t_cnode_state* state) {
+	t_i2c_bus *i2c_bus = NULL;
+	int reset, bus_number;
+	long args[1];
+
+	if (req->arity < 2 || req->arity > 3 ||
+			ei_decode_boolean(req->buf, &req->index, &reset) < 0 ||
+			decode_longs(req->buf, &req->index, req->arity - 2, args) < 0) {
+		return reply_error(reply, req->command, "badarg");
+	}
+
+	if (req->arity == 3) {
+		if (!(i2c_bus = acquire_bus(args[0], state))) {
+			return reply_error(reply, req->command, "bus_not_open");
+		}
+
+		ei_x_encode_tuple_header(reply, 3);
+		ei_x_encode_atom(reply, req->command);
+		ei_x_encode_atom(reply, "ok");
+
+		ei_x_encode_list_header(reply, 1);
+		ei_x_encode_tuple_header(reply, 2);
+		ei_x_encode_long(reply, i2c_bus->bus_number);
+		encode_stats(reply, i2c_bus->stats, reset);
+		ei_x_encode_empty_list(reply);
+
+		release_bus(i2c_bus);
+
+		return 0;
+	}
+
+	ei_x_encode_tuple_header(reply, 3);
+	ei_x_encode_atom(reply, req->command);
+	ei_x_encode_atom(reply, "ok");
+
+	ei_x_encode_list_header(reply, 1);
+	ei_x_encode_tuple_header(reply, 2);
+	ei_x_encode_atom(reply, "none");
+	encode_stats(reply, state->stats, reset);
+
+	for (bus_number = 0; bus_number < I2C_MAX_BUSES; bus_number++) {
+		if ((i2c_bus = acquire_bus(bus_number, state))) {
+			ei_x_encode_list_header(reply, 1);
+			ei_x_encode_tuple_header(reply, 2);
+			ei_x_encode_long(reply, bus_number);
+			encode_stats(reply, i2c_bus->stats, reset);
+
+			release_bus(i2c_bus);
+		}
+	}
+
+	ei_x_encode_empty_list(reply);
+
+	return 0;
+}
+
+/**************
+ * memory
+ * {memory}
+ *
+ * {memory, ok, [{Instance, [{allocations, N}, {pooled_jobs, N}]}]} -
+ * allocations counts the heap allocations on the request path since
+ * startup, which stays put once the pools and buffers are warm
+ */
+int cmd_memory(t_request* req, ei_x_buff* reply, t_cnode_state* state) {
+	int pooled_jobs;
+
+	if (req->arity != 1) {
+		return reply_error(reply, req->command, "badarg");
+	}
+
+	pthread_mutex_lock(&state->pool_lock);
+	pooled_jobs = state->pooled_jobs;
+	pthread_mutex_unlock(&state->pool_lock);
+
+	ei_x_encode_tuple_header(reply, 3);
+	ei_x_encode_atom(reply, req->command);
+	ei_x_encode_atom(reply, "ok");
+
+	ei_x_encode_list_header(reply, 1);
+	ei_x_encode_tuple_header(reply, 2);
+	ei_x_encode_long(reply, state->instance);
+
+	ei_x_encode_list_header(reply, 2);
+	ei_x_encode_tuple_header(reply, 2);
+	ei_x_encode_atom(reply, "allocations");
+	ei_x_encode_ulong(reply, __atomic_load_n(&state->allocations, __ATOMIC_RELAXED));
+	ei_x_encode_tuple_header(reply, 2);
+	ei_x_encode_atom(reply, "pooled_jobs");
+	ei_x_encode_long(reply, pooled_jobs);
+	ei_x_encode_empty_list(reply);
+
+	ei_x_encode_empty_list(reply);
+
+	return 0;
+}
+
+int cmd_batch(t_request* req, ei_x_buff* reply, t_cnode_state* state);
+int cmd_exit(t_request* req, ei_x_buff* reply, t_cnode_state* state);
+
+/**************
+ * command table
+ *
+ * looked up through a small open-addressing hash table which is
+ * filled once on startup - so finding a handler costs one hash of
+ * the atom and (usually) one strcmp, whatever the number of commands
+ */
+static const t_command commands[] = {
+	{"open_bus",    cmd_open_bus,    CMD_ALLOW_IN_BATCH, 0},
+	{"close_bus",   cmd_close_bus,   CMD_ALLOW_IN_BATCH, 0},
+	{"read_byte",   cmd_read_byte,   CMD_ALLOW_IN_BATCH | CMD_ON_BUS | CMD_SELECTS_BUS, 5},
+	{"write_byte",  cmd_write_byte,  CMD_ALLOW_IN_BATCH | CMD_ON_BUS | CMD_SELECTS_BUS, 5},
+	{"transfer",    cmd_transfer,    CMD_ALLOW_IN_BATCH | CMD_ON_BUS, 3},
+	{"get_address", cmd_get_address, CMD_ALLOW_IN_BATCH | CMD_ON_BUS, 2},
+	{"set_address", cmd_set_address, CMD_ALLOW_IN_BATCH | CMD_ON_BUS | CMD_SELECTS_BUS, 3},
+	{"bus_info",    cmd_bus_info,    CMD_ALLOW_IN_BATCH | CMD_ON_BUS, 2},
+	{"get_bus",     cmd_get_bus,     CMD_ALLOW_IN_BATCH, 0},
+	{"set_bus",     cmd_set_bus,     CMD_ALLOW_IN_BATCH, 0},
+	{"scan",        cmd_scan,        CMD_ALLOW_IN_BATCH | CMD_ON_BUS, 2},
+	{"inventory",   cmd_inventory,   CMD_ALLOW_IN_BATCH | CMD_ON_BUS, 2},
+	{"register_map", cmd_register_map, CMD_ALLOW_IN_BATCH | CMD_ON_BUS, 4},
+	{"invalidate",  cmd_invalidate,  CMD_ALLOW_IN_BATCH | CMD_ON_BUS, 3},
+	{"sync",        cmd_sync,        CMD_ALLOW_IN_BATCH | CMD_ON_BUS, 3},
+	{"eeprom",      cmd_eeprom,      CMD_ALLOW_IN_BATCH | CMD_ON_BUS, 5},
+	{"eeprom_read", cmd_eeprom_read, CMD_ALLOW_IN_BATCH | CMD_ON_BUS, 5},
+	{"eeprom_write", cmd_eeprom_write, CMD_ALLOW_IN_BATCH | CMD_ON_BUS, 5},
+	{"coalesce",    cmd_coalesce,    CMD_ALLOW_IN_BATCH | CMD_ON_BUS, 4},
+	{"flush",       cmd_flush,       CMD_ALLOW_IN_BATCH | CMD_ON_BUS, 2},
+	{"subscribe",   cmd_subscribe,   CMD_ALLOW_IN_BATCH | CMD_ON_BUS, 7},
+	{"watch",       cmd_watch,       CMD_ALLOW_IN_BATCH | CMD_ON_BUS, 9},
+	{"unsubscribe", cmd_unsubscribe, CMD_ALLOW_IN_BATCH, 0},
+	{"subscriptions", cmd_subscriptions, CMD_ALLOW_IN_BATCH, 0},
+	{"stats",       cmd_stats,       CMD_ALLOW_IN_BATCH, 0},
+	{"memory",      cmd_memory,      CMD_ALLOW_IN_BATCH, 0},
+	{"batch",       cmd_batch,       0, 0},
+	{"exit",        cmd_exit,        CMD_INLINE, 0},
+};
+
+#define NCOMMANDS (sizeof(commands) / sizeof(commands[0]))
+
+_Static_assert(NCOMMANDS <= STATS_MAX_COMMANDS, "STATS_MAX_COMMANDS is too small");
+
+// power of two and at least four times the number of commands
+#define COMMAND_TABLE_SIZE 128
+
+static const t_command* command_table[COMMAND_TABLE_SIZE];
+
+// FNV-1a
+unsigned int command_hash(const char* name) {
+	unsigned int hash = 2166136261u;
+
+	while (*name) {
+		hash ^= (unsigned char) *name++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+void init_command_table(void) {
+	unsigned int i, slot;
+
+	memset(command_table, 0, sizeof(command_table));
+
+	for (i = 0; i < NCOMMANDS; i++) {
+		slot = command_hash(commands[i].name) & (COMMAND_TABLE_SIZE - 1);
+
+		while (command_table[slot]) {
+			slot = (slot + 1) & (COMMAND_TABLE_SIZE - 1);
+		}
+
+		command_table[slot] = &commands[i];
+	}
+}
+
+// position in the command table - the stats are kept by it
+int command_index(const t_command* cmd) {
+	return cmd - commands;
+}
+
+// NULL past the end of the table
+const t_command* command_at(int index) {
+	return (index >= 0 && index < NCOMMANDS) ? &commands[index] : NULL;
+}
+
+const t_command* find_command(const char* name) {
+	unsigned int slot = command_hash(name) & (COMMAND_TABLE_SIZE - 1);
+
+	while (command_table[slot]) {
+		if (strcmp(command_table[slot]->name, name) == 0) {
+			return command_table[slot];
+		}
+
+		slot = (slot + 1) & (COMMAND_TABLE_SIZE - 1);
+	}
+
+	return NULL;
+}
+
+/*
+ * finds the bus a CMD_ON_BUS request is meant for - index points to
+ * the first argument; returns the bus with a reference taken or NULL
+ * if it isn't open
+ */
+t_i2c_bus* resolve_bus(const t_command* cmd, const char* buf, int index, int arity,
+		t_cnode_state* state) {
+	t_i2c_bus* i2c_bus;
+	long bus_number;
+
+	if (arity < cmd->bus_arity) {
+		pthread_mutex_lock(&state->lock);
+		bus_number = state->current_bus;
+		pthread_mutex_unlock(&state->lock);
+
+		return acquire_bus(bus_number, state);
+	}
+
+	if (ei_decode_long(buf, &index, &bus_number) < 0) {
+		return NULL;
+	}
+
+	if ((i2c_bus = acquire_bus(bus_number, state)) && (cmd->flags & CMD_SELECTS_BUS)) {
+		pthread_mutex_lock(&state->lock);
+		state->current_bus = bus_number;
+		pthread_mutex_unlock(&state->lock);
+	}
+
+	return i2c_bus;
+}
+
+/*
+ * executes one command tuple decoded from buf at index and encodes
+ * the reply (without the erl_i2c_cnode-tag - that's added by the caller)
+ *
+ * i2c_bus is the bus a worker already resolved the request to - if
+ * NULL, CMD_ON_BUS commands look their bus up themselves
+ *
+ * returns 0 on success and -1 if an error was replied
+ */
+int execute_command(const char* buf, int* index, ei_x_buff* reply,
+		t_cnode_state* state, t_i2c_bus* i2c_bus) {
+	char command[MAXATOMLEN_UTF8];
+	const t_command* cmd = NULL;
+	t_request req;
+	int start = *index, end, result;
+	bool resolved = false;
+	struct timespec started, finished;
+	unsigned long long ioctl_ns, execute_ns;
+	t_stats* stats;
+
+	req.buf = buf;
+	req.index = *index;
+	req.command = command;
+	req.bus = i2c_bus;
+
+	if (ei_decode_tuple_header(buf, &req.index, &req.arity) == 0 && req.arity >= 1 &&
+			ei_decode_atom(buf, &req.index, command) == 0) {
+		cmd = find_command(command);
+	}
+
+/**************
+ * unknown command
+ */
+	if (!cmd) {
+		// What should I say?!
+		// I didn't even understand what you just said!
+		end = start;
+		ei_skip_term(buf, &end);
+
+		ei_x_encode_tuple_header(reply, 3);
+		ei_x_encode_atom(reply, "error");
+		ei_x_encode_atom(reply, "unknown_command");
+		ei_x_append_buf(reply, buf + start, end - start);
+
+		*index = end;
+
+		return -1;
+	}
+
+	if ((cmd->flags & CMD_ON_BUS) && !req.bus) {
+		req.bus = resolve_bus(cmd, buf, req.index, req.arity, state);
+		resolved = true;
+	}
+
+	replied_errno = 0;
+	ioctl_ns = bus_ioctl_ns();
+	clock_gettime(CLOCK_MONOTONIC, &started);
+
+	result = cmd->handler(&req, reply, state);
+
+	clock_gettime(CLOCK_MONOTONIC, &finished);
+	ioctl_ns = bus_ioctl_ns() - ioctl_ns;
+	execute_ns = elapsed_ns(&started, &finished);
+
+	// the bus time against what the handler spent in software
+	stats = (req.bus && req.bus->stats) ? req.bus->stats : state->stats;
+	stats_record(stats, cmd, STATS_EXECUTE, execute_ns);
+	stats_record(stats, cmd, STATS_IOCTL, ioctl_ns);
+	stats_record(stats, cmd, STATS_ENCODE, execute_ns > ioctl_ns ? execute_ns - ioctl_ns : 0);
+
+	if (result < 0) {
+		stats_error(stats, cmd, replied_errno);
+	}
+
+	if (resolved) {
+		release_bus(req.bus);
+	}
+
+	*index = req.index;
+
+	return result;
+}
+
+/**************
+ * batch
+ * {batch, Mode, [Command]}
+ *
+ * runs the commands in order and replies with one list holding
+ * the reply of each command - Mode is either stop_on_error or continue
+ *
+ * batches run on the control worker; commands for a bus take the
+ * bus lock like the bus worker does, so they are safe to interleave
+ */
+int cmd_batch(t_request* req, ei_x_buff* reply, t_cnode_state* state) {
+	char mode[MAXATOMLEN_UTF8], nested[MAXATOMLEN_UTF8];
+	const t_command* cmd;
+	ei_x_buff* results;
+	int ncommands = 0, nested_arity, next, peek, i;
+	bool stop_on_error, failed = false;
+
+	if (req->arity != 3 || ei_decode_atom(req->buf, &req->index, mode) < 0 ||
+			(strcmp(mode, "stop_on_error") != 0 && strcmp(mode, "continue") != 0) ||
+			ei_decode_list_header(req->buf, &req->index, &ncommands) < 0) {
+		return reply_error(reply, req->command, "badarg");
+	}
+
+	stop_on_error = (strcmp(mode, "stop_on_error") == 0);
+
+	// the results are collected aside as the status comes first in the
+	// reply - batches don't nest, so the thread's buffer for it is free
+	results = scratch_x_buff(state, SCRATCH_BATCH);
+
+	for (i = 0; i < ncommands && !(failed && stop_on_error); i++) {
+		next = req->index;
+
+		if (ei_skip_term(req->buf, &next) < 0) {
+			break;
+		}
+
+		// one cons cell per result - the final length isn't known up front
+		ei_x_encode_list_header(results, 1);
+
+		peek = req->index;
+
+		if (ei_decode_tuple_header(req->buf, &peek, &nested_arity) == 0 &&
+				ei_decode_atom(req->buf, &peek, nested) == 0 &&
+				(cmd = find_command(nested)) &&
+				!(cmd->flags & CMD_ALLOW_IN_BATCH)) {
+			ei_x_encode_tuple_header(results, 3);
+			ei_x_encode_atom(results, "error");
+			ei_x_encode_atom(results, "not_allowed_in_batch");
+			ei_x_encode_atom(results, nested);
+
+			failed = true;
+		} else if (execute_command(req->buf, &req->index, results, state, NULL) < 0) {
+			failed = true;
+		}
+
+		req->index = next;
+	}
+
+	ei_x_encode_empty_list(results);
+
+	ei_x_encode_tuple_header(reply, 3);
+	ei_x_encode_atom(reply, req->command);
+	ei_x_encode_atom(reply, failed ? "error" : "ok");
+	ei_x_append_buf(reply, results->buff, results->index);
+
+	return failed ? -1 : 0;
+}
+
+/**************
+ * exit
+ */
+int cmd_exit(t_request* req, ei_x_buff* reply, t_cnode_state* state) {
+	state->mainloop = false;
+
+	ei_x_encode_tuple_header(reply, 2);
+	ei_x_encode_atom(reply, "ok");
+	ei_x_encode_atom(reply, "exiting");
+
+	return 0;
+}
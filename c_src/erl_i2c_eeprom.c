@@ -0,0 +1,212 @@
+/*
+ * erl_i2c_eeprom.c
+ *
+ *  Created on: 09.09.2012
+ *      Author: Christian Adams <morlac78@googlemail.com>
+ *   Copyright: (c) 2012 by Christian Adams
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *   MA 02110-1301 USA.
+ *
+ */
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "erl_i2c_cnode.h"
+
+/*
+ * 24Cxx-type EEPROMs - the memory address is sent as one or two
+ * bytes ahead of the data, address bits above that go into the low
+ * bits of the device address (24C04 .. 24C16, 24C1024); writes must
+ * not cross a page and the device doesn't answer while it programs
+ * a page
+ *
+ * everything is sent with I2C_RDWR - there is no SMBus fallback, an
+ * adapter without it fails with EOPNOTSUPP
+ */
+
+// pause between two polls while the device is busy (microseconds)
+#define EEPROM_POLL_INTERVAL 100
+
+/*
+ * the device address and memory address bytes for offset - returns
+ * how many bytes are left in the block addressed by the device address
+ */
+static long eeprom_address(t_eeprom* eeprom, int device_address, long offset,
+		__u16* addr, __u8* memory_address) {
+	int block_bits = eeprom->address_width * 8;
+
+	*addr = device_address | ((offset >> block_bits) & 0x07);
+
+	if (eeprom->address_width == 2) {
+		memory_address[0] = (offset >> 8) & 0xff;
+		memory_address[1] = offset & 0xff;
+	} else {
+		memory_address[0] = offset & 0xff;
+	}
+
+	return (1L << block_bits) - (offset & ((1L << block_bits) - 1));
+}
+
+/*
+ * i2c_rdwr() remembering an adapter without I2C_RDWR like the register
+ * transfers do; i2c_bus->lock must be held
+ */
+static int eeprom_rdwr(t_i2c_bus* i2c_bus, struct i2c_msg* msgs, int nmsgs) {
+	if (i2c_bus->rdwr_unsupported) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	if (i2c_rdwr(i2c_bus, msgs, nmsgs) < 0) {
+		if (errno == EOPNOTSUPP) {
+			i2c_bus->rdwr_unsupported = true;
+		}
+
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * sequential reads of up to I2C_RDWR_MAX_LEN bytes each - the memory
+ * address is sent again with every one so a read never relies on the
+ * device rolling over into the next block
+ *
+ * returns 0 or -1; i2c_bus->lock must be held
+ */
+int eeprom_read(t_i2c_bus* i2c_bus, int device_address, long offset, long len, __u8* data) {
+	t_eeprom* eeprom = &i2c_bus->eeproms[device_address];
+	struct i2c_msg msgs[2];
+	__u8 memory_address[2];
+	long done, chunk, left;
+	__u16 addr;
+
+	for (done = 0; done < len; done += chunk) {
+		left = eeprom_address(eeprom, device_address, offset + done, &addr, memory_address);
+
+		chunk = len - done;
+		chunk = (chunk > left) ? left : chunk;
+		chunk = (chunk > I2C_RDWR_MAX_LEN) ? I2C_RDWR_MAX_LEN : chunk;
+
+		msgs[0].addr = addr;
+		msgs[0].flags = 0;
+		msgs[0].len = eeprom->address_width;
+		msgs[0].buf = (char*) memory_address;
+
+		msgs[1].addr = addr;
+		msgs[1].flags = I2C_M_RD;
+		msgs[1].len = chunk;
+		msgs[1].buf = (char*) data + done;
+
+		if (eeprom_rdwr(i2c_bus, msgs, 2) < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * waits for the write cycle to end - the device doesn't acknowledge
+ * its address until then; polled with zero-length writes or, where
+ * the adapter can't do them, with the memory address of the page
+ * (sent anyway before the next one). i2c_bus->lock is only taken for
+ * each poll, not for the pauses in between
+ */
+static int eeprom_wait_ready(t_i2c_bus* i2c_bus, struct i2c_msg* page, int address_width) {
+	struct timespec start, now, pause = {0, EEPROM_POLL_INTERVAL * 1000};
+	struct i2c_msg poll = *page;
+	long waited;
+	int result;
+
+	poll.len = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (;;) {
+		pthread_mutex_lock(&i2c_bus->lock);
+		result = i2c_rdwr(i2c_bus, &poll, 1);
+		pthread_mutex_unlock(&i2c_bus->lock);
+
+		if (result >= 0) {
+			break;
+		}
+
+		if (errno == EOPNOTSUPP && poll.len == 0) {
+			poll.len = address_width;
+			continue;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		waited = (now.tv_sec - start.tv_sec) * 1000000 + (now.tv_nsec - start.tv_nsec) / 1000;
+
+		if (waited >= EEPROM_WRITE_TIMEOUT) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+
+		nanosleep(&pause, NULL);
+	}
+
+	return 0;
+}
+
+/*
+ * writes page by page, each one acknowledged before the next is sent
+ *
+ * returns 0 or -1; takes i2c_bus->lock per page and per poll, so the
+ * bus is free while the EEPROM programs a page - for requests run by
+ * other threads (batches on the control worker, NIF callers). The
+ * worker of the bus is busy with the write until it's done, requests
+ * queued for the bus wait for it
+ */
+int eeprom_write(t_i2c_bus* i2c_bus, int device_address, long offset, long len,
+		const __u8* data) {
+	t_eeprom eeprom_copy, *eeprom = &eeprom_copy;
+	__u8 page[2 + EEPROM_MAX_PAGE_SIZE];
+	struct i2c_msg msg;
+	long done, chunk;
+	int result = 0;
+
+	pthread_mutex_lock(&i2c_bus->lock);
+	eeprom_copy = i2c_bus->eeproms[device_address];
+	pthread_mutex_unlock(&i2c_bus->lock);
+
+	for (done = 0; done < len && result == 0; done += chunk) {
+		chunk = eeprom->page_size - ((offset + done) % eeprom->page_size);
+		chunk = (chunk > len - done) ? len - done : chunk;
+
+		eeprom_address(eeprom, device_address, offset + done, &msg.addr, page);
+		memcpy(page + eeprom->address_width, data + done, chunk);
+
+		msg.flags = 0;
+		msg.len = eeprom->address_width + chunk;
+		msg.buf = (char*) page;
+
+		pthread_mutex_lock(&i2c_bus->lock);
+		result = eeprom_rdwr(i2c_bus, &msg, 1);
+		pthread_mutex_unlock(&i2c_bus->lock);
+
+		if (result == 0) {
+			result = eeprom_wait_ready(i2c_bus, &msg, eeprom->address_width);
+		}
+	}
+
+	return result < 0 ? -1 : 0;
+}
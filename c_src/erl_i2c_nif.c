@@ -0,0 +1,175 @@
+/*
+ * erl_i2c_nif.c
+ *
+ *  Created on: 09.09.2012
+ *      Author: Christian Adams <morlac78@googlemail.com>
+ *   Copyright: (c) 2012 by Christian Adams
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *   MA 02110-1301 USA.
+ *
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "erl_nif.h"
+
+#include "erl_i2c_cnode.h"
+
+/*
+ * the same commands as the C-Node, run as a NIF on the dirty I/O
+ * schedulers - no distribution hop, no epmd, no cookie
+ *
+ * erl_i2c_nif:call(Command) hands the external format of Command to
+ * execute_command() in the calling process and returns its reply;
+ * buses still get their worker thread for subscriptions and write
+ * flushes, everything else runs in the caller
+ */
+
+// the environment of the calling process while a command runs on a
+// dirty scheduler - NULL on the worker threads
+static __thread ErlNifEnv* caller_env = NULL;
+
+/*
+ * samples and changes from the workers - and anything a command sends
+ * itself - go straight to the subscriber
+ */
+int send_reply(t_cnode_state* state, erlang_pid* to, ei_x_buff* reply) {
+	ErlNifEnv* env;
+	ErlNifPid pid;
+	ERL_NIF_TERM pid_term, msg;
+	ei_x_buff* to_buf;
+	int result = -1;
+
+	if (!(env = enif_alloc_env())) {
+		return -1;
+	}
+
+	to_buf = scratch_x_buff(state, SCRATCH_PACKET);
+	ei_x_encode_version(to_buf);
+	ei_x_encode_pid(to_buf, to);
+
+	if (enif_binary_to_term(env, (unsigned char*) to_buf->buff, to_buf->index, &pid_term, 0) &&
+			enif_get_local_pid(env, pid_term, &pid) &&
+			enif_binary_to_term(env, (unsigned char*) reply->buff, reply->index, &msg, 0) &&
+			enif_send(caller_env, &pid, env, msg)) {
+		result = 0;
+	}
+
+	enif_free_env(env);
+
+	return result;
+}
+
+static ERL_NIF_TERM nif_call(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]) {
+	t_cnode_state* state = (t_cnode_state*) enif_priv_data(env);
+	ErlNifBinary request;
+	ERL_NIF_TERM result;
+	ei_x_buff* reply;
+	int index = 0, version;
+
+	if (!enif_is_tuple(env, argv[0]) || !enif_term_to_binary(env, argv[0], &request)) {
+		return enif_make_badarg(env);
+	}
+
+	// kept by the scheduler thread - the VM owns those threads, so
+	// the buffers live as long as it does
+	reply = scratch_x_buff(state, SCRATCH_REPLY);
+	ei_x_encode_version(reply);
+
+	if (ei_decode_version((char*) request.data, &index, &version) < 0) {
+		result = enif_make_badarg(env);
+	} else {
+		caller_env = env;
+		execute_command((char*) request.data, &index, reply, state, NULL);
+		caller_env = NULL;
+
+		if (!enif_binary_to_term(env, (unsigned char*) reply->buff, reply->index, &result, 0)) {
+			result = enif_make_tuple2(env, enif_make_atom(env, "error"),
+					enif_make_atom(env, "bad_reply"));
+		}
+	}
+
+	enif_release_binary(&request);
+
+	return result;
+}
+
+static int load(ErlNifEnv* env, void** priv_data, ERL_NIF_TERM load_info) {
+	t_cnode_state* state = (t_cnode_state*) calloc(1, sizeof(t_cnode_state));
+
+	if (!state) {
+		return -1;
+	}
+
+	pthread_mutex_init(&state->lock, NULL);
+	pthread_mutex_init(&state->send_lock, NULL);
+	pthread_mutex_init(&state->pool_lock, NULL);
+	state->erl_fd = -1;
+	state->instances = 1;
+	state->stats = new_stats();
+	state->backend = &kernel_backend;
+	state->mainloop = true;
+
+	ei_init();
+
+	init_command_table();
+
+	*priv_data = state;
+
+	return 0;
+}
+
+/*
+ * a new version of the module takes over the open buses
+ */
+static int upgrade(ErlNifEnv* env, void** priv_data, void** old_priv_data,
+		ERL_NIF_TERM load_info) {
+	*priv_data = *old_priv_data;
+	*old_priv_data = NULL;
+
+	return 0;
+}
+
+static void unload(ErlNifEnv* env, void* priv_data) {
+	t_cnode_state* state = (t_cnode_state*) priv_data;
+	t_i2c_bus* i2c_bus;
+	int bus_number;
+
+	if (!state) {
+		return;
+	}
+
+	for (bus_number = 0; bus_number < I2C_MAX_BUSES; bus_number++) {
+		if ((i2c_bus = remove_bus(bus_number, state))) {
+			stop_worker(&i2c_bus->worker);
+			release_bus(i2c_bus);
+		}
+	}
+
+	free_job_pool(state);
+
+	pthread_mutex_destroy(&state->pool_lock);
+	pthread_mutex_destroy(&state->send_lock);
+	pthread_mutex_destroy(&state->lock);
+	free(state->stats);
+	free(state);
+}
+
+static ErlNifFunc nif_funcs[] = {
+	{"call", 1, nif_call, ERL_NIF_DIRTY_JOB_IO_BOUND}
+};
+
+ERL_NIF_INIT(erl_i2c_nif, nif_funcs, load, NULL, upgrade, unload)
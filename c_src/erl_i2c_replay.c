@@ -0,0 +1,377 @@
+/*
+ * erl_i2c_replay.c
+ *
+ *  Created on: 09.09.2012
+ *      Author: Christian Adams <morlac78@googlemail.com>
+ *   Copyright: (c) 2012 by Christian Adams
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *   MA 02110-1301 USA.
+ *
+ */
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "erl_i2c_cnode.h"
+
+/*
+ * re-issues the transactions of a trace written with
+ * erl_i2c_cnode --trace - as fast as possible or, with --timed, at the
+ * offsets they were recorded at - on the real buses or simulated ones,
+ * and compares the latencies with the recorded ones
+ *
+ * prints per kind of transaction the recorded and the replayed
+ * p50/p99/p999 (us), the mean difference and the errors of both
+ */
+
+#define USAGE "usage: erl_i2c_replay [Options] Trace\n" \
+		"  --timed                 keep the recorded timing instead of running flat out\n" \
+		"  --no-writes             skip writes and combined transfers writing data\n" \
+		"  --simulate              simulated buses instead of /dev/i2c-N\n" \
+		"  --sim-clock Hz          their bus clock - 100000 by default\n" \
+		"  --sim-devices A,B,...   addresses devices answer at - 0x48 by default\n" \
+		"  --sim-nak [Address:]N   N NAKs per million transfers (to Address)"
+
+static const char* kinds[] = { NULL, "read", "write", "transfer", "probe" };
+
+#define KINDS 5
+
+// the longest read and the longest combined transfer
+#define REPLAY_BUF_LEN (I2C_MAX_DATA_LEN + \
+		I2C_RDWR_MAX_MSGS * (sizeof(t_trace_msg) + I2C_RDWR_MAX_LEN))
+
+typedef struct s_replay_stats {
+	long count;
+	unsigned long long* recorded;
+	unsigned long long* replayed;
+	long long delta_sum;
+	long recorded_errors;
+	long replayed_errors;
+	// failed in one but not in the other
+	long mismatches;
+} t_replay_stats;
+
+// the replay runs no commands - nothing to send
+int send_reply(t_cnode_state* state, erlang_pid* to, ei_x_buff* reply) {
+	return 0;
+}
+
+static void quit(const char* message) {
+	fprintf(stderr, "%s\n", message);
+	exit(1);
+}
+
+static int compare_ns(const void* a, const void* b) {
+	unsigned long long x = *(const unsigned long long*) a;
+	unsigned long long y = *(const unsigned long long*) b;
+
+	return (x > y) - (x < y);
+}
+
+static double percentile_us(unsigned long long* sorted, long count, double p) {
+	long index = count * p;
+
+	return count ? sorted[index < count ? index : count - 1] / 1000.0 : 0;
+}
+
+/*
+ * a combined transfer rebuilt from its record - buf gets a copy of the
+ * payload the messages point into, reads overwrite their part of it
+ */
+static int replay_rdwr(t_i2c_bus* i2c_bus, const t_trace_record* record, unsigned char* buf,
+		bool no_writes) {
+	struct i2c_msg msgs[I2C_RDWR_MAX_MSGS];
+	unsigned char* next = buf;
+	t_trace_msg msg;
+	int i;
+
+	if (record->reg > I2C_RDWR_MAX_MSGS || record->len > REPLAY_BUF_LEN) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memcpy(buf, TRACE_PAYLOAD(record), record->len);
+
+	for (i = 0; i < record->reg; i++) {
+		if (next + sizeof(msg) > buf + record->len) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		memcpy(&msg, next, sizeof(msg));
+		next += sizeof(msg);
+
+		if (next + msg.len > buf + record->len) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		// the register pointer of a read isn't a write worth skipping
+		if (no_writes && !(msg.flags & I2C_M_RD) && msg.len > 1) {
+			return 1;
+		}
+
+		msgs[i].addr = msg.addr;
+		msgs[i].flags = msg.flags;
+		msgs[i].len = msg.len;
+		msgs[i].buf = (char*) next;
+
+		next += msg.len;
+	}
+
+	return i2c_rdwr(i2c_bus, msgs, record->reg) < 0 ? -1 : 0;
+}
+
+/*
+ * returns 0, -1 with errno set if it failed or 1 if it was skipped
+ */
+static int replay_record(t_i2c_bus* i2c_bus, const t_trace_record* record, unsigned char* buf,
+		bool no_writes) {
+	int device_fd, result;
+
+	pthread_mutex_lock(&i2c_bus->lock);
+
+	if (record->type == TRACE_RDWR) {
+		result = replay_rdwr(i2c_bus, record, buf, no_writes);
+	} else if (record->type == TRACE_PROBE) {
+		result = i2c_probe(i2c_bus, record->address, record->reg == TRACE_PROBE_QUICK) < 0 ? -1 : 0;
+	} else if (record->type == TRACE_WRITE && no_writes) {
+		result = 1;
+	} else if (record->len > I2C_MAX_DATA_LEN) {
+		errno = EINVAL;
+		result = -1;
+	} else if ((device_fd = i2c_device_fd(i2c_bus, record->address)) < 0) {
+		result = -1;
+	} else if (record->type == TRACE_READ) {
+		result = i2c_read_data(i2c_bus, device_fd, record->address, record->reg,
+				record->len, buf) < 0 ? -1 : 0;
+	} else {
+		result = i2c_write_data(i2c_bus, device_fd, record->address, record->reg,
+				record->len, TRACE_PAYLOAD(record));
+	}
+
+	pthread_mutex_unlock(&i2c_bus->lock);
+
+	return result;
+}
+
+static void report(t_replay_stats* stats, int kind) {
+	if (!stats->count) {
+		return;
+	}
+
+	qsort(stats->recorded, stats->count, sizeof(unsigned long long), compare_ns);
+	qsort(stats->replayed, stats->count, sizeof(unsigned long long), compare_ns);
+
+	printf("%-9s %8ld   recorded p50 %8.1f p99 %8.1f p999 %8.1f   "
+			"replayed p50 %8.1f p99 %8.1f p999 %8.1f   mean diff %+8.1f us   "
+			"errors %ld/%ld (%ld differ)\n",
+			kinds[kind], stats->count,
+			percentile_us(stats->recorded, stats->count, 0.5),
+			percentile_us(stats->recorded, stats->count, 0.99),
+			percentile_us(stats->recorded, stats->count, 0.999),
+			percentile_us(stats->replayed, stats->count, 0.5),
+			percentile_us(stats->replayed, stats->count, 0.99),
+			percentile_us(stats->replayed, stats->count, 0.999),
+			stats->delta_sum / 1000.0 / stats->count,
+			stats->recorded_errors, stats->replayed_errors, stats->mismatches);
+}
+
+int main(int argc, char** argv) {
+	static const struct option options[] = {
+			{ "timed", no_argument, NULL, 'T' },
+			{ "no-writes", no_argument, NULL, 'w' },
+			{ "simulate", no_argument, NULL, 's' },
+			{ "sim-clock", required_argument, NULL, 'c' },
+			{ "sim-devices", required_argument, NULL, 'd' },
+			{ "sim-nak", required_argument, NULL, 'n' },
+			{ NULL, 0, NULL, 0 }
+	};
+	const t_bus_backend* backend = &kernel_backend;
+	t_i2c_bus* buses[I2C_MAX_BUSES] = { NULL };
+	t_replay_stats stats[KINDS], *kind;
+	bool timed = false, no_writes = false;
+	const t_trace_record* record;
+	struct timespec started, done, first, due, end;
+	unsigned long long* lateness;
+	unsigned long long capacity, first_timestamp = 0, last_timestamp = 0;
+	long skipped = 0, late = 0, replayed = 0, i;
+	unsigned char* buf;
+	uint64_t offset;
+	t_trace* trace;
+	int option, result;
+
+	while ((option = getopt_long(argc, argv, "", options, NULL)) != -1) {
+		switch (option) {
+		case 'T':
+			timed = true;
+			break;
+
+		case 'w':
+			no_writes = true;
+			break;
+
+		case 's':
+			backend = &sim_backend;
+			break;
+
+		case 'c':
+			if (sim_set_clock(atol(optarg)) < 0) {
+				quit("--sim-clock takes the bus clock in Hz (0 for no delay)");
+			}
+			break;
+
+		case 'd':
+			if (sim_add_devices(optarg) < 0) {
+				quit("--sim-devices takes a list of addresses like 0x48,0x50");
+			}
+			break;
+
+		case 'n':
+			if (sim_set_nak(optarg) < 0) {
+				quit("--sim-nak takes [Address:]NAKs per million transfers");
+			}
+			break;
+
+		default:
+			quit(USAGE);
+		}
+	}
+
+	if (optind != argc - 1) {
+		quit(USAGE);
+	}
+
+	if (!(trace = map_trace(argv[optind]))) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	// every record takes at least its header
+	capacity = (trace->header->head - trace->header->tail) / sizeof(t_trace_record) + 1;
+
+	memset(stats, 0, sizeof(stats));
+
+	for (i = 1; i < KINDS; i++) {
+		stats[i].recorded = malloc(capacity * sizeof(unsigned long long));
+		stats[i].replayed = malloc(capacity * sizeof(unsigned long long));
+
+		if (!stats[i].recorded || !stats[i].replayed) {
+			quit("out of memory");
+		}
+	}
+
+	if (!(lateness = malloc(capacity * sizeof(unsigned long long))) ||
+			!(buf = malloc(REPLAY_BUF_LEN))) {
+		quit("out of memory");
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &first);
+
+	for (offset = trace->header->tail; (record = next_trace_record(trace, &offset)); ) {
+		if (record->type < TRACE_READ || record->type > TRACE_PROBE) {
+			skipped++;
+			continue;
+		}
+
+		if (!first_timestamp) {
+			first_timestamp = record->timestamp;
+		}
+
+		last_timestamp = record->timestamp + record->duration;
+
+		if (!buses[record->bus] && !(buses[record->bus] = open_bus(record->bus, backend))) {
+			skipped++;
+			continue;
+		}
+
+		// the same offset from the start as when it was recorded
+		if (timed) {
+			due = first;
+			due.tv_sec += (record->timestamp - first_timestamp) / 1000000000;
+			due.tv_nsec += (record->timestamp - first_timestamp) % 1000000000;
+
+			if (due.tv_nsec >= 1000000000) {
+				due.tv_sec++;
+				due.tv_nsec -= 1000000000;
+			}
+
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &started);
+		result = replay_record(buses[record->bus], record, buf, no_writes);
+		clock_gettime(CLOCK_MONOTONIC, &done);
+
+		if (result > 0) {
+			skipped++;
+			continue;
+		}
+
+		if (timed) {
+			lateness[late++] = timespec_before(&due, &started) ? elapsed_ns(&due, &started) : 0;
+		}
+
+		kind = &stats[record->type];
+
+		kind->recorded[kind->count] = record->duration;
+		kind->replayed[kind->count] = elapsed_ns(&started, &done);
+		kind->delta_sum += (long long) kind->replayed[kind->count] - record->duration;
+		kind->recorded_errors += (record->result != 0);
+		kind->replayed_errors += (result < 0);
+		kind->mismatches += ((record->result != 0) != (result < 0));
+		kind->count++;
+
+		replayed++;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	printf("%ld transactions replayed, %ld skipped, %llu dropped while tracing - "
+			"%.3f s recorded, %.3f s replayed\n",
+			replayed, skipped, (unsigned long long) trace->header->dropped,
+			(last_timestamp - first_timestamp) / 1e9, elapsed_ns(&first, &end) / 1e9);
+
+	for (i = 1; i < KINDS; i++) {
+		report(&stats[i], i);
+	}
+
+	if (timed && late) {
+		qsort(lateness, late, sizeof(unsigned long long), compare_ns);
+
+		printf("issued late     p50 %8.1f p99 %8.1f p999 %8.1f us\n",
+				percentile_us(lateness, late, 0.5),
+				percentile_us(lateness, late, 0.99),
+				percentile_us(lateness, late, 0.999));
+	}
+
+	for (i = 0; i < I2C_MAX_BUSES; i++) {
+		release_bus(buses[i]);
+	}
+
+	for (i = 1; i < KINDS; i++) {
+		free(stats[i].recorded);
+		free(stats[i].replayed);
+	}
+
+	free(lateness);
+	free(buf);
+	close_trace(trace);
+
+	return 0;
+}
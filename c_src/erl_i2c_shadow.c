@@ -0,0 +1,201 @@
+/*
+ * erl_i2c_shadow.c
+ *
+ *  Created on: 09.09.2012
+ *      Author: Christian Adams <morlac78@googlemail.com>
+ *   Copyright: (c) 2012 by Christian Adams
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *   MA 02110-1301 USA.
+ *
+ */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "erl_i2c_cnode.h"
+
+/*
+ * register shadow of the devices on a bus - every function here must
+ * be called with i2c_bus->lock held
+ *
+ * block transfers are taken to auto-increment the register pointer,
+ * so Len bytes at Register are the registers Register .. Register+Len-1
+ */
+
+static t_register_shadow* get_shadow(t_i2c_bus* i2c_bus, int device_address) {
+	if (device_address < 0 || device_address >= I2C_MAX_DEVICES) {
+		return NULL;
+	}
+
+	return i2c_bus->shadows[device_address];
+}
+
+/*
+ * every register starts out volatile - so a device without a map
+ * behaves as if there was no shadow at all
+ */
+int shadow_set_mode(t_i2c_bus* i2c_bus, int device_address, int device_register, int mode) {
+	t_register_shadow* shadow;
+
+	if (device_address < 0 || device_address >= I2C_MAX_DEVICES ||
+			device_register < 0 || device_register >= I2C_MAX_REGISTERS) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!(shadow = i2c_bus->shadows[device_address])) {
+		if (!(shadow = (t_register_shadow*)calloc(1, sizeof(t_register_shadow)))) {
+			return -1;
+		}
+
+		i2c_bus->shadows[device_address] = shadow;
+	}
+
+	if (shadow->mode[device_register] != mode) {
+		shadow->mode[device_register] = mode;
+		shadow->valid[device_register] = false;
+	}
+
+	return 0;
+}
+
+/*
+ * SHADOW_HIT if all registers are known and not volatile - data holds
+ * them then; SHADOW_WRITE_ONLY if some write-only register isn't known
+ * and SHADOW_MISS if the device has to be read
+ */
+int shadow_read(t_i2c_bus* i2c_bus, int device_address, int device_register, int len,
+		__u8* data) {
+	t_register_shadow* shadow = get_shadow(i2c_bus, device_address);
+	int i, result = SHADOW_HIT;
+
+	if (!shadow || len <= 0 || device_register + len > I2C_MAX_REGISTERS) {
+		return SHADOW_MISS;
+	}
+
+	for (i = device_register; i < device_register + len; i++) {
+		if (shadow->mode[i] == REGISTER_VOLATILE) {
+			return SHADOW_MISS;
+		}
+
+		if (!shadow->valid[i]) {
+			result = (shadow->mode[i] == REGISTER_WRITE_ONLY) ? SHADOW_WRITE_ONLY : SHADOW_MISS;
+		}
+	}
+
+	if (result == SHADOW_HIT) {
+		memcpy(data, shadow->value + device_register, len);
+	}
+
+	return result;
+}
+
+/*
+ * remembers what was written to the device (written) or read from it
+ * - a read can't tell anything about write-only registers
+ */
+void shadow_update(t_i2c_bus* i2c_bus, int device_address, int device_register,
+		const __u8* data, int len, bool written) {
+	t_register_shadow* shadow = get_shadow(i2c_bus, device_address);
+	int i;
+
+	if (!shadow) {
+		return;
+	}
+
+	for (i = 0; i < len && device_register + i < I2C_MAX_REGISTERS; i++) {
+		switch (shadow->mode[device_register + i]) {
+		case REGISTER_WRITE_ONLY:
+			if (!written) {
+				break;
+			}
+			// fall through
+		case REGISTER_CACHEABLE:
+			shadow->value[device_register + i] = data[i];
+			shadow->valid[device_register + i] = true;
+			break;
+		}
+	}
+}
+
+/*
+ * forgets one register - or all of the device if device_register is -1
+ */
+void shadow_invalidate(t_i2c_bus* i2c_bus, int device_address, int device_register) {
+	t_register_shadow* shadow = get_shadow(i2c_bus, device_address);
+
+	if (!shadow) {
+		return;
+	}
+
+	if (device_register < 0) {
+		memset(shadow->valid, 0, sizeof(shadow->valid));
+	} else if (device_register < I2C_MAX_REGISTERS) {
+		shadow->valid[device_register] = false;
+	}
+}
+
+/*
+ * reads all cacheable registers of the device again - consecutive
+ * ones in one block read each; returns the number of registers read
+ */
+int shadow_sync(t_i2c_bus* i2c_bus, int device_address) {
+	t_register_shadow* shadow = get_shadow(i2c_bus, device_address);
+	__u8 data[I2C_SMBUS_I2C_BLOCK_MAX];
+	int device_fd, first, len, synced = 0;
+
+	if (!shadow) {
+		return 0;
+	}
+
+	if ((device_fd = i2c_device_fd(i2c_bus, device_address)) < 0) {
+		return -1;
+	}
+
+	errno = 0;
+
+	for (first = 0; first < I2C_MAX_REGISTERS; first += len) {
+		for (len = 0; first + len < I2C_MAX_REGISTERS && len < I2C_SMBUS_I2C_BLOCK_MAX &&
+				shadow->mode[first + len] == REGISTER_CACHEABLE; len++);
+
+		if (len == 0) {
+			len = 1;
+			continue;
+		}
+
+		if (i2c_read_data(i2c_bus, device_fd, device_address, first, len, data) != len) {
+			if (errno == 0) {
+				errno = EIO;
+			}
+
+			return -1;
+		}
+
+		shadow_update(i2c_bus, device_address, first, data, len, false);
+		synced += len;
+	}
+
+	return synced;
+}
+
+void free_shadows(t_i2c_bus* i2c_bus) {
+	int i;
+
+	for (i = 0; i < I2C_MAX_DEVICES; i++) {
+		free(i2c_bus->shadows[i]);
+		i2c_bus->shadows[i] = NULL;
+	}
+}
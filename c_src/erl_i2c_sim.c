@@ -0,0 +1,445 @@
+/*
+ * erl_i2c_sim.c
+ *
+ *  Created on: 09.09.2012
+ *      Author: Christian Adams <morlac78@googlemail.com>
+ *   Copyright: (c) 2012 by Christian Adams
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *   MA 02110-1301 USA.
+ *
+ */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "erl_i2c_cnode.h"
+
+/*
+ * buses without hardware - every bus number open_bus() takes (0 to
+ * I2C_MAX_BUSES - 1) opens, devices answer at the configured addresses
+ * (0x48 if none are) with a register file of 256 bytes each and
+ * every transfer takes as long as its bytes would at the configured
+ * clock (9 clocks a byte with the ACK, one more for every start and the
+ * stop). NAKs can be injected at random, per address or for all of
+ * them, the same sequence for every run
+ */
+
+// what the adapter can do - what i2c-stub does, plus I2C_RDWR with
+// I2C_M_NOSTART
+#define SIM_FUNCS (I2C_FUNC_I2C | I2C_FUNC_NOSTART | I2C_FUNC_SMBUS_QUICK | I2C_FUNC_SMBUS_BYTE | \
+		I2C_FUNC_SMBUS_BYTE_DATA | I2C_FUNC_SMBUS_WORD_DATA | I2C_FUNC_SMBUS_I2C_BLOCK)
+
+// handle slots - unbound and free
+#define SIM_UNBOUND -1
+#define SIM_FREE -2
+
+// NAKs are injected per million transfers
+#define SIM_NAK_SCALE 1000000
+
+typedef struct s_sim_device {
+	unsigned char registers[I2C_MAX_REGISTERS];
+	// where a transfer without a register continues - counts up
+	int pointer;
+} t_sim_device;
+
+typedef struct s_sim_bus {
+	// NULL where nothing answers
+	t_sim_device *devices[I2C_MAX_DEVICES];
+	// address each handle is bound to
+	int handles[SIM_MAX_HANDLES];
+	unsigned int seed;
+} t_sim_bus;
+
+// set from the command line before any bus is opened
+static struct {
+	long clock_hz;
+	bool devices_set;
+	unsigned char present[I2C_MAX_DEVICES / 8];
+	long nak_ppm[I2C_MAX_DEVICES];
+} sim_config = {
+		.clock_hz = SIM_DEFAULT_CLOCK
+};
+
+int sim_set_clock(long clock_hz) {
+	if (clock_hz < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	sim_config.clock_hz = clock_hz;
+
+	return 0;
+}
+
+/*
+ * "0x48,0x50,..." - may be given more than once
+ */
+int sim_add_devices(const char* addresses) {
+	const char* next = addresses;
+	char* end;
+	long address;
+
+	do {
+		address = strtol(next, &end, 0);
+
+		if (end == next || address < 0 || address >= I2C_MAX_DEVICES ||
+				(*end != ',' && *end != '\0')) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		sim_config.present[address / 8] |= 0x80 >> (address % 8);
+		sim_config.devices_set = true;
+
+		next = end + 1;
+	} while (*end == ',');
+
+	return 0;
+}
+
+/*
+ * "[Address:]PPM" - NAKs in a million transfers, for one address or
+ * for all of them
+ */
+int sim_set_nak(const char* spec) {
+	long address = -1, ppm;
+	char* end;
+	int i;
+
+	if (strchr(spec, ':')) {
+		address = strtol(spec, &end, 0);
+
+		if (end == spec || *end != ':' || address < 0 || address >= I2C_MAX_DEVICES) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		spec = end + 1;
+	}
+
+	ppm = strtol(spec, &end, 0);
+
+	if (end == spec || *end != '\0' || ppm < 0 || ppm > SIM_NAK_SCALE) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (i = 0; i < I2C_MAX_DEVICES; i++) {
+		if (address < 0 || i == address) {
+			sim_config.nak_ppm[i] = ppm;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * holds the bus as long as the transfer would have taken on the wire
+ */
+static void sim_wire_time(long clocks) {
+	struct timespec due;
+	long long ns;
+
+	if (sim_config.clock_hz <= 0) {
+		return;
+	}
+
+	ns = (long long) clocks * 1000000000 / sim_config.clock_hz;
+
+	clock_gettime(CLOCK_MONOTONIC, &due);
+
+	due.tv_sec += ns / 1000000000;
+	due.tv_nsec += ns % 1000000000;
+
+	if (due.tv_nsec >= 1000000000) {
+		due.tv_sec++;
+		due.tv_nsec -= 1000000000;
+	}
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR);
+}
+
+/*
+ * the device that ACKs its address or NULL with errno set - ENXIO
+ * if nothing is there, EREMOTEIO for an injected NAK
+ */
+static t_sim_device* sim_address(t_sim_bus* sim, int device_address) {
+	long ppm;
+
+	if (device_address < 0 || device_address >= I2C_MAX_DEVICES ||
+			!sim->devices[device_address]) {
+		errno = ENXIO;
+		return NULL;
+	}
+
+	if ((ppm = sim_config.nak_ppm[device_address]) &&
+			rand_r(&sim->seed) % SIM_NAK_SCALE < ppm) {
+		errno = EREMOTEIO;
+		return NULL;
+	}
+
+	return sim->devices[device_address];
+}
+
+static int sim_open(t_i2c_bus* i2c_bus) {
+	t_sim_bus* sim = (t_sim_bus*) i2c_bus->backend_data;
+	int address, handle;
+
+	if (!sim) {
+		if (!(sim = (t_sim_bus*) calloc(1, sizeof(t_sim_bus)))) {
+			return -1;
+		}
+
+		i2c_bus->backend_data = sim;
+
+		if (!sim_config.devices_set) {
+			sim_add_devices("0x48");
+		}
+
+		for (address = 0; address < I2C_MAX_DEVICES; address++) {
+			if ((sim_config.present[address / 8] & (0x80 >> (address % 8))) &&
+					!(sim->devices[address] = (t_sim_device*) calloc(1, sizeof(t_sim_device)))) {
+				return -1;
+			}
+		}
+
+		for (handle = 0; handle < SIM_MAX_HANDLES; handle++) {
+			sim->handles[handle] = SIM_FREE;
+		}
+
+		// the same NAKs for every run on the same bus
+		sim->seed = i2c_bus->bus_number + 1;
+	}
+
+	for (handle = 0; handle < SIM_MAX_HANDLES; handle++) {
+		if (sim->handles[handle] == SIM_FREE) {
+			sim->handles[handle] = SIM_UNBOUND;
+			return handle;
+		}
+	}
+
+	errno = EMFILE;
+	return -1;
+}
+
+static void sim_close(t_i2c_bus* i2c_bus, int handle) {
+	t_sim_bus* sim = (t_sim_bus*) i2c_bus->backend_data;
+
+	if (handle >= 0 && handle < SIM_MAX_HANDLES) {
+		sim->handles[handle] = SIM_FREE;
+	}
+}
+
+static void sim_release(t_i2c_bus* i2c_bus) {
+	t_sim_bus* sim = (t_sim_bus*) i2c_bus->backend_data;
+	int address;
+
+	if (!sim) {
+		return;
+	}
+
+	for (address = 0; address < I2C_MAX_DEVICES; address++) {
+		free(sim->devices[address]);
+	}
+
+	free(sim);
+	i2c_bus->backend_data = NULL;
+}
+
+static int sim_funcs(t_i2c_bus* i2c_bus, int handle, unsigned long* funcs) {
+	*funcs = SIM_FUNCS;
+
+	return 0;
+}
+
+static int sim_set_address(t_i2c_bus* i2c_bus, int handle, int device_address) {
+	t_sim_bus* sim = (t_sim_bus*) i2c_bus->backend_data;
+
+	if (handle < 0 || handle >= SIM_MAX_HANDLES || sim->handles[handle] == SIM_FREE) {
+		errno = EBADF;
+		return -1;
+	}
+
+	if (device_address < 0 || device_address >= I2C_MAX_DEVICES) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	sim->handles[handle] = device_address;
+
+	return 0;
+}
+
+/*
+ * one SMBus transfer to the device the handle is bound to - a read
+ * sends the register, then a repeated start and the address again
+ */
+static int sim_smbus(t_i2c_bus* i2c_bus, int handle, char read_write, __u8 command,
+		int size, union i2c_smbus_data* data) {
+	t_sim_bus* sim = (t_sim_bus*) i2c_bus->backend_data;
+	bool read = (read_write == I2C_SMBUS_READ);
+	t_sim_device* device;
+	int i, len;
+
+	if (handle < 0 || handle >= SIM_MAX_HANDLES || sim->handles[handle] == SIM_FREE) {
+		errno = EBADF;
+		return -1;
+	}
+
+	if (!(device = sim_address(sim, sim->handles[handle]))) {
+		// the address went out and nobody took it
+		sim_wire_time(9 + 2);
+		return -1;
+	}
+
+	switch (size) {
+	case I2C_SMBUS_QUICK:
+		sim_wire_time(9 + 2);
+		break;
+
+	case I2C_SMBUS_BYTE:
+		if (read) {
+			data->byte = device->registers[device->pointer];
+			device->pointer = (device->pointer + 1) % I2C_MAX_REGISTERS;
+		} else {
+			device->pointer = command;
+		}
+
+		sim_wire_time(2 * 9 + 2);
+		break;
+
+	case I2C_SMBUS_BYTE_DATA:
+		if (read) {
+			data->byte = device->registers[command];
+		} else {
+			device->registers[command] = data->byte;
+		}
+
+		device->pointer = (command + 1) % I2C_MAX_REGISTERS;
+		sim_wire_time(read ? 4 * 9 + 3 : 3 * 9 + 2);
+		break;
+
+	case I2C_SMBUS_WORD_DATA:
+		if (read) {
+			data->word = device->registers[command] |
+					(device->registers[(command + 1) % I2C_MAX_REGISTERS] << 8);
+		} else {
+			device->registers[command] = data->word & 0xff;
+			device->registers[(command + 1) % I2C_MAX_REGISTERS] = data->word >> 8;
+		}
+
+		device->pointer = (command + 2) % I2C_MAX_REGISTERS;
+		sim_wire_time(read ? 5 * 9 + 3 : 4 * 9 + 2);
+		break;
+
+	case I2C_SMBUS_I2C_BLOCK_BROKEN:
+	case I2C_SMBUS_I2C_BLOCK_DATA:
+		if ((len = data->block[0]) < 1 || len > I2C_SMBUS_I2C_BLOCK_MAX) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		for (i = 0; i < len; i++) {
+			if (read) {
+				data->block[i + 1] = device->registers[(command + i) % I2C_MAX_REGISTERS];
+			} else {
+				device->registers[(command + i) % I2C_MAX_REGISTERS] = data->block[i + 1];
+			}
+		}
+
+		device->pointer = (command + len) % I2C_MAX_REGISTERS;
+		sim_wire_time(read ? (3 + len) * 9 + 3 : (2 + len) * 9 + 2);
+		break;
+
+	default:
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * a combined transfer - the first byte written to a device sets its
+ * pointer, everything after that and every read continues from there;
+ * a message with I2C_M_NOSTART goes on with the one before it. Stops
+ * at the first message not ACKed like the adapter would
+ */
+static int sim_rdwr(t_i2c_bus* i2c_bus, struct i2c_msg* msgs, int nmsgs) {
+	t_sim_bus* sim = (t_sim_bus*) i2c_bus->backend_data;
+	t_sim_device* device = NULL;
+	unsigned char* buf;
+	long clocks = 1;
+	bool continued;
+	int i, j;
+
+	if (nmsgs < 1 || nmsgs > I2C_RDWR_MAX_MSGS) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (i = 0; i < nmsgs; i++) {
+		if (msgs[i].len < 0 || msgs[i].len > I2C_RDWR_MAX_LEN) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		continued = device && (msgs[i].flags & I2C_M_NOSTART) &&
+				(msgs[i].flags & I2C_M_RD) == (msgs[i - 1].flags & I2C_M_RD);
+
+		if (!continued) {
+			// start (or repeated start) and the address
+			clocks += 1 + 9;
+
+			if (!(device = sim_address(sim, msgs[i].addr))) {
+				sim_wire_time(clocks);
+				return -1;
+			}
+		}
+
+		buf = (unsigned char*) msgs[i].buf;
+
+		for (j = 0; j < msgs[i].len; j++) {
+			if (msgs[i].flags & I2C_M_RD) {
+				buf[j] = device->registers[device->pointer];
+			} else if (j == 0 && !continued) {
+				device->pointer = buf[0];
+				continue;
+			} else {
+				device->registers[device->pointer] = buf[j];
+			}
+
+			device->pointer = (device->pointer + 1) % I2C_MAX_REGISTERS;
+		}
+
+		clocks += msgs[i].len * 9;
+	}
+
+	sim_wire_time(clocks);
+
+	return nmsgs;
+}
+
+const t_bus_backend sim_backend = {
+		.name = "simulated",
+		.open = sim_open,
+		.close = sim_close,
+		.funcs = sim_funcs,
+		.set_address = sim_set_address,
+		.smbus = sim_smbus,
+		.rdwr = sim_rdwr,
+		.release = sim_release
+};
@@ -0,0 +1,203 @@
+/*
+ * erl_i2c_sim_test.c
+ *
+ *  Created on: 09.09.2012
+ *      Author: Christian Adams <morlac78@googlemail.com>
+ *   Copyright: (c) 2012 by Christian Adams
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *   MA 02110-1301 USA.
+ *
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "erl_i2c_cnode.h"
+
+/*
+ * checks the simulated backend through the transfers the commands use -
+ * reads and writes of every length class, a combined I2C_RDWR transfer,
+ * absent devices and injected NAKs. Run by make check, exits non-zero
+ * if anything failed
+ */
+
+#define TEST_BUS 1
+#define TEST_DEVICE 0x48
+#define TEST_ABSENT 0x49
+
+static int failures = 0;
+
+#define CHECK(condition) do { \
+		if (!(condition)) { \
+			fprintf(stderr, "%s:%d: %s failed (%s)\n", __FILE__, __LINE__, #condition, strerror(errno)); \
+			failures++; \
+		} \
+	} while (0)
+
+// the commands link against it - nothing is sent anywhere here
+int send_reply(t_cnode_state* state, erlang_pid* to, ei_x_buff* reply) {
+	return 0;
+}
+
+/*
+ * writes of len bytes at 0x10 - SMBus byte, word and block, I2C_RDWR
+ * and I2C_RDWR continued with I2C_M_NOSTART past I2C_RDWR_MAX_LEN - and
+ * the register file read back against what they should have left there
+ */
+static void test_round_trip(t_i2c_bus* i2c_bus, unsigned char* expected, int len) {
+	__u8 *data, registers[I2C_MAX_REGISTERS];
+	int device_fd, i;
+
+	if (!(data = (__u8*) malloc(len))) {
+		CHECK(data != NULL);
+		return;
+	}
+
+	for (i = 0; i < len; i++) {
+		data[i] = (i * 7 + len) & 0xff;
+		expected[(0x10 + i) % I2C_MAX_REGISTERS] = data[i];
+	}
+
+	CHECK((device_fd = i2c_device_fd(i2c_bus, TEST_DEVICE)) >= 0);
+	CHECK(i2c_write_data(i2c_bus, device_fd, TEST_DEVICE, 0x10, len, data) == 0);
+
+	if (len <= I2C_MAX_REGISTERS) {
+		memset(registers, 0, sizeof(registers));
+		CHECK(i2c_read_data(i2c_bus, device_fd, TEST_DEVICE, 0x10, len, registers) == len);
+		CHECK(memcmp(registers, data, len) == 0);
+	}
+
+	memset(registers, 0, sizeof(registers));
+	CHECK(i2c_read_data(i2c_bus, device_fd, TEST_DEVICE, 0, I2C_MAX_REGISTERS, registers) ==
+			I2C_MAX_REGISTERS);
+	CHECK(memcmp(registers, expected, I2C_MAX_REGISTERS) == 0);
+
+	free(data);
+}
+
+/*
+ * a write and a register read with a repeated start in one transfer
+ */
+static void test_transfer(t_i2c_bus* i2c_bus) {
+	__u8 write[] = { 0x20, 0xaa, 0x55 }, reg = 0x20, read[2] = { 0, 0 };
+	struct i2c_msg msgs[3] = {
+			{ .addr = TEST_DEVICE, .flags = 0, .len = sizeof(write), .buf = (char*) write },
+			{ .addr = TEST_DEVICE, .flags = 0, .len = 1, .buf = (char*) &reg },
+			{ .addr = TEST_DEVICE, .flags = I2C_M_RD, .len = sizeof(read), .buf = (char*) read }
+	};
+
+	CHECK(i2c_rdwr(i2c_bus, msgs, 3) == 3);
+	CHECK(read[0] == 0xaa && read[1] == 0x55);
+}
+
+static void test_absent(t_i2c_bus* i2c_bus) {
+	struct i2c_msg msg = { .addr = TEST_ABSENT, .flags = 0, .len = 0, .buf = NULL };
+	__u8 data[4];
+	int device_fd;
+
+	CHECK((device_fd = i2c_device_fd(i2c_bus, TEST_ABSENT)) >= 0);
+
+	errno = 0;
+	CHECK(i2c_read_data(i2c_bus, device_fd, TEST_ABSENT, 0, 1, data) < 0 && errno == ENXIO);
+	errno = 0;
+	CHECK(i2c_rdwr(i2c_bus, &msg, 1) < 0 && errno == ENXIO);
+}
+
+/*
+ * every transfer NAKed, then a quarter of them - the count is the same
+ * for every run, only checked to be about right here
+ */
+static void test_nak(t_i2c_bus* i2c_bus) {
+	int device_fd, i, naks = 0, others = 0;
+	__u8 data;
+
+	CHECK(sim_set_nak("0x48:2000000") < 0 && errno == EINVAL);
+	CHECK(sim_set_nak("0x48:") < 0 && errno == EINVAL);
+
+	CHECK((device_fd = i2c_device_fd(i2c_bus, TEST_DEVICE)) >= 0);
+
+	CHECK(sim_set_nak("0x48:1000000") == 0);
+	errno = 0;
+	CHECK(i2c_read_data(i2c_bus, device_fd, TEST_DEVICE, 0, 1, &data) < 0 && errno == EREMOTEIO);
+	errno = 0;
+	CHECK(i2c_write_data(i2c_bus, device_fd, TEST_DEVICE, 0, 1, &data) < 0 && errno == EREMOTEIO);
+
+	CHECK(sim_set_nak("0x48:250000") == 0);
+
+	for (i = 0; i < 4000; i++) {
+		if (i2c_read_data(i2c_bus, device_fd, TEST_DEVICE, 0, 1, &data) < 0) {
+			if (errno == EREMOTEIO) {
+				naks++;
+			} else {
+				others++;
+			}
+		}
+	}
+
+	CHECK(naks > 800 && naks < 1200);
+	CHECK(others == 0);
+
+	// other addresses are left alone
+	CHECK(sim_set_nak("0x50:1000000") == 0);
+	CHECK(sim_set_nak("0x48:0") == 0);
+	CHECK(i2c_read_data(i2c_bus, device_fd, TEST_DEVICE, 0, 1, &data) == 1);
+	CHECK(sim_set_nak("0") == 0);
+}
+
+int main(int argc, char **argv) {
+	int lengths[] = { 1, 2, 17, I2C_SMBUS_I2C_BLOCK_MAX, I2C_SMBUS_I2C_BLOCK_MAX + 1,
+			I2C_MAX_REGISTERS, 1000, I2C_RDWR_MAX_LEN + 1000 };
+	unsigned char expected[I2C_MAX_REGISTERS];
+	t_i2c_bus* i2c_bus;
+	int i;
+
+	sim_set_clock(0);
+	CHECK(sim_add_devices("0x48,0x50") == 0);
+	CHECK(sim_add_devices("0x80") < 0 && errno == EINVAL);
+
+	CHECK(open_bus(I2C_MAX_BUSES, &sim_backend) == NULL && errno == EINVAL);
+
+	if (!(i2c_bus = open_bus(TEST_BUS, &sim_backend))) {
+		fprintf(stderr, "open_bus(%d): %s\n", TEST_BUS, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	pthread_mutex_lock(&i2c_bus->lock);
+
+	memset(expected, 0, sizeof(expected));
+
+	for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+		test_round_trip(i2c_bus, expected, lengths[i]);
+	}
+
+	test_transfer(i2c_bus);
+	test_absent(i2c_bus);
+	test_nak(i2c_bus);
+
+	pthread_mutex_unlock(&i2c_bus->lock);
+
+	release_bus(i2c_bus);
+
+	if (failures) {
+		fprintf(stderr, "%d checks failed\n", failures);
+		return EXIT_FAILURE;
+	}
+
+	printf("sim backend: all checks passed\n");
+
+	return EXIT_SUCCESS;
+}
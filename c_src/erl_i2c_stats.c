@@ -0,0 +1,206 @@
+/*
+ * erl_i2c_stats.c
+ *
+ *  Created on: 09.09.2012
+ *      Author: Christian Adams <morlac78@googlemail.com>
+ *   Copyright: (c) 2012 by Christian Adams
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *   MA 02110-1301 USA.
+ *
+ */
+#include <stdlib.h>
+
+#include "erl_i2c_cnode.h"
+
+/*
+ * latency histograms per command and phase, kept per bus - HDR style
+ * log-linear buckets, so a bucket is at most 25% wide whatever the
+ * magnitude; updated with relaxed atomics, so a reader may see a
+ * sample half counted but nobody ever waits for the stats
+ */
+
+static const char* phase_names[STATS_PHASES] = {
+	"decode", "queue", "execute", "ioctl", "encode", "send"
+};
+
+t_stats* new_stats(void) {
+	return (t_stats*)calloc(1, sizeof(t_stats));
+}
+
+unsigned long long elapsed_ns(const struct timespec* from, const struct timespec* to) {
+	long long ns = (long long)(to->tv_sec - from->tv_sec) * 1000000000LL +
+			(to->tv_nsec - from->tv_nsec);
+
+	return ns > 0 ? ns : 0;
+}
+
+static int bucket_of(unsigned long long ns) {
+	int msb, bucket;
+
+	if (ns < (1 << STATS_SUB_BUCKET_BITS)) {
+		return ns;
+	}
+
+	msb = 63 - __builtin_clzll(ns);
+	bucket = ((msb - STATS_SUB_BUCKET_BITS + 1) << STATS_SUB_BUCKET_BITS) +
+			((ns >> (msb - STATS_SUB_BUCKET_BITS)) & ((1 << STATS_SUB_BUCKET_BITS) - 1));
+
+	return bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1;
+}
+
+// the smallest value counted in the bucket
+static unsigned long long bucket_floor(int bucket) {
+	int shift;
+
+	if (bucket < (1 << STATS_SUB_BUCKET_BITS)) {
+		return bucket;
+	}
+
+	shift = (bucket >> STATS_SUB_BUCKET_BITS) - 1;
+
+	return (unsigned long long)((1 << STATS_SUB_BUCKET_BITS) +
+			(bucket & ((1 << STATS_SUB_BUCKET_BITS) - 1))) << shift;
+}
+
+static void record(t_histogram* histogram, unsigned long long ns) {
+	unsigned long long max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+
+	__atomic_add_fetch(&histogram->buckets[bucket_of(ns)], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&histogram->count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&histogram->sum, ns, __ATOMIC_RELAXED);
+
+	while (ns > max && !__atomic_compare_exchange_n(&histogram->max, &max, ns,
+			true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void stats_phase(t_stats* stats, const t_command* cmd, int phase,
+		const struct timespec* from, const struct timespec* to) {
+	stats_record(stats, cmd, phase, elapsed_ns(from, to));
+}
+
+void stats_record(t_stats* stats, const t_command* cmd, int phase,
+		unsigned long long ns) {
+	if (stats && cmd) {
+		record(&stats->phases[command_index(cmd)][phase], ns);
+	}
+}
+
+void stats_error(t_stats* stats, const t_command* cmd, int errnum) {
+	if (stats && cmd) {
+		if (errnum < 0 || errnum >= STATS_MAX_ERRNO) {
+			errnum = 0;
+		}
+
+		__atomic_add_fetch(&stats->errors[command_index(cmd)][errnum], 1, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * a counter read for a reply - taken out of it in one step if the stats
+ * are reset, so every sample counted meanwhile is in this reply or the
+ * next one, never lost in between
+ */
+#define READ_COUNTER(counter, reset) ((reset) ? \
+		__atomic_exchange_n(&(counter), 0, __ATOMIC_RELAXED) : \
+		__atomic_load_n(&(counter), __ATOMIC_RELAXED))
+
+// {Count, Sum, Max, [{Floor, Count}]} - in nanoseconds, empty buckets left out
+static void encode_histogram(ei_x_buff* reply, t_histogram* histogram, bool reset) {
+	unsigned int count;
+	int bucket;
+
+	ei_x_encode_tuple_header(reply, 4);
+	ei_x_encode_ulonglong(reply, READ_COUNTER(histogram->count, reset));
+	ei_x_encode_ulonglong(reply, READ_COUNTER(histogram->sum, reset));
+	ei_x_encode_ulonglong(reply, READ_COUNTER(histogram->max, reset));
+
+	for (bucket = 0; bucket < STATS_BUCKETS; bucket++) {
+		if ((count = READ_COUNTER(histogram->buckets[bucket], reset))) {
+			ei_x_encode_list_header(reply, 1);
+			ei_x_encode_tuple_header(reply, 2);
+			ei_x_encode_ulonglong(reply, bucket_floor(bucket));
+			ei_x_encode_ulong(reply, count);
+		}
+	}
+
+	ei_x_encode_empty_list(reply);
+}
+
+// anything counted for the command - in any phase or as an error
+static bool command_seen(t_stats* stats, int i) {
+	int phase, errnum;
+
+	for (phase = 0; phase < STATS_PHASES; phase++) {
+		if (__atomic_load_n(&stats->phases[i][phase].count, __ATOMIC_RELAXED)) {
+			return true;
+		}
+	}
+
+	for (errnum = 0; errnum < STATS_MAX_ERRNO; errnum++) {
+		if (__atomic_load_n(&stats->errors[i][errnum], __ATOMIC_RELAXED)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * [{Command, [{Phase, Histogram}], [{Errno, Count}]}] for every command
+ * with anything counted - with reset every counter is taken out as it
+ * is encoded (see READ_COUNTER). A sample recorded while its histogram
+ * is encoded can still have its count in one reply and its bucket in
+ * the next
+ */
+void encode_stats(ei_x_buff* reply, t_stats* stats, bool reset) {
+	const t_command* cmd;
+	unsigned int count;
+	int i, phase, errnum;
+
+	for (i = 0; stats && (cmd = command_at(i)); i++) {
+		// nothing to report, nothing to reset
+		if (!command_seen(stats, i)) {
+			continue;
+		}
+
+		ei_x_encode_list_header(reply, 1);
+		ei_x_encode_tuple_header(reply, 3);
+		ei_x_encode_atom(reply, cmd->name);
+
+		ei_x_encode_list_header(reply, STATS_PHASES);
+
+		for (phase = 0; phase < STATS_PHASES; phase++) {
+			ei_x_encode_tuple_header(reply, 2);
+			ei_x_encode_atom(reply, phase_names[phase]);
+			encode_histogram(reply, &stats->phases[i][phase], reset);
+		}
+
+		ei_x_encode_empty_list(reply);
+
+		for (errnum = 0; errnum < STATS_MAX_ERRNO; errnum++) {
+			if ((count = READ_COUNTER(stats->errors[i][errnum], reset))) {
+				ei_x_encode_list_header(reply, 1);
+				ei_x_encode_tuple_header(reply, 2);
+				ei_x_encode_long(reply, errnum);
+				ei_x_encode_ulong(reply, count);
+			}
+		}
+
+		ei_x_encode_empty_list(reply);
+	}
+
+	ei_x_encode_empty_list(reply);
+}
@@ -0,0 +1,501 @@
+/*
+ * erl_i2c_subscription.c
+ *
+ *  Created on: 09.09.2012
+ *      Author: Christian Adams <morlac78@googlemail.com>
+ *   Copyright: (c) 2012 by Christian Adams
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *   MA 02110-1301 USA.
+ *
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "erl_i2c_cnode.h"
+
+/*
+ * subscriptions are polled by the worker of their bus in between the
+ * requests for that bus - the worker sleeps on its queue until either
+ * a request comes in or the next subscription is due, so sampling
+ * needs neither a timer on the erlang side nor a round trip per sample
+ */
+
+t_subscription* new_subscription(const erlang_pid* to, int device_address,
+		int device_register, int len, long interval, int batch_count,
+		long flush_after, t_cnode_state* state) {
+	t_subscription* subscription = (t_subscription*)calloc(1, sizeof(t_subscription));
+
+	if (!subscription) {
+		return NULL;
+	}
+
+	if (batch_count > 1 &&
+			!(subscription->records = malloc(batch_count * SAMPLE_RECORD_SIZE(len)))) {
+		free(subscription);
+		return NULL;
+	}
+
+	subscription->id = __atomic_add_fetch(&state->last_subscription_id, 1, __ATOMIC_ACQ_REL) *
+			state->instances + state->instance;
+	subscription->to = *to;
+	subscription->device_address = device_address;
+	subscription->device_register = device_register;
+	subscription->len = len;
+	subscription->interval = interval;
+	subscription->batch_count = batch_count;
+	subscription->flush_after = flush_after;
+
+	clock_gettime(CLOCK_MONOTONIC, &subscription->due);
+	timespec_add_us(&subscription->due, interval);
+
+	return subscription;
+}
+
+/*
+ * the worker takes over the subscription and is woken up to take
+ * its deadline into account
+ */
+void add_subscription(t_worker* worker, t_subscription* subscription) {
+	pthread_mutex_lock(&worker->subscription_lock);
+	subscription->next = worker->subscriptions;
+	worker->subscriptions = subscription;
+	pthread_mutex_unlock(&worker->subscription_lock);
+
+	reschedule_worker(worker);
+}
+
+/*
+ * unlinks the subscription and sends the samples it collected so far
+ * (buf is the caller's scratch buffer) - false if the worker doesn't
+ * poll it. One the worker is polling right now is left to the worker,
+ * which flushes and frees it once done with it
+ */
+bool remove_subscription(t_worker* worker, long id, ei_x_buff* buf) {
+	t_subscription **link, *subscription = NULL;
+
+	pthread_mutex_lock(&worker->subscription_lock);
+
+	for (link = &worker->subscriptions; *link; link = &(*link)->next) {
+		if ((*link)->id == id) {
+			subscription = *link;
+			*link = subscription->next;
+			subscription->removed = true;
+			break;
+		}
+	}
+
+	if (subscription && subscription->polling) {
+		pthread_mutex_unlock(&worker->subscription_lock);
+		return true;
+	}
+
+	pthread_mutex_unlock(&worker->subscription_lock);
+
+	if (!subscription) {
+		return false;
+	}
+
+	flush_samples(subscription, buf, worker->state);
+	free_subscription(subscription);
+
+	return true;
+}
+
+/*
+ * turns the subscription into a watch - an empty mask watches all bits
+ */
+void set_watch(t_subscription* subscription, const char* mask, long mask_len,
+		long hysteresis) {
+	subscription->watch = true;
+	subscription->hysteresis = hysteresis;
+	subscription->last_len = -1;
+
+	if (mask_len > 0) {
+		memcpy(subscription->mask, mask, mask_len);
+	} else {
+		memset(subscription->mask, 0xff, subscription->len);
+	}
+}
+
+void free_subscription(t_subscription* subscription) {
+	free(subscription->records);
+	free(subscription);
+}
+
+/*
+ * the worker is stopped already - samples still collected are sent
+ */
+void free_subscriptions(t_worker* worker) {
+	t_subscription* subscription;
+
+	while ((subscription = worker->subscriptions)) {
+		worker->subscriptions = subscription->next;
+
+		flush_samples(subscription, &worker->reply, worker->state);
+		free_subscription(subscription);
+	}
+}
+
+/*
+ * false if there's nothing to poll
+ */
+bool next_subscription_due(t_worker* worker, struct timespec* due) {
+	t_subscription* subscription;
+	bool found = false;
+
+	pthread_mutex_lock(&worker->subscription_lock);
+
+	for (subscription = worker->subscriptions; subscription; subscription = subscription->next) {
+		if (!found || timespec_before(&subscription->due, due)) {
+			*due = subscription->due;
+			found = true;
+		}
+
+		if (subscription->nrecords > 0 && subscription->flush_after > 0 &&
+				timespec_before(&subscription->flush_due, due)) {
+			*due = subscription->flush_due;
+		}
+	}
+
+	pthread_mutex_unlock(&worker->subscription_lock);
+
+	return found;
+}
+
+static long long sample_timestamp(void) {
+	struct timespec now;
+
+	// wall clock, to be comparable with erlang:system_time(microsecond)
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	return (long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static int send_sample(t_worker* worker, t_subscription* subscription,
+		const __u8* data, int len) {
+	ei_x_buff* sample = &worker->reply;
+
+	sample->index = 0;
+	ei_x_encode_version(sample);
+	ei_x_encode_tuple_header(sample, 4);
+	ei_x_encode_atom(sample, subscription->watch ? "erl_i2c_change" : "erl_i2c_sample");
+	ei_x_encode_long(sample, subscription->id);
+	ei_x_encode_longlong(sample, sample_timestamp());
+
+	if (len >= 0) {
+		ei_x_encode_binary(sample, data, len);
+	} else {
+		ei_x_encode_tuple_header(sample, 2);
+		ei_x_encode_atom(sample, "error");
+		ei_x_encode_atom(sample, "i2c_error");
+	}
+
+	return send_reply(worker->state, &subscription->to, sample);
+}
+
+/*
+ * sends the records collected so far as one binary
+ * {erl_i2c_samples, Id, Data_Len, Records} - buf is the caller's
+ * scratch buffer; returns what send_reply() did
+ */
+int flush_samples(t_subscription* subscription, ei_x_buff* buf, t_cnode_state* state) {
+	int result;
+
+	if (subscription->nrecords == 0) {
+		return 0;
+	}
+
+	buf->index = 0;
+	ei_x_encode_version(buf);
+	ei_x_encode_tuple_header(buf, 4);
+	ei_x_encode_atom(buf, "erl_i2c_samples");
+	ei_x_encode_long(buf, subscription->id);
+	ei_x_encode_long(buf, subscription->len);
+	ei_x_encode_binary(buf, subscription->records,
+			subscription->nrecords * SAMPLE_RECORD_SIZE(subscription->len));
+
+	result = send_reply(state, &subscription->to, buf);
+
+	subscription->nrecords = 0;
+
+	return result;
+}
+
+/*
+ * appends one record - the timestamp is stored big endian, the data
+ * zero padded to the subscribed length
+ */
+static int collect_sample(t_worker* worker, t_subscription* subscription,
+		const __u8* data, int len, const struct timespec* now) {
+	unsigned char* record = subscription->records +
+			subscription->nrecords * SAMPLE_RECORD_SIZE(subscription->len);
+	unsigned long long timestamp = sample_timestamp();
+	int i;
+
+	for (i = 7; i >= 0; i--) {
+		record[i] = timestamp & 0xff;
+		timestamp >>= 8;
+	}
+
+	if (len < 0) {
+		len = 0;
+	}
+
+	record[8] = len;
+	memcpy(record + 9, data, len);
+	memset(record + 9 + len, 0, subscription->len - len);
+
+	if (subscription->nrecords++ == 0) {
+		subscription->flush_due = *now;
+		timespec_add_us(&subscription->flush_due, subscription->flush_after);
+	}
+
+	if (subscription->nrecords == subscription->batch_count) {
+		return flush_samples(subscription, &worker->reply, worker->state);
+	}
+
+	return 0;
+}
+
+static unsigned long long masked_value(t_subscription* subscription, const __u8* data) {
+	unsigned long long value = 0;
+	int i;
+
+	for (i = 0; i < subscription->len; i++) {
+		value = (value << 8) | (data[i] & subscription->mask[i]);
+	}
+
+	return value;
+}
+
+/*
+ * true if a watch has to notify the read - remembers it as the last
+ * value notified then; a short read is compared zero padded to the
+ * watched length like collect_sample() stores it
+ */
+static bool watch_changed(t_subscription* subscription, __u8* data, int len) {
+	unsigned long long last, current;
+	int i;
+
+	if (len < 0) {
+		// a failing device is reported once, not with every poll
+		if (subscription->last_len == 0) {
+			return false;
+		}
+
+		subscription->last_len = 0;
+
+		return true;
+	}
+
+	if (len < subscription->len) {
+		memset(data + len, 0, subscription->len - len);
+	}
+
+	if (subscription->last_len == subscription->len) {
+		if (subscription->hysteresis > 0) {
+			last = masked_value(subscription, subscription->last);
+			current = masked_value(subscription, data);
+
+			if ((current > last ? current - last : last - current) <=
+					(unsigned long long) subscription->hysteresis) {
+				return false;
+			}
+		} else {
+			for (i = 0; i < subscription->len; i++) {
+				if ((data[i] ^ subscription->last[i]) & subscription->mask[i]) {
+					break;
+				}
+			}
+
+			if (i == subscription->len) {
+				return false;
+			}
+		}
+	}
+
+	memcpy(subscription->last, data, subscription->len);
+	subscription->last_len = subscription->len;
+
+	return true;
+}
+
+/*
+ * reads the subscription and sends what it has to - -1 if sending
+ * failed
+ */
+static int poll_subscription(t_worker* worker, t_subscription* subscription,
+		const struct timespec* now) {
+	t_i2c_bus* i2c_bus = worker->bus;
+	__u8 data[I2C_SMBUS_I2C_BLOCK_MAX];
+	int device_fd, len;
+
+	pthread_mutex_lock(&i2c_bus->lock);
+
+	flush_writes(i2c_bus, subscription->device_address, false);
+
+	if ((device_fd = i2c_device_fd(i2c_bus, subscription->device_address)) < 0) {
+		len = -1;
+	} else {
+		len = i2c_read_data(
+				i2c_bus,
+				device_fd,
+				subscription->device_address,
+				subscription->device_register,
+				subscription->len,
+				data);
+	}
+
+	pthread_mutex_unlock(&i2c_bus->lock);
+
+	if (subscription->watch) {
+		return watch_changed(subscription, data, len) ?
+				send_sample(worker, subscription, data, len) : 0;
+	}
+
+	if (subscription->batch_count > 1) {
+		return collect_sample(worker, subscription, data, len, now);
+	}
+
+	return send_sample(worker, subscription, data, len);
+}
+
+/*
+ * reads every subscription which is due and sends the samples - a
+ * subscription falling behind skips the samples it missed instead
+ * of catching up in a burst
+ *
+ * the due ones are picked under the subscription lock, the reads and
+ * sends run without it, so (un)subscribing and listing don't wait
+ * for a slow device or a blocked connection; a subscriber that can't
+ * be sent to any more is dropped
+ */
+void run_due_subscriptions(t_worker* worker) {
+	t_subscription **link, *subscription, *due = NULL, **due_tail = &due, *dropped = NULL;
+	struct timespec now;
+	bool flush, poll;
+
+	if (!worker->bus) {
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	pthread_mutex_lock(&worker->subscription_lock);
+
+	for (subscription = worker->subscriptions; subscription; subscription = subscription->next) {
+		flush = subscription->nrecords > 0 && subscription->flush_after > 0 &&
+				!timespec_before(&now, &subscription->flush_due);
+		poll = !timespec_before(&now, &subscription->due);
+
+		if (flush || poll) {
+			subscription->polling = true;
+			subscription->next_due = NULL;
+			*due_tail = subscription;
+			due_tail = &subscription->next_due;
+		}
+	}
+
+	pthread_mutex_unlock(&worker->subscription_lock);
+
+	// only this thread changes the state of a subscription being polled
+	for (subscription = due; subscription; subscription = subscription->next_due) {
+		if (subscription->nrecords > 0 && subscription->flush_after > 0 &&
+				!timespec_before(&now, &subscription->flush_due) &&
+				flush_samples(subscription, &worker->reply, worker->state) < 0) {
+			subscription->failed = true;
+			continue;
+		}
+
+		if (timespec_before(&now, &subscription->due)) {
+			continue;
+		}
+
+		if (poll_subscription(worker, subscription, &now) < 0) {
+			subscription->failed = true;
+			continue;
+		}
+
+		timespec_add_us(&subscription->due, subscription->interval);
+
+		if (timespec_before(&subscription->due, &now)) {
+			subscription->due = now;
+			timespec_add_us(&subscription->due, subscription->interval);
+		}
+	}
+
+	pthread_mutex_lock(&worker->subscription_lock);
+
+	while ((subscription = due)) {
+		due = subscription->next_due;
+		subscription->polling = false;
+
+		if (subscription->failed && !subscription->removed) {
+			for (link = &worker->subscriptions; *link != subscription; link = &(*link)->next);
+			*link = subscription->next;
+			subscription->removed = true;
+		}
+
+		if (subscription->removed) {
+			subscription->next_due = dropped;
+			dropped = subscription;
+		}
+	}
+
+	pthread_mutex_unlock(&worker->subscription_lock);
+
+	while ((subscription = dropped)) {
+		dropped = subscription->next_due;
+
+		// unsubscribed while being polled - what was collected still goes out
+		if (!subscription->failed) {
+			flush_samples(subscription, &worker->reply, worker->state);
+		}
+
+		free_subscription(subscription);
+	}
+}
+
+/*
+ * appends {Id, Bus_Number, Device_Address, Register, Data_Len,
+ * Interval, Pid, Batch_Count, Flush_After} for every subscription of the worker to an open
+ * list (one cons cell each) - returns the number appended
+ */
+int encode_subscriptions(ei_x_buff* list, t_worker* worker) {
+	t_subscription* subscription;
+	int count = 0;
+
+	pthread_mutex_lock(&worker->subscription_lock);
+
+	for (subscription = worker->subscriptions; subscription; subscription = subscription->next) {
+		ei_x_encode_list_header(list, 1);
+		ei_x_encode_tuple_header(list, 9);
+		ei_x_encode_long(list, subscription->id);
+		ei_x_encode_long(list, worker->bus->bus_number);
+		ei_x_encode_long(list, subscription->device_address);
+		ei_x_encode_long(list, subscription->device_register);
+		ei_x_encode_long(list, subscription->len);
+		ei_x_encode_long(list, subscription->interval);
+		ei_x_encode_pid(list, &subscription->to);
+		ei_x_encode_long(list, subscription->batch_count);
+		ei_x_encode_long(list, subscription->flush_after);
+		count++;
+	}
+
+	pthread_mutex_unlock(&worker->subscription_lock);
+
+	return count;
+}
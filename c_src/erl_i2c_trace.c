@@ -0,0 +1,313 @@
+/*
+ * erl_i2c_trace.c
+ *
+ *  Created on: 09.09.2012
+ *      Author: Christian Adams <morlac78@googlemail.com>
+ *   Copyright: (c) 2012 by Christian Adams
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *   MA 02110-1301 USA.
+ *
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "erl_i2c_cnode.h"
+
+/*
+ * every transaction on the buses appended to a memory-mapped ring file
+ * - a header followed by the ring of records; once the ring is full
+ * the oldest records are dropped to make room. records never wrap
+ * around the end of the ring, the rest of it is skipped with a
+ * TRACE_PAD record then. the file can be read while it is written,
+ * consistent between records (tail .. head) once closed
+ */
+
+#define TRACE_ALIGN(size) (((size) + 7) & ~7UL)
+
+static uint64_t timespec_ns(const struct timespec* ts) {
+	return (uint64_t) ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+/*
+ * creates (or truncates) path with a ring of ring_size bytes
+ */
+t_trace* open_trace(const char* path, size_t ring_size) {
+	t_trace* trace;
+
+	ring_size = TRACE_ALIGN(ring_size);
+
+	if (ring_size < TRACE_MIN_RING) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (!(trace = (t_trace*) calloc(1, sizeof(t_trace)))) {
+		return NULL;
+	}
+
+	trace->map_len = sizeof(t_trace_header) + ring_size;
+
+	if ((trace->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+		free(trace);
+		return NULL;
+	}
+
+	if (ftruncate(trace->fd, trace->map_len) < 0 ||
+			(trace->header = mmap(NULL, trace->map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+					trace->fd, 0)) == MAP_FAILED) {
+		close(trace->fd);
+		free(trace);
+		return NULL;
+	}
+
+	trace->ring = (unsigned char*) trace->header + sizeof(t_trace_header);
+	trace->writable = true;
+
+	memcpy(trace->header->magic, TRACE_MAGIC, sizeof(trace->header->magic));
+	trace->header->version = TRACE_VERSION;
+	trace->header->header_size = sizeof(t_trace_header);
+	trace->header->ring_size = ring_size;
+
+	pthread_mutex_init(&trace->lock, NULL);
+
+	return trace;
+}
+
+/*
+ * maps an existing trace read-only - for the replay
+ */
+t_trace* map_trace(const char* path) {
+	t_trace* trace;
+	struct stat st;
+
+	if (!(trace = (t_trace*) calloc(1, sizeof(t_trace)))) {
+		return NULL;
+	}
+
+	if ((trace->fd = open(path, O_RDONLY)) < 0) {
+		free(trace);
+		return NULL;
+	}
+
+	if (fstat(trace->fd, &st) < 0 || st.st_size < (off_t) sizeof(t_trace_header) ||
+			(trace->header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+					trace->fd, 0)) == MAP_FAILED) {
+		close(trace->fd);
+		free(trace);
+		return NULL;
+	}
+
+	trace->map_len = st.st_size;
+	trace->ring = (unsigned char*) trace->header + sizeof(t_trace_header);
+
+	if (memcmp(trace->header->magic, TRACE_MAGIC, sizeof(trace->header->magic)) != 0 ||
+			trace->header->version != TRACE_VERSION ||
+			trace->header->header_size != sizeof(t_trace_header) ||
+			trace->header->ring_size + sizeof(t_trace_header) > trace->map_len) {
+		close_trace(trace);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	pthread_mutex_init(&trace->lock, NULL);
+
+	return trace;
+}
+
+void close_trace(t_trace* trace) {
+	if (trace->writable) {
+		msync(trace->header, trace->map_len, MS_SYNC);
+	}
+
+	munmap(trace->header, trace->map_len);
+	close(trace->fd);
+	pthread_mutex_destroy(&trace->lock);
+	free(trace);
+}
+
+/*
+ * room for a record of size bytes at the head, dropping the oldest
+ * records for it - trace->lock must be held
+ */
+static t_trace_record* trace_reserve(t_trace* trace, uint32_t size) {
+	t_trace_header* header = trace->header;
+	t_trace_record* record;
+	uint64_t position = header->head % header->ring_size;
+	uint64_t rest = header->ring_size - position;
+
+	// doesn't fit before the end of the ring - skip the rest of it
+	if (rest < size) {
+		while (header->head + rest - header->tail > header->ring_size) {
+			header->tail += ((t_trace_record*) (trace->ring + header->tail % header->ring_size))->size;
+		}
+
+		record = (t_trace_record*) (trace->ring + position);
+		record->size = rest;
+		record->type = TRACE_PAD;
+
+		header->head += rest;
+	}
+
+	while (header->head + size - header->tail > header->ring_size) {
+		header->tail += ((t_trace_record*) (trace->ring + header->tail % header->ring_size))->size;
+	}
+
+	record = (t_trace_record*) (trace->ring + header->head % header->ring_size);
+	record->size = size;
+
+	return record;
+}
+
+/*
+ * len bytes of payload - the data written, or read (zeros if the read
+ * failed); records too big for a quarter of the ring are only counted
+ */
+static t_trace_record* trace_begin(t_trace* trace, int type, t_i2c_bus* i2c_bus,
+		int device_address, int device_register, const struct timespec* started,
+		const struct timespec* done, int errnum, uint32_t len) {
+	uint32_t size = TRACE_ALIGN(sizeof(t_trace_record) + len);
+	t_trace_record* record;
+
+	pthread_mutex_lock(&trace->lock);
+
+	if (size > trace->header->ring_size / 4) {
+		trace->header->dropped++;
+		pthread_mutex_unlock(&trace->lock);
+		return NULL;
+	}
+
+	record = trace_reserve(trace, size);
+
+	record->type = type;
+	record->bus = i2c_bus->bus_number;
+	record->address = device_address;
+	record->reg = device_register;
+	record->timestamp = timespec_ns(started);
+	record->duration = elapsed_ns(started, done) > UINT32_MAX ?
+			UINT32_MAX : elapsed_ns(started, done);
+	record->result = errnum;
+	record->len = len;
+	record->reserved = 0;
+
+	return record;
+}
+
+static void trace_end(t_trace* trace, t_trace_record* record) {
+	trace->header->head += record->size;
+	trace->header->records++;
+
+	pthread_mutex_unlock(&trace->lock);
+}
+
+void trace_data(t_trace* trace, int type, t_i2c_bus* i2c_bus, int device_address,
+		int device_register, const struct timespec* started, const struct timespec* done,
+		int result, const __u8* data, int len) {
+	int saved_errno = errno, got;
+	t_trace_record* record;
+
+	if ((record = trace_begin(trace, type, i2c_bus, device_address, device_register,
+			started, done, result < 0 ? saved_errno : 0, len))) {
+		// a read returns how many bytes it got - what it didn't get
+		// is recorded as zeros, like all of a failed one
+		if (type == TRACE_READ && result < len) {
+			got = (result > 0) ? result : 0;
+
+			memcpy(TRACE_PAYLOAD(record), data, got);
+			memset(TRACE_PAYLOAD(record) + got, 0, len - got);
+		} else {
+			memcpy(TRACE_PAYLOAD(record), data, len);
+		}
+
+		trace_end(trace, record);
+	}
+
+	errno = saved_errno;
+}
+
+/*
+ * a combined transfer - the payload is every message as t_trace_msg
+ * followed by its data (what was read for reads)
+ */
+void trace_rdwr(t_trace* trace, t_i2c_bus* i2c_bus, struct i2c_msg* msgs, int nmsgs,
+		const struct timespec* started, const struct timespec* done, int result) {
+	int saved_errno = errno;
+	t_trace_record* record;
+	t_trace_msg msg;
+	unsigned char* payload;
+	uint32_t len = 0;
+	int i;
+
+	for (i = 0; i < nmsgs; i++) {
+		len += sizeof(t_trace_msg) + msgs[i].len;
+	}
+
+	if ((record = trace_begin(trace, TRACE_RDWR, i2c_bus, nmsgs ? msgs[0].addr : 0, nmsgs,
+			started, done, result < 0 ? saved_errno : 0, len))) {
+		payload = TRACE_PAYLOAD(record);
+
+		for (i = 0; i < nmsgs; i++) {
+			msg.addr = msgs[i].addr;
+			msg.flags = msgs[i].flags;
+			msg.len = msgs[i].len;
+
+			memcpy(payload, &msg, sizeof(msg));
+			payload += sizeof(msg);
+
+			if ((msgs[i].flags & I2C_M_RD) && result < 0) {
+				memset(payload, 0, msgs[i].len);
+			} else {
+				memcpy(payload, msgs[i].buf, msgs[i].len);
+			}
+
+			payload += msgs[i].len;
+		}
+
+		trace_end(trace, record);
+	}
+
+	errno = saved_errno;
+}
+
+/*
+ * the record at *offset (starting at header->tail) and *offset moved
+ * past it - NULL at the head; pads are skipped
+ */
+const t_trace_record* next_trace_record(t_trace* trace, uint64_t* offset) {
+	const t_trace_header* header = trace->header;
+	const t_trace_record* record;
+
+	while (*offset < header->head) {
+		record = (const t_trace_record*) (trace->ring + *offset % header->ring_size);
+
+		if (record->size == 0 || (record->size < sizeof(t_trace_record) && record->type != TRACE_PAD)) {
+			return NULL;
+		}
+
+		*offset += record->size;
+
+		if (record->type != TRACE_PAD) {
+			return record;
+		}
+	}
+
+	return NULL;
+}
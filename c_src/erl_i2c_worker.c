@@ -0,0 +1,475 @@
+/*
+ * erl_i2c_worker.c
+ *
+ *  Created on: 09.09.2012
+ *      Author: Christian Adams <morlac78@googlemail.com>
+ *   Copyright: (c) 2012 by Christian Adams
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *   MA 02110-1301 USA.
+ *
+ */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "erl_i2c_cnode.h"
+
+/*
+ * every bus gets a worker thread with its own queue, so a slow
+ * transfer on one bus never holds up requests for another bus
+ * while requests for the same bus are still run in order
+ */
+
+void timespec_add_us(struct timespec* ts, long us) {
+	ts->tv_sec += us / 1000000;
+	ts->tv_nsec += (us % 1000000) * 1000;
+
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+bool timespec_before(const struct timespec* a, const struct timespec* b) {
+	return a->tv_sec < b->tv_sec ||
+			(a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/*
+ * jobs come from the pool of the state and go back there once done -
+ * only an empty pool or a request longer than the data of the pooled
+ * job allocate
+ */
+t_job* new_job(t_cnode_state* state, const erlang_pid* from, const char* ref, int ref_len,
+		const char* term, int term_len) {
+	int len = ref_len + term_len;
+	t_job* job;
+	char* data;
+
+	pthread_mutex_lock(&state->pool_lock);
+
+	if ((job = state->job_pool)) {
+		state->job_pool = job->next;
+		state->pooled_jobs--;
+	}
+
+	pthread_mutex_unlock(&state->pool_lock);
+
+	if (!job) {
+		if (!(job = (t_job*)calloc(1, sizeof(t_job)))) {
+			return NULL;
+		}
+
+		COUNT_ALLOCATION(state);
+	}
+
+	if (job->size < len) {
+		if (!(data = realloc(job->data, len < JOB_MIN_DATA ? JOB_MIN_DATA : len))) {
+			free(job->data);
+			free(job);
+			return NULL;
+		}
+
+		COUNT_ALLOCATION(state);
+
+		job->data = data;
+		job->size = len < JOB_MIN_DATA ? JOB_MIN_DATA : len;
+	}
+
+	job->from = *from;
+	job->ref_len = ref_len;
+	job->len = len;
+	job->command = NULL;
+	job->next = NULL;
+
+	clock_gettime(CLOCK_MONOTONIC, &job->received);
+
+	memcpy(job->data, ref, ref_len);
+	memcpy(job->data + ref_len, term, term_len);
+
+	return job;
+}
+
+void free_job(t_cnode_state* state, t_job* job) {
+	// one big batch shouldn't pin its data for good
+	if (job->size > JOB_POOL_MAX_DATA) {
+		free(job->data);
+		job->data = NULL;
+		job->size = 0;
+	}
+
+	pthread_mutex_lock(&state->pool_lock);
+
+	if (state->pooled_jobs < JOB_POOL_MAX) {
+		job->next = state->job_pool;
+		state->job_pool = job;
+		state->pooled_jobs++;
+		job = NULL;
+	}
+
+	pthread_mutex_unlock(&state->pool_lock);
+
+	if (job) {
+		free(job->data);
+		free(job);
+	}
+}
+
+void free_job_pool(t_cnode_state* state) {
+	t_job* job;
+
+	pthread_mutex_lock(&state->pool_lock);
+
+	while ((job = state->job_pool)) {
+		state->job_pool = job->next;
+		free(job->data);
+		free(job);
+	}
+
+	state->pooled_jobs = 0;
+
+	pthread_mutex_unlock(&state->pool_lock);
+}
+
+/*
+ * buffers of the thread running a request, kept for the next one -
+ * data read from a device until it is encoded into the reply, and
+ * encode buffers for what is built aside the reply
+ */
+static __thread unsigned char* scratch = NULL;
+static __thread size_t scratch_size = 0;
+static __thread ei_x_buff scratch_x[SCRATCH_X_BUFFS];
+static __thread int scratch_x_size[SCRATCH_X_BUFFS];
+
+void* scratch_buffer(t_cnode_state* state, size_t len) {
+	unsigned char* grown;
+
+	if (len > scratch_size) {
+		if (!(grown = realloc(scratch, len))) {
+			return NULL;
+		}
+
+		COUNT_ALLOCATION(state);
+
+		scratch = grown;
+		scratch_size = len;
+	}
+
+	return scratch;
+}
+
+/*
+ * emptied for the next use - ei grows it on its own, that is counted
+ * when it's taken again
+ */
+ei_x_buff* scratch_x_buff(t_cnode_state* state, int which) {
+	ei_x_buff* buf = &scratch_x[which];
+
+	if (!buf->buff) {
+		ei_x_new(buf);
+		COUNT_ALLOCATION(state);
+	} else if (buf->buffsz != scratch_x_size[which]) {
+		COUNT_ALLOCATION(state);
+	}
+
+	scratch_x_size[which] = buf->buffsz;
+	buf->index = 0;
+
+	return buf;
+}
+
+/*
+ * when the thread is done with requests
+ */
+void free_scratch(void) {
+	int i;
+
+	free(scratch);
+	scratch = NULL;
+	scratch_size = 0;
+
+	for (i = 0; i < SCRATCH_X_BUFFS; i++) {
+		if (scratch_x[i].buff) {
+			ei_x_free(&scratch_x[i]);
+			scratch_x[i].buff = NULL;
+		}
+	}
+}
+
+/*
+ * returns -1 if the worker is about to stop and didn't take the job
+ */
+int enqueue_job(t_worker* worker, t_job* job) {
+	t_job_queue* queue = &worker->queue;
+
+	clock_gettime(CLOCK_MONOTONIC, &job->queued);
+
+	pthread_mutex_lock(&queue->lock);
+
+	if (queue->stopping) {
+		pthread_mutex_unlock(&queue->lock);
+		return -1;
+	}
+
+	job->next = NULL;
+
+	if (queue->tail) {
+		queue->tail->next = job;
+	} else {
+		queue->head = job;
+	}
+
+	queue->tail = job;
+
+	pthread_cond_signal(&queue->cond);
+	pthread_mutex_unlock(&queue->lock);
+
+	return 0;
+}
+
+/*
+ * wakes the worker up to recompute what it waits for - after
+ * something with a deadline was handed to it
+ */
+void reschedule_worker(t_worker* worker) {
+	pthread_mutex_lock(&worker->queue.lock);
+	worker->queue.rescheduled = true;
+	pthread_cond_signal(&worker->queue.cond);
+	pthread_mutex_unlock(&worker->queue.lock);
+}
+
+/*
+ * blocks until there is a job, the next subscription is due or held
+ * back writes have to be flushed - NULL on timeout; *stopped is set
+ * once the queue is stopped and empty
+ */
+t_job* dequeue_job(t_worker* worker, bool* stopped) {
+	t_job_queue* queue = &worker->queue;
+	struct timespec due, flush_due;
+	bool polling = next_subscription_due(worker, &due);
+	t_job* job;
+
+	if (worker->bus && next_write_due(worker->bus, &flush_due) &&
+			(!polling || timespec_before(&flush_due, &due))) {
+		due = flush_due;
+		polling = true;
+	}
+
+	pthread_mutex_lock(&queue->lock);
+
+	while (!queue->head && !queue->stopping && !queue->rescheduled) {
+		if (!polling) {
+			pthread_cond_wait(&queue->cond, &queue->lock);
+		} else if (pthread_cond_timedwait(&queue->cond, &queue->lock, &due) == ETIMEDOUT) {
+			break;
+		}
+	}
+
+	queue->rescheduled = false;
+
+	if ((job = queue->head)) {
+		queue->head = job->next;
+
+		if (!queue->head) {
+			queue->tail = NULL;
+		}
+	}
+
+	*stopped = (!job && queue->stopping);
+
+	pthread_mutex_unlock(&queue->lock);
+
+	return job;
+}
+
+/*
+ * writes one {packet, 4} framed packet to stdout - in port mode
+ * everything the workers send goes this way
+ */
+int send_packet(t_cnode_state* state, const char* buf, int len) {
+	unsigned char header[4] = { len >> 24, len >> 16, len >> 8, len };
+	const char* parts[2] = { (const char*) header, buf };
+	int sizes[2] = { sizeof(header), len };
+	int i, offset, written, result = 0;
+
+	pthread_mutex_lock(&state->send_lock);
+
+	for (i = 0; i < 2 && result == 0; i++) {
+		for (offset = 0; offset < sizes[i]; offset += written) {
+			if ((written = write(STDOUT_FILENO, parts[i] + offset, sizes[i] - offset)) < 0) {
+				if (errno == EINTR) {
+					written = 0;
+					continue;
+				}
+
+				result = -1;
+				break;
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&state->send_lock);
+
+	return result;
+}
+
+/*
+ * executes the job and sends {erl_i2c_cnode, Ref, Reply}
+ * (or {erl_i2c_cnode, Reply} for untagged requests) to the caller -
+ * in port mode <<Id:32, Reply/binary>> with Reply in external format
+ */
+void run_job(t_job* job, t_i2c_bus* i2c_bus, ei_x_buff* reply, t_cnode_state* state) {
+	t_stats* stats = (i2c_bus && i2c_bus->stats) ? i2c_bus->stats : state->stats;
+	struct timespec started, sent;
+	int index = job->ref_len, reply_size = reply->buffsz;
+
+	clock_gettime(CLOCK_MONOTONIC, &started);
+
+	stats_phase(stats, job->command, STATS_DECODE, &job->received, &job->queued);
+	stats_phase(stats, job->command, STATS_QUEUE, &job->queued, &started);
+
+	reply->index = 0;
+
+	// the reference (or id) is echoed as is so the frontend can match the reply
+	if (state->port) {
+		ei_x_append_buf(reply, job->data, job->ref_len);
+		ei_x_encode_version(reply);
+	} else {
+		ei_x_encode_version(reply);
+		ei_x_encode_tuple_header(reply, job->ref_len ? 3 : 2);
+		ei_x_encode_atom(reply, "erl_i2c_cnode");
+
+		if (job->ref_len) {
+			ei_x_append_buf(reply, job->data, job->ref_len);
+		}
+	}
+
+	execute_command(job->data, &index, reply, state, i2c_bus);
+
+	clock_gettime(CLOCK_MONOTONIC, &started);
+
+	if (state->port) {
+		send_packet(state, reply->buff, reply->index);
+	} else {
+		send_reply(state, &job->from, reply);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &sent);
+
+	stats_phase(stats, job->command, STATS_SEND, &started, &sent);
+
+	// the reply buffer is reused - it only grows for a longer reply
+	if (reply->buffsz != reply_size) {
+		COUNT_ALLOCATION(state);
+	}
+}
+
+void* worker_main(void* arg) {
+	t_worker* worker = (t_worker*)arg;
+	t_job* job;
+	bool stopped = false;
+
+	while (!stopped) {
+		if (worker->bus) {
+			run_due_writes(worker->bus);
+		}
+
+		run_due_subscriptions(worker);
+
+		if ((job = dequeue_job(worker, &stopped))) {
+			run_job(job, worker->bus, &worker->reply, worker->state);
+			free_job(worker->state, job);
+		}
+	}
+
+	free_scratch();
+
+	return NULL;
+}
+
+/*
+ * the worker of a bus holds a reference to it until it is stopped
+ */
+int start_worker(t_worker* worker, t_i2c_bus* i2c_bus, t_cnode_state* state) {
+	pthread_condattr_t cond_attr;
+
+	memset(worker, 0, sizeof(t_worker));
+
+	worker->bus = i2c_bus;
+	worker->state = state;
+
+	pthread_condattr_init(&cond_attr);
+	pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+
+	pthread_mutex_init(&worker->queue.lock, NULL);
+	pthread_cond_init(&worker->queue.cond, &cond_attr);
+	pthread_mutex_init(&worker->subscription_lock, NULL);
+	ei_x_new(&worker->reply);
+
+	pthread_condattr_destroy(&cond_attr);
+
+	if (i2c_bus) {
+		__atomic_add_fetch(&i2c_bus->refs, 1, __ATOMIC_ACQ_REL);
+	}
+
+	if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+		if (i2c_bus) {
+			__atomic_sub_fetch(&i2c_bus->refs, 1, __ATOMIC_ACQ_REL);
+		}
+
+		worker->queue.stopping = true;
+
+		return -1;
+	}
+
+	worker->running = true;
+
+	return 0;
+}
+
+/*
+ * lets the worker finish all queued jobs and waits for it - the queue
+ * itself stays valid (and refuses new jobs) until destroy_worker()
+ */
+void stop_worker(t_worker* worker) {
+	t_i2c_bus* i2c_bus = worker->bus;
+
+	if (!worker->running) {
+		return;
+	}
+
+	pthread_mutex_lock(&worker->queue.lock);
+	worker->queue.stopping = true;
+	pthread_cond_broadcast(&worker->queue.cond);
+	pthread_mutex_unlock(&worker->queue.lock);
+
+	pthread_join(worker->thread, NULL);
+
+	worker->running = false;
+
+	// may free the bus - and the worker with it
+	release_bus(i2c_bus);
+}
+
+void destroy_worker(t_worker* worker) {
+	free_subscriptions(worker);
+
+	ei_x_free(&worker->reply);
+	pthread_mutex_destroy(&worker->subscription_lock);
+	pthread_cond_destroy(&worker->queue.cond);
+	pthread_mutex_destroy(&worker->queue.lock);
+}
@@ -14,6 +14,10 @@
 
 -define(SERVER, ?MODULE).
 -define(APP, erl_i2c).
+% ETS table of the frontend metrics - see metrics/0
+-define(METRICS, erl_i2c_metrics).
+% log2 buckets of microseconds, the last one takes everything longer
+-define(METRIC_BUCKETS, 32).
 
 -behaviour(gen_server).
 %% --------------------------------------------------------------------
@@ -22,13 +26,23 @@
 
 %% --------------------------------------------------------------------
 %% External exports
--export([spawn_cnode/0, cnode_started/2,
+-export([spawn_cnode/0, spawn_cnode/1, cnode_started/2, cnode_started/3,
 				 open_bus/1, close_bus/1, get_bus/0, set_bus/1,
 				 bus_info/1, bus_info/0, get_state/0,
 				 set_address/2, set_address/1,
 				 get_address/1, get_address/0,
 				 write_byte/4, write_byte/3, write_byte/2, write_byte/1,
 				 read_byte/4, read_byte/3, read_byte/2, read_byte/1,
+				 transfer/2,
+				 scan/1, inventory/1, scan_addresses/1,
+				 register_map/3, invalidate/3, invalidate/2, sync/2,
+				 coalesce/3, flush/2, flush/1,
+				 eeprom/4, eeprom_read/4, eeprom_write/4,
+				 batch/2, batch/1,
+				 subscribe/7, subscribe/6, subscribe/5, unsubscribe/1, subscriptions/0,
+				 fold_samples/4, samples/2,
+				 watch/7, watch/6, watch/5,
+				 stats/1, stats/0, percentile/2, metrics/0, memory/0,
 				 start_link/0, stop_link/0]).
 
 %% gen_server callbacks
@@ -37,8 +51,28 @@
 				 terminate/2, code_change/3]).
 
 -record(state,
-				{cnode_port,
-				 cnode_nodename}).
+				{% the port program in port mode
+				 cnode_port,
+				 % the C-Nodes started so far: Instance => Nodename
+				 cnode_nodenames = #{},
+				 % buses are shared among this many C-Nodes - bus N is served
+				 % by instance N rem instances
+				 instances = 1,
+				 % the bus requests without a bus number go to
+				 current_bus = 0,
+				 % requests sent to the C-Node and not answered yet:
+				 % Ref => {Instance, From, Timing} (Id => {0, From, Timing}
+				 % in port mode) - Timing is {Type, Sent, Forwarded} or undefined
+				 pending = #{},
+				 % {Type, Sent} of the timed request being handled
+				 timing,
+				 % longest message queue seen - for metrics/0
+				 mailbox_len_max = 0,
+				 % id of the next request in port mode
+				 next_id = 1,
+				 % subscribers are monitored, their subscriptions end with
+				 % them: Pid => {Monitor, [Subscription_Id]}
+				 subscribers = #{}}).
 
 %% ====================================================================
 %% External functions
@@ -47,12 +81,17 @@
 start_link() ->
 	error_logger:info_report("~p starting", [?MODULE]),
 
-	gen_server:start_link({local, ?MODULE}, ?MODULE, [], []),
+	Result = gen_server:start_link({local, ?MODULE}, ?MODULE, [], []),
 
-	spawn(
-		?SERVER,
-		spawn_cnode,
-		[]).
+	% the port program is owned by the gen_server, the NIF needs none
+	case backend() of
+		cnode ->
+			[spawn(?SERVER, spawn_cnode, [Instance]) ||
+				Instance <- lists:seq(0, instances() - 1)];
+		_ -> ok
+	end,
+
+	Result.
 
 %% @doc
 %% .
@@ -72,157 +111,514 @@ get_state() ->
 %% .
 %% @end
 open_bus(Bus_Number) ->
-	gen_server:call(
-		?SERVER,
+	call(
 		{open_bus, Bus_Number}).
 
 %% @doc
 %% .
 %% @end
 close_bus(Bus_Number) ->
-	gen_server:call(
-		?SERVER,
+	call(
 		{close_bus, Bus_Number}).
 
 %% @doc
 %% .
 %% @end
 get_bus() ->
-	gen_server:call(
-		?SERVER,
+	call(
 		{get_bus}).
 
 %% @doc
 %% .
 %% @end
 set_bus(Bus_Number) ->
-	gen_server:call(
-		?SERVER,
+	call(
 		{set_bus, Bus_Number}).
 
 %% @doc
 %% .
 %% @end
 bus_info(Bus_Number) ->
-	gen_server:call(
-		?SERVER,
+	call(
 		{bus_info, Bus_Number}).
 
 %% @doc
 %% .
 %% @end
 bus_info() ->
-	gen_server:call(
-		?SERVER,
+	call(
 		{bus_info}).
 
 %% @doc
 %% .
 %% @end
 set_address(Bus_Number, Device_Address) ->
-	gen_server:call(
-		?SERVER,
+	call(
 		{set_address, Bus_Number, Device_Address}).
 
 %% @doc
 %% .
 %% @end
 set_address(Device_Address) ->
-	gen_server:call(
-		?SERVER,
+	call(
 		{set_address, Device_Address}).
 
 %% @doc
 %% .
 %% @end
 get_address(Bus_Number) ->
-	gen_server:call(
-		?SERVER,
+	call(
 		{get_address, Bus_Number}).
 
 %% @doc
 %% .
 %% @end
 get_address() ->
-	gen_server:call(
-		?SERVER,
+	call(
 		{get_address}).
 
 %% @doc
 %% .
 %% @end
 write_byte(Bus_Number, Device_Address, Device_Register, Device_Data) when
-	is_binary(Device_Data) andalso byte_size(Device_Data) =< 32 ->
-	gen_server:call(
-		?SERVER,
+	is_binary(Device_Data) ->
+	call(
 		{write_byte, Bus_Number, Device_Address, Device_Register, Device_Data}).
 
 %% @doc
 %% .
 %% @end
 write_byte(Device_Address, Device_Register, Device_Data) when
-	is_binary(Device_Data) andalso byte_size(Device_Data) =< 32 ->
-	gen_server:call(
-		?SERVER,
+	is_binary(Device_Data) ->
+	call(
 		{write_byte, Device_Address, Device_Register, Device_Data}).
 
 %% @doc
 %% .
 %% @end
 write_byte(Device_Register, Device_Data) when
-	is_binary(Device_Data) andalso byte_size(Device_Data) =< 32 ->
-	gen_server:call(
-		?SERVER,
+	is_binary(Device_Data) ->
+	call(
 		{write_byte, Device_Register, Device_Data}).
 
 %% @doc
 %% .
 %% @end
 write_byte(Device_Data) when
-	is_binary(Device_Data) andalso byte_size(Device_Data) =< 32 ->
-	gen_server:call(
-		?SERVER,
+	is_binary(Device_Data) ->
+	call(
 		{write_byte, Device_Data}).
 
 %% @doc
 %% .
 %% @end
 read_byte(Bus_Number, Device_Address, Device_Register, Data_Length)  ->
-	gen_server:call(
-		?SERVER,
+	call(
 		{read_byte, Bus_Number, Device_Address, Device_Register, Data_Length}).
 
 %% @doc
 %% .
 %% @end
 read_byte(Device_Address, Device_Register, Data_Length) ->
-	gen_server:call(
-		?SERVER,
+	call(
 		{read_byte, Device_Address, Device_Register, Data_Length}).
 
 %% @doc
 %% .
 %% @end
 read_byte(Device_Register, Data_Length) ->
-	gen_server:call(
-		?SERVER,
+	call(
 		{read_byte, Device_Register, Data_Length}).
 
 %% @doc
 %% .
 %% @end
 read_byte(Data_Length) ->
-	gen_server:call(
-		?SERVER,
+	call(
 		{read_byte, Data_Length}).
 
+%% @doc
+%% runs a list of read/write segments as one combined transfer
+%% (repeated start between segments, one stop at the end).
+%% Segments are `{write, Device_Address, Data}' or
+%% `{read, Device_Address, Data_Length}'.
+%% @end
+transfer(Bus_Number, Segments) when
+	is_list(Segments) ->
+	call(
+		{transfer, Bus_Number, Segments}).
+
+%% @doc
+%% probes all 7-bit addresses of a bus and returns `{scan, ok, Bitmap}' with
+%% bit N of the 128 bit Bitmap set if a device answered at address N (see
+%% scan_addresses/1). The bitmap is kept as inventory of the bus.
+%% Given a list of buses they are scanned in parallel and
+%% `[{Bus_Number, Reply}]' is returned.
+%% @end
+scan(Buses) when
+	is_list(Buses) ->
+	Self = self(),
+
+	Refs =
+		[begin
+			 Ref = make_ref(),
+			 spawn_link(fun() -> Self ! {Ref, scan(Bus_Number)} end),
+			 {Bus_Number, Ref}
+		 end || Bus_Number <- Buses],
+
+	[receive {Ref, Reply} -> {Bus_Number, Reply} end || {Bus_Number, Ref} <- Refs];
+
+scan(Bus_Number) ->
+	call(
+		{scan, Bus_Number}).
+
+%% @doc
+%% returns the bitmap of the last scan of a bus as `{inventory, ok, Bitmap}'
+%% without touching the bus.
+%% @end
+inventory(Bus_Number) ->
+	call(
+		{inventory, Bus_Number}).
+
+%% @doc
+%% the addresses set in a scan bitmap.
+%% @end
+scan_addresses(Bitmap) when
+	bit_size(Bitmap) =:= 128 ->
+	[Address ||
+		{Address, 1} <- lists:zip(lists:seq(0, 127), [Bit || <<Bit:1>> <= Bitmap])].
+
+%% @doc
+%% sets how the C-Node shadows registers of a device - Map is a list of
+%% `{Register, Mode}' with Mode `volatile' (default - always read from
+%% the device), `cacheable' (read_byte is served from memory once the
+%% value is known) or `write_only' (never read from the device).
+%% @end
+register_map(Bus_Number, Device_Address, Map) when
+	is_list(Map) ->
+	call(
+		{register_map, Bus_Number, Device_Address, Map}).
+
+%% @doc
+%% forgets the shadowed value of a register.
+%% @end
+invalidate(Bus_Number, Device_Address, Device_Register) ->
+	call(
+		{invalidate, Bus_Number, Device_Address, Device_Register}).
+
+%% @doc
+%% forgets all shadowed registers of a device.
+%% @end
+invalidate(Bus_Number, Device_Address) ->
+	call(
+		{invalidate, Bus_Number, Device_Address}).
+
+%% @doc
+%% reads all cacheable registers of a device into the shadow again.
+%% @end
+sync(Bus_Number, Device_Address) ->
+	call(
+		{sync, Bus_Number, Device_Address}).
+
+%% @doc
+%% holds write_byte to a device back for up to Window microseconds and
+%% merges them into block writes of consecutive registers (a later write
+%% to a register replaces an earlier one). A Window of 0 stops it.
+%% @end
+coalesce(Bus_Number, Device_Address, Window) when
+	is_integer(Window) andalso Window >= 0 ->
+	call(
+		{coalesce, Bus_Number, Device_Address, Window}).
+
+%% @doc
+%% sends the writes held back for a device right away.
+%% @end
+flush(Bus_Number, Device_Address) ->
+	call(
+		{flush, Bus_Number, Device_Address}).
+
+%% @doc
+%% sends the writes held back for all devices of a bus right away.
+%% @end
+flush(Bus_Number) ->
+	call(
+		{flush, Bus_Number}).
+
+%% @doc
+%% makes the device a 24Cxx-type EEPROM with Page_Size bytes per page and
+%% Address_Width (1 or 2) bytes of memory address, for eeprom_read/4 and
+%% eeprom_write/4.
+%% @end
+eeprom(Bus_Number, Device_Address, Page_Size, Address_Width) when
+	Address_Width =:= 1 orelse Address_Width =:= 2 ->
+	call(
+		{eeprom, Bus_Number, Device_Address, Page_Size, Address_Width}).
+
+%% @doc
+%% reads Data_Length bytes from Offset on in sequential reads.
+%% Returns `{eeprom_read, ok, Data}'.
+%% @end
+eeprom_read(Bus_Number, Device_Address, Offset, Data_Length) ->
+	call(
+		{eeprom_read, Bus_Number, Device_Address, Offset, Data_Length},
+		infinity).
+
+%% @doc
+%% writes Data from Offset on - split on page boundaries, each page
+%% waited for by polling the device until it acknowledges again.
+%% Returns `{eeprom_write, ok, Bytes_Written}'.
+%% @end
+eeprom_write(Bus_Number, Device_Address, Offset, Data) when
+	is_binary(Data) ->
+	call(
+		{eeprom_write, Bus_Number, Device_Address, Offset, Data},
+		infinity).
+
+%% @doc
+%% sends a list of commands (e.g. `{open_bus, 0}',
+%% `{write_byte, 0, 32, 1, <<0>>}') to the C-Node in one message.
+%% They are run in order and answered with one list of results.
+%% Mode is `stop_on_error' or `continue'. With several C-Nodes all
+%% commands have to be for buses of the same one, otherwise the batch
+%% is answered with `{batch, error, mixed_instances}'.
+%% @end
+batch(Commands, Mode) when
+	is_list(Commands) andalso
+	(Mode =:= stop_on_error orelse Mode =:= continue) ->
+	call(
+		{batch, Mode, Commands}).
+
+%% @doc
+%% same as batch(Commands, stop_on_error).
+%% @end
+batch(Commands) ->
+	batch(Commands, stop_on_error).
+
+%% @doc
+%% lets the C-Node read Data_Length bytes from Device_Register every
+%% Interval microseconds and send each sample straight to Pid as
+%% `{erl_i2c_sample, Subscription_Id, Timestamp, Data}' with Timestamp
+%% in microseconds (comparable to erlang:system_time(microsecond)).
+%% Returns `{subscribe, ok, Subscription_Id}'.
+%% @end
+subscribe(Bus_Number, Device_Address, Device_Register, Data_Length, Interval, Pid) when
+	is_integer(Interval) andalso is_pid(Pid) ->
+	monitor_subscriber(
+		Pid,
+		call(
+			{subscribe, Bus_Number, Device_Address, Device_Register, Data_Length, Interval, Pid})).
+
+%% @doc
+%% like subscribe/6 but with Options:
+%% `{batch, Count}' - collect Count samples and send them as one packed
+%% binary `{erl_i2c_samples, Subscription_Id, Data_Length, Records}'
+%% (see fold_samples/4),
+%% `{flush_after, Microseconds}' - send the collected samples early once
+%% the first one waited that long.
+%% @end
+subscribe(Bus_Number, Device_Address, Device_Register, Data_Length, Interval, Pid, Options) when
+	is_integer(Interval) andalso is_pid(Pid) andalso is_list(Options) ->
+	monitor_subscriber(
+		Pid,
+		call(
+			{subscribe, Bus_Number, Device_Address, Device_Register, Data_Length, Interval, Pid,
+			 proplists:get_value(batch, Options, 1),
+			 proplists:get_value(flush_after, Options, 0)})).
+
+%% @doc
+%% same as subscribe/6 with the calling process as subscriber.
+%% @end
+subscribe(Bus_Number, Device_Address, Device_Register, Data_Length, Interval) ->
+	subscribe(Bus_Number, Device_Address, Device_Register, Data_Length, Interval, self()).
+
+%% @doc
+%% polls Device_Register like subscribe/6 but only sends
+%% `{erl_i2c_change, Subscription_Id, Timestamp, Data}' to Pid when the
+%% value changed. Options:
+%% `{mask, Mask}' - binary of Data_Length bytes, only the bits set are watched,
+%% `{hysteresis, N}' - only notify if the masked value (read as unsigned
+%% big endian integer, Data_Length up to 8) moved by more than N.
+%% Stopped with unsubscribe/1.
+%% @end
+watch(Bus_Number, Device_Address, Device_Register, Data_Length, Interval, Pid, Options) when
+	is_integer(Interval) andalso is_pid(Pid) andalso is_list(Options) ->
+	monitor_subscriber(
+		Pid,
+		call(
+			{watch, Bus_Number, Device_Address, Device_Register, Data_Length, Interval, Pid,
+			 proplists:get_value(mask, Options, <<>>),
+			 proplists:get_value(hysteresis, Options, 0)})).
+
+%% @doc
+%% same as watch/7 without Options.
+%% @end
+watch(Bus_Number, Device_Address, Device_Register, Data_Length, Interval, Pid) ->
+	watch(Bus_Number, Device_Address, Device_Register, Data_Length, Interval, Pid, []).
+
+%% @doc
+%% same as watch/6 with the calling process as subscriber.
+%% @end
+watch(Bus_Number, Device_Address, Device_Register, Data_Length, Interval) ->
+	watch(Bus_Number, Device_Address, Device_Register, Data_Length, Interval, self(), []).
+
+%% @doc
+%% stops polling for a subscription - subscriptions also end when
+%% their Pid exits.
+%% @end
+unsubscribe(Subscription_Id) ->
+	Reply = call(
+		{unsubscribe, Subscription_Id}),
+
+	gen_server:cast(?SERVER, {unsubscribed, Subscription_Id}),
+
+	Reply.
+
+%% @doc
+%% lists all subscriptions as
+%% `{Subscription_Id, Bus_Number, Device_Address, Device_Register, Data_Length, Interval, Pid,
+%% Batch_Count, Flush_After}' - the batch and flush_after options of
+%% subscribe/7 (1 and 0 if not given).
+%% @end
+subscriptions() ->
+	call(
+		{subscriptions}).
+
+%% @doc
+%% folds over the records of an `{erl_i2c_samples, _, Data_Length, Records}'
+%% message. Fun is called as Fun(Timestamp, Data, Acc) with Data being a
+%% binary or `{error, i2c_error}' for a failed read.
+%% @end
+fold_samples(Fun, Acc, Data_Length, Records) ->
+	case Records of
+		<<Timestamp:64/signed, 0:8, _:Data_Length/binary, Rest/binary>> ->
+			fold_samples(Fun, Fun(Timestamp, {error, i2c_error}, Acc), Data_Length, Rest);
+
+		<<Timestamp:64/signed, Read_Length:8, Padded:Data_Length/binary, Rest/binary>> ->
+			<<Data:Read_Length/binary, _/binary>> = Padded,
+			fold_samples(Fun, Fun(Timestamp, Data, Acc), Data_Length, Rest);
+
+		<<>> ->
+			Acc
+	end.
+
+%% @doc
+%% returns the records of a packed sample message as `[{Timestamp, Data}]'.
+%% @end
+samples(Data_Length, Records) ->
+	lists:reverse(
+		fold_samples(
+			fun(Timestamp, Data, Acc) -> [{Timestamp, Data} | Acc] end,
+			[], Data_Length, Records)).
+
+%% @doc
+%% returns the latency histograms the C-Node keeps per bus and command as
+%% `{stats, ok, [{Bus_Number, [{Command, Phases, Errors}]}]}' - Bus_Number
+%% is none for requests not run for an open bus. Phases holds a histogram
+%% `{Count, Sum, Max, [{Floor, Bucket_Count}]}' (nanoseconds) each for
+%% decode (request received to queued), queue (waiting for the bus
+%% thread), execute (handler with its ioctls), ioctl (the part of
+%% execute in bus transfers), encode (the rest of execute) and send
+%% (reply sent);
+%% Errors is `[{Errno, Count}]' with Errno 0 for errors without one.
+%% Options: `{bus, Bus_Number}' for just that bus, reset to clear each
+%% counter as it is read (nothing counted meanwhile is lost).
+%% @end
+stats(Options) when is_list(Options) ->
+	Reset = proplists:get_bool(reset, Options),
+
+	case proplists:get_value(bus, Options) of
+		undefined ->
+			call(
+				{stats, Reset});
+
+		Bus_Number ->
+			call(
+				{stats, Reset, Bus_Number})
+	end.
+
+%% @doc
+%% same as stats/1 without Options.
+%% @end
+stats() ->
+	stats([]).
+
+%% @doc
+%% returns `{memory, ok, [{Instance, [{allocations, N}, {pooled_jobs, N}]}]}'
+%% per C-Node - allocations counts the heap allocations on its request
+%% path since it started, which stops growing once its job pool and
+%% buffers are warm; pooled_jobs is the number of jobs kept for reuse.
+%% @end
+memory() ->
+	call(
+		{memory}).
+
+%% @doc
+%% returns the floor of the bucket the Pth percentile (0..100) of a
+%% stats histogram falls into - at most 25% below the real value.
+%% @end
+percentile({0, _Sum, _Max, _Buckets}, _P) ->
+	undefined;
+
+percentile({Count, _Sum, Max, Buckets}, P) when P >= 0 andalso P =< 100 ->
+	percentile(Buckets, max(1, ceil(Count * P / 100)), Max).
+
+percentile([{Floor, Bucket_Count} | Buckets], Rank, Max) ->
+	case Rank =< Bucket_Count of
+		true -> min(Floor, Max);
+		false -> percentile(Buckets, Rank - Bucket_Count, Max)
+	end;
+
+percentile([], _Rank, Max) ->
+	Max.
+
+%% @doc
+%% returns what the frontend measured - read from ETS, so it works
+%% even while the gen_server is swamped:
+%% `#{frontend => #{mailbox_len, mailbox_len_max, in_flight},
+%%   requests => #{Type => #{Phase => #{count, sum, buckets}}}}'
+%% with Type the command, Phase one of queue (waiting in the mailbox
+%% of the gen_server), wait (sent to the C-Node until its reply came
+%% in) and total (end to end) and times in microseconds; buckets is
+%% `[{Floor, Count}]' with log2 sized buckets. With the NIF only total
+%% is recorded.
+%% @end
+metrics() ->
+	lists:foldl(
+		fun({frontend, Mailbox_Len, Mailbox_Len_Max, In_Flight}, Acc) ->
+				Acc#{frontend =>
+							 #{mailbox_len => Mailbox_Len,
+								 mailbox_len_max => Mailbox_Len_Max,
+								 in_flight => In_Flight}};
+
+			 (Metric, #{requests := Requests} = Acc) ->
+				[{Type, Phase}, Count, Sum | Counts] = tuple_to_list(Metric),
+				Buckets =
+					[{bucket_floor(Bucket), N} ||
+						{Bucket, N} <- lists:zip(lists:seq(0, ?METRIC_BUCKETS - 1), Counts),
+						N > 0],
+				Phases = maps:get(Type, Requests, #{}),
+
+				Acc#{requests :=
+							 Requests#{Type =>
+													 Phases#{Phase =>
+																		 #{count => Count, sum => Sum, buckets => Buckets}}}}
+		end,
+		#{frontend => #{}, requests => #{}},
+		ets:tab2list(?METRICS)).
+
 %% @doc
 %% .
 %% @end
 cnode_started(Erlang_Port, NodeName) ->
+	cnode_started(0, Erlang_Port, NodeName).
+
+%% @doc
+%% tells the gen_server C-Node Instance is up as NodeName.
+%% @end
+cnode_started(Instance, Erlang_Port, NodeName) ->
 	gen_server:cast(
 		?SERVER,
-		{cnode_started, Erlang_Port, NodeName}).
+		{cnode_started, Instance, Erlang_Port, NodeName}).
 
 %% ====================================================================
 %% Server functions
@@ -240,7 +636,18 @@ init([]) ->
 	%% to make this gen_server monitorable by a supervisor
 %%	process_flag(trap_exit, true),
 
-	{ok, #state{}}.
+	% written by callers too (NIF backend) - read by metrics/0 without
+	% asking the gen_server
+	ets:new(?METRICS, [named_table, public, set, {write_concurrency, true}]),
+	ets:insert(?METRICS, {frontend, 0, 0, 0}),
+
+	schedule_metrics_report(),
+
+	case backend() of
+		port -> {ok, #state{cnode_port = spawn_port()}};
+		cnode -> {ok, #state{instances = instances()}};
+		nif -> {ok, #state{}}
+	end.
 
 %% --------------------------------------------------------------------
 %% Function: handle_call/3
@@ -256,182 +663,263 @@ init([]) ->
 %% @doc
 %% .
 %% @end
-handle_call({open_bus, Bus_Number}, _From, State) ->
-	send_cnode(State#state.cnode_nodename, {open_bus, Bus_Number}),
+handle_call({open_bus, Bus_Number}, From, State) ->
+	{noreply, call_cnode({open_bus, Bus_Number}, From, State)};
 
-	Reply = receive_cnode_response(),
+%% @doc
+%% .
+%% @end
+handle_call({close_bus, Bus_Number}, From, State) ->
+	{noreply, call_cnode({close_bus, Bus_Number}, From, State)};
 
-	{reply, Reply, State};
+%% @doc
+%% .
+%% @end
+handle_call({get_bus}, From, State) ->
+	{noreply, call_cnode({get_bus}, From, State)};
 
 %% @doc
 %% .
 %% @end
-handle_call({close_bus, Bus_Number}, _From, State) ->
-	send_cnode(
-		State#state.cnode_nodename,
-		{close_bus, Bus_Number}),
+handle_call({set_bus, Bus_Number}, From, State) ->
+	{noreply, call_cnode({set_bus, Bus_Number}, From, State)};
 
-	{reply, receive_cnode_response(), State};
+%% @doc
+%% .
+%% @end
+handle_call({bus_info, Bus_Number}, From, State) ->
+	{noreply, call_cnode({bus_info, Bus_Number}, From, State)};
 
 %% @doc
 %% .
 %% @end
-handle_call({get_bus}, _From, State) ->
-	send_cnode(
-		State#state.cnode_nodename,
-		{get_bus}),
+handle_call({bus_info}, From, State) ->
+	{noreply, call_cnode({bus_info}, From, State)};
 
-	{reply, receive_cnode_response(), State};
+%% @doc
+%% .
+%% @end
+handle_call({set_address, Bus_Number, Device_Address}, From, State) ->
+	{noreply, call_cnode({set_address, Bus_Number, Device_Address}, From, State)};
 
 %% @doc
 %% .
 %% @end
-handle_call({set_bus, Bus_Number}, _From, State) ->
-	send_cnode(
-		State#state.cnode_nodename,
-		{set_bus, Bus_Number}),
+handle_call({set_address, Device_Address}, From, State) ->
+	{noreply, call_cnode({set_address, Device_Address}, From, State)};
 
-	{reply, receive_cnode_response(), State};
+%% @doc
+%% .
+%% @end
+handle_call({get_address, Bus_Number}, From, State) ->
+	{noreply, call_cnode({get_address, Bus_Number}, From, State)};
 
 %% @doc
 %% .
 %% @end
-handle_call({bus_info, Bus_Number}, _From, State) ->
-	send_cnode(
-		State#state.cnode_nodename,
-		{bus_info, Bus_Number}),
+handle_call({get_address}, From, State) ->
+	{noreply, call_cnode({get_address}, From, State)};
 
-	{reply, receive_cnode_response(), State};
+%% @doc
+%% .
+%% @end
+handle_call({write_byte, Bus_Number, Device_Address, Device_Register, Device_Data}, From, State) ->
+	{noreply, call_cnode({write_byte, Bus_Number, Device_Address, Device_Register, Device_Data}, From, State)};
 
 %% @doc
 %% .
 %% @end
-handle_call({bus_info}, _From, State) ->
-	send_cnode(
-		State#state.cnode_nodename,
-		{bus_info}),
+handle_call({write_byte, Device_Address, Device_Register, Device_Data}, From, State) ->
+	{noreply, call_cnode({write_byte, Device_Address, Device_Register, Device_Data}, From, State)};
 
-	{reply, receive_cnode_response(), State};
+%% @doc
+%% .
+%% @end
+handle_call({write_byte, Device_Register, Device_Data}, From, State) ->
+	{noreply, call_cnode({write_byte, Device_Register, Device_Data}, From, State)};
 
 %% @doc
 %% .
 %% @end
-handle_call({set_address, Bus_Number, Device_Address}, _From, State) ->
-	send_cnode(
-		State#state.cnode_nodename,
-		{set_address, Bus_Number, Device_Address}),
+handle_call({write_byte, Device_Data}, From, State) ->
+	{noreply, call_cnode({write_byte, Device_Data}, From, State)};
 
-	{reply, receive_cnode_response(), State};
+%% @doc
+%% .
+%% @end
+handle_call({read_byte, Bus_Number, Device_Address, Device_Register, Data_Length}, From, State) ->
+	{noreply, call_cnode({read_byte, Bus_Number, Device_Address, Device_Register, Data_Length}, From, State)};
 
 %% @doc
 %% .
 %% @end
-handle_call({set_address, Device_Address}, _From, State) ->
-	send_cnode(
-		State#state.cnode_nodename,
-		{set_address, Device_Address}),
+handle_call({read_byte, Device_Address, Device_Register, Data_Length}, From, State) ->
+	{noreply, call_cnode({read_byte, Device_Address, Device_Register, Data_Length}, From, State)};
 
-	{reply, receive_cnode_response(), State};
+%% @doc
+%% .
+%% @end
+handle_call({read_byte, Device_Register, Data_Length}, From, State) ->
+	{noreply, call_cnode({read_byte, Device_Register, Data_Length}, From, State)};
 
 %% @doc
 %% .
 %% @end
-handle_call({get_address, Bus_Number}, _From, State) ->
-	send_cnode(
-		State#state.cnode_nodename,
-		{get_address, Bus_Number}),
+handle_call({read_byte, Data_Length}, From, State) ->
+	{noreply, call_cnode({read_byte, Data_Length}, From, State)};
 
-	{reply, receive_cnode_response(), State};
+%% @doc
+%% .
+%% @end
+handle_call({transfer, Bus_Number, Segments}, From, State) ->
+	{noreply, call_cnode({transfer, Bus_Number, Segments}, From, State)};
 
 %% @doc
 %% .
 %% @end
-handle_call({get_address}, _From, State) ->
-	send_cnode(
-		State#state.cnode_nodename,
-		{get_address}),
+handle_call({scan, Bus_Number}, From, State) ->
+	{noreply, call_cnode({scan, Bus_Number}, From, State)};
 
-	{reply, receive_cnode_response(), State};
+%% @doc
+%% .
+%% @end
+handle_call({inventory, Bus_Number}, From, State) ->
+	{noreply, call_cnode({inventory, Bus_Number}, From, State)};
 
 %% @doc
 %% .
 %% @end
-handle_call({write_byte, Bus_Number, Device_Address, Device_Register, Device_Data}, _From, State) ->
-	send_cnode(
-		State#state.cnode_nodename,
-		{write_byte, Bus_Number, Device_Address, Device_Register, Device_Data}),
+handle_call({register_map, Bus_Number, Device_Address, Map}, From, State) ->
+	{noreply, call_cnode({register_map, Bus_Number, Device_Address, Map}, From, State)};
 
-	{reply, receive_cnode_response(), State};
+%% @doc
+%% .
+%% @end
+handle_call({invalidate, Bus_Number, Device_Address, Device_Register}, From, State) ->
+	{noreply, call_cnode({invalidate, Bus_Number, Device_Address, Device_Register}, From, State)};
 
 %% @doc
 %% .
 %% @end
-handle_call({write_byte, Device_Address, Device_Register, Device_Data}, _From, State) ->
-	send_cnode(
-		State#state.cnode_nodename,
-		{write_byte, Device_Address, Device_Register, Device_Data}),
+handle_call({invalidate, Bus_Number, Device_Address}, From, State) ->
+	{noreply, call_cnode({invalidate, Bus_Number, Device_Address}, From, State)};
 
-	{reply, receive_cnode_response(), State};
+%% @doc
+%% .
+%% @end
+handle_call({sync, Bus_Number, Device_Address}, From, State) ->
+	{noreply, call_cnode({sync, Bus_Number, Device_Address}, From, State)};
 
 %% @doc
 %% .
 %% @end
-handle_call({write_byte, Device_Register, Device_Data}, _From, State) ->
-	send_cnode(
-		State#state.cnode_nodename,
-		{write_byte, Device_Register, Device_Data}),
+handle_call({eeprom, Bus_Number, Device_Address, Page_Size, Address_Width}, From, State) ->
+	{noreply, call_cnode({eeprom, Bus_Number, Device_Address, Page_Size, Address_Width}, From, State)};
 
-	{reply, receive_cnode_response(), State};
+%% @doc
+%% .
+%% @end
+handle_call({eeprom_read, Bus_Number, Device_Address, Offset, Data_Length}, From, State) ->
+	{noreply, call_cnode({eeprom_read, Bus_Number, Device_Address, Offset, Data_Length}, From, State)};
+
+%% @doc
+%% .
+%% @end
+handle_call({eeprom_write, Bus_Number, Device_Address, Offset, Data}, From, State) ->
+	{noreply, call_cnode({eeprom_write, Bus_Number, Device_Address, Offset, Data}, From, State)};
+
+%% @doc
+%% .
+%% @end
+handle_call({coalesce, Bus_Number, Device_Address, Window}, From, State) ->
+	{noreply, call_cnode({coalesce, Bus_Number, Device_Address, Window}, From, State)};
+
+%% @doc
+%% .
+%% @end
+handle_call({flush, Bus_Number, Device_Address}, From, State) ->
+	{noreply, call_cnode({flush, Bus_Number, Device_Address}, From, State)};
+
+%% @doc
+%% .
+%% @end
+handle_call({flush, Bus_Number}, From, State) ->
+	{noreply, call_cnode({flush, Bus_Number}, From, State)};
 
 %% @doc
 %% .
 %% @end
-handle_call({write_byte, Device_Data}, _From, State) ->
-	send_cnode(
-		State#state.cnode_nodename,
-		{write_byte, Device_Data}),
+handle_call({batch, Mode, Commands}, From, State) ->
+	{noreply, call_cnode({batch, Mode, Commands}, From, State)};
 
-	{reply, receive_cnode_response(), State};
+%% @doc
+%% .
+%% @end
+handle_call({subscribe, Bus_Number, Device_Address, Device_Register, Data_Length, Interval, Pid}, From, State) ->
+	{noreply, call_cnode({subscribe, Bus_Number, Device_Address, Device_Register, Data_Length, Interval, Pid}, From, State)};
 
 %% @doc
 %% .
 %% @end
-handle_call({read_byte, Bus_Number, Device_Address, Device_Register}, _From, State) ->
-	send_cnode(
-		State#state.cnode_nodename,
-		{read_byte, Bus_Number, Device_Address, Device_Register}),
+handle_call({subscribe, Bus_Number, Device_Address, Device_Register, Data_Length, Interval, Pid,
+						 Batch_Count, Flush_After}, From, State) ->
+	{noreply, call_cnode({subscribe, Bus_Number, Device_Address, Device_Register, Data_Length, Interval, Pid,
+												Batch_Count, Flush_After}, From, State)};
 
-	{reply, receive_cnode_response(), State};
+%% @doc
+%% .
+%% @end
+handle_call({watch, Bus_Number, Device_Address, Device_Register, Data_Length, Interval, Pid,
+						 Mask, Hysteresis}, From, State) ->
+	{noreply, call_cnode({watch, Bus_Number, Device_Address, Device_Register, Data_Length, Interval, Pid,
+												Mask, Hysteresis}, From, State)};
 
 %% @doc
 %% .
 %% @end
-handle_call({read_byte, Device_Address, Device_Register}, _From, State) ->
-	send_cnode(
-		State#state.cnode_nodename,
-		{read_byte, Device_Address, Device_Register}),
+handle_call({unsubscribe, Subscription_Id}, From, State) ->
+	{noreply, call_cnode({unsubscribe, Subscription_Id}, From, State)};
 
-	{reply, receive_cnode_response(), State};
+%% @doc
+%% .
+%% @end
+handle_call({subscriptions}, From, State) ->
+	{noreply, call_cnode({subscriptions}, From, State)};
 
 %% @doc
 %% .
 %% @end
-handle_call({read_byte, Device_Register}, _From, State) ->
-	send_cnode(
-		State#state.cnode_nodename,
-		{read_byte, Device_Register}),
+handle_call({stats, Reset}, From, State) ->
+	{noreply, call_cnode({stats, Reset}, From, State)};
 
-	{reply, receive_cnode_response(), State};
+%% @doc
+%% .
+%% @end
+handle_call({stats, Reset, Bus_Number}, From, State) ->
+	{noreply, call_cnode({stats, Reset, Bus_Number}, From, State)};
 
 %% @doc
 %% .
 %% @end
-handle_call({read_byte}, _From, State) ->
-	send_cnode(
-		State#state.cnode_nodename,
-		{read_byte}),
+handle_call({memory}, From, State) ->
+	{noreply, call_cnode({memory}, From, State)};
 
-	{reply, receive_cnode_response(), State};
+%% @doc
+%% a request from call/2 - the time it spent in the mailbox is recorded
+%% here, the rest once the C-Node answered it.
+%% @end
+handle_call({timed, Sent, Request}, From, State) ->
+	Type = element(1, Request),
+	record_metric(Type, queue, erlang:monotonic_time(microsecond) - Sent),
+
+	case handle_call(Request, From, State#state{timing = {Type, Sent}}) of
+		{noreply, State_1} ->
+			{noreply, update_frontend_metrics(State_1#state{timing = undefined})};
+
+		{reply, Reply, State_1} ->
+			record_metric(Type, total, erlang:monotonic_time(microsecond) - Sent),
+			{reply, Reply, update_frontend_metrics(State_1#state{timing = undefined})}
+	end;
 
 %% @doc
 %% .
@@ -467,10 +955,46 @@ handle_cast(stop, State) ->
 %% @doc
 %% .
 %% @end
-handle_cast({cnode_started, Erlang_Port, Nodename}, State) ->
+handle_cast({cnode_started, Instance, _Erlang_Port, Nodename}, State) ->
+	% to answer pending requests if the C-Node goes away
+	erlang:monitor_node(Nodename, true),
+
 	{noreply,
-	 State#state{cnode_nodename = Nodename,
-							 cnode_port = Erlang_Port}};
+	 State#state{cnode_nodenames =
+								 maps:put(Instance, Nodename, State#state.cnode_nodenames)}};
+
+%% @doc
+%% a subscription was made for Pid - ended once Pid exits.
+%% @end
+handle_cast({subscribed, Pid, Subscription_Id}, State) ->
+	Subscribers = State#state.subscribers,
+
+	Subscriber =
+		case maps:find(Pid, Subscribers) of
+			{ok, {Monitor, Ids}} -> {Monitor, [Subscription_Id | Ids]};
+			error -> {erlang:monitor(process, Pid), [Subscription_Id]}
+		end,
+
+	{noreply, State#state{subscribers = maps:put(Pid, Subscriber, Subscribers)}};
+
+%% @doc
+%% .
+%% @end
+handle_cast({unsubscribed, Subscription_Id}, State) ->
+	Subscribers =
+		maps:fold(
+			fun(Pid, {Monitor, Ids}, Acc) ->
+					case lists:delete(Subscription_Id, Ids) of
+						[] ->
+							erlang:demonitor(Monitor, [flush]),
+							Acc;
+						Ids_1 ->
+							maps:put(Pid, {Monitor, Ids_1}, Acc)
+					end
+			end,
+			#{}, State#state.subscribers),
+
+	{noreply, State#state{subscribers = Subscribers}};
 
 %% @doc
 %% .
@@ -487,8 +1011,86 @@ handle_cast(Msg, State) ->
 %%          {noreply, State, Timeout} |
 %%          {stop, Reason, State}            (terminate/2 is called)
 %% --------------------------------------------------------------------
-handle_info(_Info, State) ->
-    {noreply, State}.
+handle_info({erl_i2c_cnode, Ref, Reply}, State) when
+	is_reference(Ref) ->
+	{noreply, reply_pending(Ref, Reply, State)};
+
+%% @doc
+%% port mode - a message for another process (a sample of a subscription).
+%% @end
+handle_info({Port, {data, <<0:32, Forward/binary>>}}, #state{cnode_port = Port} = State) ->
+	{To, Message} = binary_to_term(Forward),
+	To ! Message,
+
+	{noreply, State};
+
+%% @doc
+%% port mode - the reply to request Id.
+%% @end
+handle_info({Port, {data, <<Id:32, Reply/binary>>}}, #state{cnode_port = Port} = State) ->
+	{noreply, reply_pending(Id, binary_to_term(Reply), State)};
+
+%% @doc
+%% port program is gone - none of the pending requests will be answered.
+%% @end
+handle_info({Port, {exit_status, Status}}, #state{cnode_port = Port} = State) ->
+	error_logger:error_msg(
+		"~p: port program exited with ~p~n", [?SERVER, Status]),
+
+	{noreply, fail_pending(0, State#state{cnode_port = undefined})};
+
+%% @doc
+%% C-Node is gone - none of the pending requests will be answered.
+%% @end
+handle_info({nodedown, Nodename}, State) ->
+	error_logger:error_msg(
+		"~p: C-Node ~p is down~n", [?SERVER, Nodename]),
+
+	% only the requests of that C-Node are lost - the others go on
+	Down = [Instance ||
+		{Instance, Name} <- maps:to_list(State#state.cnode_nodenames), Name =:= Nodename],
+
+	{noreply,
+	 lists:foldl(
+		 fun(Instance, State_1) ->
+				 fail_pending(
+					 Instance,
+					 State_1#state{cnode_nodenames =
+													 maps:remove(Instance, State_1#state.cnode_nodenames)})
+		 end,
+		 State, Down)};
+
+%% @doc
+%% a subscriber exited - nobody takes its samples any more.
+%% @end
+handle_info({'DOWN', _Monitor, process, Pid, _Reason}, State) ->
+	case maps:take(Pid, State#state.subscribers) of
+		{{_Monitor_1, Ids}, Subscribers} ->
+			% through call/1 like any other request - not from the gen_server
+			% itself, which has to answer it
+			spawn(fun() -> [call({unsubscribe, Id}) || Id <- Ids] end),
+
+			{noreply, State#state{subscribers = Subscribers}};
+
+		error ->
+			{noreply, State}
+	end;
+
+%% @doc
+%% periodic report of metrics/0.
+%% @end
+handle_info(report_metrics, State) ->
+	error_logger:info_report([{?SERVER, metrics}, metrics()]),
+
+	schedule_metrics_report(),
+
+	{noreply, State};
+
+handle_info(Info, State) ->
+	error_logger:warning_msg(
+		"handle_info got unknown message:~n~p~n", [Info]),
+
+	{noreply, State}.
 
 %% --------------------------------------------------------------------
 %% Function: terminate/2
@@ -499,8 +1101,15 @@ terminate(Reason, State) ->
 	error_logger:info_msg(
 		"~p terminating~nReason: ~p~n", [?SERVER, Reason]),
 	
-	send_cnode(State#state.cnode_nodename, {exit}),
-		
+	case backend() of
+		cnode ->
+			[send_cnode(Nodename, make_ref(), {exit}) ||
+				Nodename <- maps:values(State#state.cnode_nodenames)];
+		% closing stdin ends the port program
+		port -> catch port_close(State#state.cnode_port);
+		nif -> ok
+	end,
+
 	ok.
 
 %% --------------------------------------------------------------------
@@ -520,12 +1129,22 @@ code_change(_OldVsn, State, _Extra) ->
 %% .
 %% @end
 spawn_cnode() ->
+	spawn_cnode(0).
+
+-spec spawn_cnode(Instance::non_neg_integer()) -> ok.
+%% @doc
+%% starts C-Node Instance (of instances()) - it listens on a port of
+%% its own and registers as c<Instance> with epmd.
+%% @end
+spawn_cnode(Instance) ->
 	Erlang_Port =
 		open_port(
 			{spawn_executable,
 			 filename:join(
 				 [code:priv_dir(?APP),"cbin", "erl_i2c_cnode"])},
-			[{args, [erlang:get_cookie()]},
+			[{args, simulate_args() ++ trace_args(Instance) ++
+							[erlang:get_cookie(),
+							 integer_to_list(Instance), integer_to_list(instances())]},
 			 stream,
 			 use_stdio,
 			 stderr_to_stdout,
@@ -533,24 +1152,43 @@ spawn_cnode() ->
 			 exit_status
 			]),
 
-	receive_spawned_cnode(Erlang_Port).
+	receive_spawned_cnode(Instance, Erlang_Port).
+
+-spec spawn_port() -> port().
+%% @doc
+%% starts erl_i2c_cnode as a port program - requests and replies are
+%% exchanged {packet, 4} framed over its stdin and stdout, no epmd and
+%% no distribution involved.
+%% @end
+spawn_port() ->
+	open_port(
+		{spawn_executable,
+		 filename:join(
+			 [code:priv_dir(?APP),"cbin", "erl_i2c_cnode"])},
+		[{args, ["--port" | simulate_args() ++ trace_args(0)]},
+		 {packet, 4},
+		 binary,
+		 use_stdio,
+		 exit_status
+		]).
 
 -spec receive_spawned_cnode(
+				Instance::non_neg_integer(),
 				Erlang_Port::port()) -> ok.
 %% @doc
 %% .
 %% @end
-receive_spawned_cnode(Erlang_Port) ->
+receive_spawned_cnode(Instance, Erlang_Port) ->
 	receive
 		{Erlang_Port, {data, {eol, "this.nodename: " ++ NodeName}}} ->
-			cnode_started(Erlang_Port, list_to_atom(NodeName)),
+			cnode_started(Instance, Erlang_Port, list_to_atom(NodeName)),
 
-			receive_spawned_cnode(Erlang_Port);
+			receive_spawned_cnode(Instance, Erlang_Port);
 
 		{Erlang_Port, {data, {eol, Line}}} ->
 			error_logger:info_msg("Line: ~p~n", [Line]),
 
-			receive_spawned_cnode(Erlang_Port);
+			receive_spawned_cnode(Instance, Erlang_Port);
 
 		{Erlang_Port, {exit_status, Status}} ->
 			case Status of
@@ -564,36 +1202,468 @@ receive_spawned_cnode(Erlang_Port) ->
 			error_logger:info_msg(
 				"receive_cnode~ngot Message from erl_i2c_cnode:~n~p~n", [Msg]),
 
-			receive_spawned_cnode(Erlang_Port);
+			receive_spawned_cnode(Instance, Erlang_Port);
 
 		Message ->
 			error_logger:info_msg(
 				"unknown message: ~p~n", [Message]),
-			receive_spawned_cnode(Erlang_Port)
+			receive_spawned_cnode(Instance, Erlang_Port)
 	end.
 
--spec receive_cnode_response() ->
-				any().
+-spec backend() -> cnode | port | nif.
+%% @doc
+%% the backend selected with the application environment -
+%% `{backend, cnode}' (the default) runs the commands in the
+%% erl_i2c_cnode program connected as a C-Node, `{backend, port}' in
+%% the same program run as a port, `{backend, nif}' in erl_i2c_nif.
+%% @end
+backend() ->
+	application:get_env(?APP, backend, cnode).
+
+-spec simulate_args() -> [string()].
+%% @doc
+%% the options of erl_i2c_cnode for `{simulate, Options}' in the
+%% application environment - simulated buses instead of /dev/i2c-N,
+%% with Options `{clock, Hz}', `{devices, [Address]}', `{nak, PPM}' and
+%% `{nak, Address, PPM}' (or `true' for the defaults). Not for the NIF.
+%% @end
+simulate_args() ->
+	case application:get_env(?APP, simulate, false) of
+		false ->
+			[];
+		true ->
+			["--simulate"];
+		Options when is_list(Options) ->
+			["--simulate" | lists:append([simulate_arg(Option) || Option <- Options])]
+	end.
+
+simulate_arg({clock, Hz}) ->
+	["--sim-clock", integer_to_list(Hz)];
+
+simulate_arg({devices, Addresses}) ->
+	["--sim-devices", string:join([integer_to_list(Address) || Address <- Addresses], ",")];
+
+simulate_arg({nak, PPM}) ->
+	["--sim-nak", integer_to_list(PPM)];
+
+simulate_arg({nak, Address, PPM}) ->
+	["--sim-nak", integer_to_list(Address) ++ ":" ++ integer_to_list(PPM)].
+
+-spec trace_args(Instance::non_neg_integer()) -> [string()].
+%% @doc
+%% the options of erl_i2c_cnode for `{trace, File}' or
+%% `{trace, {File, Megabytes}}' in the application environment - every
+%% transaction is appended to the ring file File (64MB by default) to
+%% be replayed with erl_i2c_replay. With several instances each one
+%% writes File.Instance. Not for the NIF.
+%% @end
+trace_args(Instance) ->
+	case application:get_env(?APP, trace, false) of
+		false ->
+			[];
+		{File, Megabytes} ->
+			["--trace", trace_file(File, Instance), "--trace-size", integer_to_list(Megabytes)];
+		File ->
+			["--trace", trace_file(File, Instance)]
+	end.
+
+trace_file(File, Instance) ->
+	case instances() of
+		1 -> File;
+		_ -> File ++ "." ++ integer_to_list(Instance)
+	end.
+
+-spec instances() -> pos_integer().
+%% @doc
+%% how many C-Nodes share the buses - `{instances, N}' in the
+%% application environment, 1 by default.
+%% @end
+instances() ->
+	application:get_env(?APP, instances, 1).
+
+-spec call(Request::tuple()) -> term().
+%% @doc
+%% runs Request with the configured backend - through this gen_server
+%% and the C-Node, or with the NIF right in the calling process
+%% (on a dirty I/O scheduler).
+%% @end
+call(Request) ->
+	call(Request, 5000).
+
+-spec call(Request::tuple(), Timeout::timeout()) -> term().
 %% @doc
 %% .
 %% @end
-receive_cnode_response() ->
-	receive
-		{erl_i2c_cnode, Message} ->
-			Message;
-		Message ->
-			error_logger:warning_msg("unknown format in answer:~n~p~n", [Message]),
-			{error}
+call(Request, Timeout) ->
+	Sent = erlang:monotonic_time(microsecond),
+
+	case backend() of
+		nif ->
+			Reply = erl_i2c_nif:call(Request),
+			record_metric(element(1, Request), total, erlang:monotonic_time(microsecond) - Sent),
+			Reply;
+		_ ->
+			gen_server:call(?SERVER, {timed, Sent, Request}, Timeout)
+	end.
+
+-spec monitor_subscriber(Pid::pid(), Reply::term()) -> term().
+%% @doc
+%% passes on the Reply of subscribe or watch - a subscription made has
+%% its subscriber monitored by the gen_server.
+%% @end
+monitor_subscriber(Pid, {_Command, ok, Subscription_Id} = Reply) ->
+	gen_server:cast(?SERVER, {subscribed, Pid, Subscription_Id}),
+
+	Reply;
+
+monitor_subscriber(_Pid, Reply) ->
+	Reply.
+
+-spec call_cnode(
+				Message::term(),
+				From::{pid(), term()},
+				State::#state{}) ->
+				#state{}.
+%% @doc
+%% sends Message to the C-Node tagged with a fresh reference and
+%% remembers the caller - the reply is picked up in handle_info/2,
+%% so further requests can be sent in the meantime.
+%% @end
+call_cnode(Message, From, #state{cnode_port = Port, next_id = Id} = State) when
+	is_port(Port) ->
+	% port mode - ids count up, 0 is reserved for forwarded messages
+	port_command(Port, [<<Id:32>>, term_to_binary(Message)]),
+
+	State#state{pending = maps:put(Id, {0, From, forwarded(State)}, State#state.pending),
+							next_id = Id rem 16#ffffffff + 1};
+
+call_cnode(Message, From, #state{instances = Instances} = State) when
+	Instances > 1 andalso
+	(Message =:= {subscriptions} orelse Message =:= {memory} orelse
+	 element(1, Message) =:= stats andalso tuple_size(Message) =:= 2) ->
+	% every C-Node only knows the subscriptions and stats of its own buses
+	% and its own allocations
+	Nodenames = maps:values(State#state.cnode_nodenames),
+
+	spawn(fun() -> gen_server:reply(From, gather_cnodes(Nodenames, Message)) end),
+
+	State;
+
+call_cnode(Message, From, State) ->
+	Instance = instance(Message, State),
+
+	case maps:find(Instance, State#state.cnode_nodenames) of
+		_ when Instance =:= mixed ->
+			reply_now(From, {batch, error, mixed_instances}, State);
+
+		{ok, Nodename} ->
+			Ref = make_ref(),
+
+			send_cnode(Nodename, Ref, Message),
+
+			State#state{pending = maps:put(Ref, {Instance, From, forwarded(State)}, State#state.pending),
+									current_bus = selected_bus(Message, State#state.current_bus)};
+
+		error ->
+			% not started yet, gone or the port program exited - nothing
+			% would ever answer, so nothing is left pending
+			reply_now(From, {error, cnode_down}, State)
+	end.
+
+-spec reply_now(From::{pid(), term()}, Reply::term(), State::#state{}) -> #state{}.
+%% @doc
+%% answers a request without sending it anywhere - timed like one
+%% answered by the C-Node.
+%% @end
+reply_now(From, Reply, State) ->
+	gen_server:reply(From, Reply),
+
+	case State#state.timing of
+		{Type, Sent} ->
+			record_metric(Type, total, erlang:monotonic_time(microsecond) - Sent);
+		undefined ->
+			ok
+	end,
+
+	State.
+
+-spec bus_arity(Command::atom()) -> pos_integer() | undefined.
+%% @doc
+%% requests with at least this many elements name their bus in the
+%% second one - the same as the bus_arity column of the C-Node's
+%% command table (open_bus, close_bus and set_bus always name it).
+%% @end
+bus_arity(open_bus) -> 2;
+bus_arity(close_bus) -> 2;
+bus_arity(set_bus) -> 2;
+bus_arity(read_byte) -> 5;
+bus_arity(write_byte) -> 5;
+bus_arity(transfer) -> 3;
+bus_arity(get_address) -> 2;
+bus_arity(set_address) -> 3;
+bus_arity(bus_info) -> 2;
+bus_arity(scan) -> 2;
+bus_arity(inventory) -> 2;
+bus_arity(register_map) -> 4;
+bus_arity(invalidate) -> 3;
+bus_arity(sync) -> 3;
+bus_arity(eeprom) -> 5;
+bus_arity(eeprom_read) -> 5;
+bus_arity(eeprom_write) -> 5;
+bus_arity(coalesce) -> 4;
+bus_arity(flush) -> 2;
+bus_arity(subscribe) -> 7;
+bus_arity(watch) -> 9;
+bus_arity(_) -> undefined.
+
+-spec request_bus(Message::tuple()) -> integer() | undefined.
+%% @doc
+%% the bus Message names - undefined if it goes to the current bus.
+%% @end
+request_bus(Message) ->
+	case bus_arity(element(1, Message)) of
+		Arity when is_integer(Arity) andalso tuple_size(Message) >= Arity ->
+			element(2, Message);
+		_ ->
+			undefined
+	end.
+
+-spec selected_bus(Message::tuple(), Current_Bus::integer()) -> integer().
+%% @doc
+%% the current bus after Message - the C-Nodes make the bus a request
+%% names the current one for the same commands, a batch for each of
+%% its commands in turn.
+%% @end
+selected_bus({batch, _Mode, Commands}, Current_Bus) when
+	is_list(Commands) ->
+	lists:foldl(fun selected_bus/2, Current_Bus, batch_commands(Commands));
+
+selected_bus(Message, Current_Bus) ->
+	case element(1, Message) of
+		Command when Command =:= open_bus; Command =:= set_bus;
+								 Command =:= read_byte; Command =:= write_byte;
+								 Command =:= set_address ->
+			case request_bus(Message) of
+				Bus_Number when is_integer(Bus_Number) -> Bus_Number;
+				_ -> Current_Bus
+			end;
+		_ ->
+			Current_Bus
+	end.
+
+-spec instance(Message::tuple(), State::#state{}) -> non_neg_integer() | mixed.
+%% @doc
+%% the C-Node Message goes to - the one serving the bus it names (or
+%% the current bus), unsubscribe to the one the subscription is on.
+%% A batch goes to the C-Node all its commands go to - mixed if they
+%% don't go to the same one, it can't be run by a single C-Node then.
+%% @end
+instance(_Message, #state{instances = 1}) ->
+	0;
+
+instance({batch, _Mode, Commands}, State) when
+	is_list(Commands) ->
+	% a command without a bus goes to the current bus as the commands
+	% before it in the batch left it
+	{Instances, _Current_Bus} =
+		lists:foldl(
+			fun(Command, {Acc, Current_Bus}) ->
+					{[instance(Command, State#state{current_bus = Current_Bus}) | Acc],
+					 selected_bus(Command, Current_Bus)}
+			end,
+			{[], State#state.current_bus}, batch_commands(Commands)),
+
+	case lists:usort(Instances) of
+		[] -> State#state.current_bus rem State#state.instances;
+		[Instance] -> Instance;
+		_ -> mixed
+	end;
+
+instance({unsubscribe, Subscription_Id}, State) when
+	is_integer(Subscription_Id) ->
+	Subscription_Id rem State#state.instances;
+
+instance({stats, _Reset, Bus_Number}, State) when
+	is_integer(Bus_Number) andalso Bus_Number >= 0 ->
+	Bus_Number rem State#state.instances;
+
+instance(Message, State) ->
+	case request_bus(Message) of
+		Bus_Number when is_integer(Bus_Number) andalso Bus_Number >= 0 ->
+			Bus_Number rem State#state.instances;
+		_ ->
+			State#state.current_bus rem State#state.instances
+	end.
+
+-spec batch_commands(Commands::list()) -> [tuple()].
+%% @doc
+%% the commands of a batch which can be routed - anything else is left
+%% to the C-Node to reject.
+%% @end
+batch_commands(Commands) ->
+	[Command || Command <- Commands, is_tuple(Command), tuple_size(Command) > 0,
+							is_atom(element(1, Command))].
+
+-spec gather_cnodes(Nodenames::[atom()], Message::tuple()) -> term().
+%% @doc
+%% sends Message to all Nodenames and joins their
+%% `{Command, ok, List}' replies - the first error is returned as is.
+%% @end
+gather_cnodes(Nodenames, Message) ->
+	Refs = [begin Ref = make_ref(), send_cnode(Nodename, Ref, Message), Ref end ||
+		Nodename <- Nodenames],
+
+	lists:foldl(
+		fun(Ref, {Command, ok, Acc}) ->
+				receive
+					{erl_i2c_cnode, Ref, {Command, ok, List}} -> {Command, ok, Acc ++ List};
+					{erl_i2c_cnode, Ref, Error} -> Error
+				after 5000 ->
+					{Command, error, timeout}
+				end;
+			 (_Ref, Error) ->
+				Error
+		end,
+		{element(1, Message), ok, []}, Refs).
+
+-spec reply_pending(
+				Key::reference() | non_neg_integer(),
+				Reply::term(),
+				State::#state{}) ->
+				#state{}.
+%% @doc
+%% answers the caller waiting for the request tagged with Key.
+%% @end
+reply_pending(Key, Reply, State) ->
+	Pending = State#state.pending,
+
+	case maps:take(Key, Pending) of
+		{{_Instance, From, Timing}, Pending_1} ->
+			gen_server:reply(From, Reply),
+
+			case Timing of
+				{Type, Sent, Forwarded} ->
+					Now = erlang:monotonic_time(microsecond),
+					record_metric(Type, wait, Now - Forwarded),
+					record_metric(Type, total, Now - Sent);
+				undefined ->
+					ok
+			end,
+
+			update_frontend_metrics(State#state{pending = Pending_1});
+
+		error ->
+			error_logger:warning_msg(
+				"reply for unknown request:~n~p~n", [Reply]),
+
+			State
+	end.
+
+-spec fail_pending(Instance::non_neg_integer(), State::#state{}) -> #state{}.
+%% @doc
+%% answers all callers waiting for C-Node Instance with `{error, cnode_down}'.
+%% @end
+fail_pending(Instance, State) ->
+	{Lost, Pending} =
+		maps:fold(
+			fun(Key, {I, From, _Timing}, {Lost_1, Pending_1}) when I =:= Instance ->
+					{[From | Lost_1], maps:remove(Key, Pending_1)};
+				 (_Key, _, Acc) ->
+					Acc
+			end,
+			{[], State#state.pending}, State#state.pending),
+
+	[gen_server:reply(From, {error, cnode_down}) || From <- Lost],
+
+	update_frontend_metrics(State#state{pending = Pending}).
+
+-spec forwarded(State::#state{}) -> {atom(), integer(), integer()} | undefined.
+%% @doc
+%% the Timing of a pending request - the timed request being handled
+%% is sent to the C-Node right now.
+%% @end
+forwarded(#state{timing = {Type, Sent}}) ->
+	{Type, Sent, erlang:monotonic_time(microsecond)};
+
+forwarded(#state{timing = undefined}) ->
+	undefined.
+
+-spec record_metric(Type::atom(), Phase::atom(), Microseconds::integer()) -> any().
+%% @doc
+%% counts one request of Type in the log2 bucket of Microseconds - one
+%% ets:update_counter/3, the row is created on first use.
+%% @end
+record_metric(Type, Phase, Microseconds) ->
+	Key = {Type, Phase},
+	Ops = [{2, 1}, {3, Microseconds}, {4 + bucket(Microseconds), 1}],
+
+	try
+		ets:update_counter(?METRICS, Key, Ops)
+	catch
+		error:badarg ->
+			catch ets:insert_new(
+							?METRICS,
+							erlang:make_tuple(3 + ?METRIC_BUCKETS, 0, [{1, Key}])),
+			catch ets:update_counter(?METRICS, Key, Ops)
+	end.
+
+-spec bucket(Microseconds::integer()) -> non_neg_integer().
+%% @doc
+%% bucket N > 0 counts 2^(N-1) up to 2^N - 1 microseconds, 0 counts 0.
+%% @end
+bucket(Microseconds) when Microseconds =< 0 ->
+	0;
+
+bucket(Microseconds) ->
+	bucket(Microseconds, 0).
+
+bucket(0, Bits) ->
+	min(Bits, ?METRIC_BUCKETS - 1);
+
+bucket(Microseconds, Bits) ->
+	bucket(Microseconds bsr 1, Bits + 1).
+
+bucket_floor(0) ->
+	0;
+
+bucket_floor(Bucket) ->
+	1 bsl (Bucket - 1).
+
+-spec update_frontend_metrics(State::#state{}) -> #state{}.
+%% @doc
+%% publishes mailbox length and requests in flight.
+%% @end
+update_frontend_metrics(State) ->
+	{message_queue_len, Mailbox_Len} = process_info(self(), message_queue_len),
+	Mailbox_Len_Max = max(Mailbox_Len, State#state.mailbox_len_max),
+
+	ets:insert(?METRICS,
+						 {frontend, Mailbox_Len, Mailbox_Len_Max, maps:size(State#state.pending)}),
+
+	State#state{mailbox_len_max = Mailbox_Len_Max}.
+
+-spec schedule_metrics_report() -> any().
+%% @doc
+%% `{metrics_interval, Milliseconds}' in the application environment
+%% has the metrics logged that often.
+%% @end
+schedule_metrics_report() ->
+	case application:get_env(?APP, metrics_interval) of
+		{ok, Interval} when is_integer(Interval) andalso Interval > 0 ->
+			erlang:send_after(Interval, self(), report_metrics);
+		_ ->
+			ok
 	end.
 
 -spec send_cnode(
 				Nodename::atom(),
+				Ref::reference(),
 				Message::term()) ->
 				any().
 %% @doc
 %%
 %% @end
-send_cnode(Nodename, Message) ->
-	{any, Nodename} ! {call, self(), Message}.
+send_cnode(Nodename, Ref, Message) ->
+	{any, Nodename} ! {call, self(), Ref, Message}.
 
 % vim:ft=erlang shiftwidth=2 tabstop=2 softtabstop=2
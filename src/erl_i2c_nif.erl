@@ -0,0 +1,30 @@
+%%% -------------------------------------------------------------------
+%%% @doc :
+%%% erl_i2c_nif runs the commands of erl_i2c_cnode as a NIF on the dirty
+%%% I/O schedulers - selected with `{backend, nif}' in the erl_i2c
+%%% application environment, see erl_i2c:call/2.
+%%% @end
+%%% -------------------------------------------------------------------
+-module(erl_i2c_nif).
+
+-define(APP, erl_i2c).
+
+-export([call/1]).
+
+-on_load(init/0).
+
+%% @doc
+%% loads priv/erl_i2c_nif.so.
+%% @end
+init() ->
+	erlang:load_nif(filename:join(code:priv_dir(?APP), "erl_i2c_nif"), 0).
+
+-spec call(Command::tuple()) -> term().
+%% @doc
+%% runs Command (the same tuples erl_i2c sends to the C-Node) in the
+%% calling process and returns the reply.
+%% @end
+call(_Command) ->
+	erlang:nif_error(nif_not_loaded).
+
+% vim:ft=erlang shiftwidth=2 tabstop=2 softtabstop=2